@@ -3,8 +3,10 @@
 //
 
 #include <string.h>
+#include <errno.h>
 #include "../lexicalParser/include/parser.h"
 #include "../vm/core.h"
+#include "../compiler/cache.h"
 
 #define MAX_LINE_LEN 1024
 
@@ -22,8 +24,8 @@
 #define OS "Unknown"
 #endif
 
-//执行脚本文件
-static void runFile(const char *path) {
+//以脚本path所在的目录为根目录，导入的模块都相对于它
+static void setRootDir(const char *path) {
     const char *lastSlash = strrchr(path, '/');
     if (lastSlash != NULL) {
         char *root = (char *) malloc(lastSlash - path + 2);
@@ -31,10 +33,43 @@ static void runFile(const char *path) {
         root[lastSlash - path + 1] = EOS;
         rootDir = root;
     }
+}
+
+//把选项值解析为非负整数，存在非数字字符、负号或超出uint64_t范围时返回false
+static bool parseCount(const char *arg, uint64_t *count) {
+    //strtoull会接受前导空白和负号，这里只认十进制数字开头
+    if (*arg < '0' || *arg > '9')
+        return false;
+    errno = 0;
+    char *endPtr;
+    unsigned long long value = strtoull(arg, &endPtr, 10);
+    if (errno == ERANGE || *endPtr != EOS)
+        return false;
+    *count = (uint64_t) value;
+    return true;
+}
+
+//执行脚本文件，useRegisterTier为true时以寄存器指令执行，instructionQuota和maxHeapSize为0表示不限制
+//useBytecodeCache为true时读写源码旁的.stvc字节码缓存，bundlePath不为NULL时先从该模块包中载入模块
+static VMResult runFile(const char *path, bool useRegisterTier, uint64_t instructionQuota, uint64_t maxHeapSize,
+                        bool useBytecodeCache, const char *bundlePath) {
+    setRootDir(path);
 
     VM *vm = newVM();
-    const char *sourceCode = readFile(path);
-    executeModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode);
+    if (bundlePath != NULL && (vm->bundle = openBundle(vm, bundlePath)) == NULL)
+        IO_ERROR("Couldn't open the bundle : \"%s\"", bundlePath);
+    vm->config.useRegisterTier = useRegisterTier;
+    vm->config.instructionQuota = instructionQuota;
+    vm->config.maxHeapSize = maxHeapSize;
+    vm->config.useBytecodeCache = useBytecodeCache;
+#if PROFILE_PAIRS
+    //脚本执行完后进程就退出，不会释放虚拟机，故在此输出统计
+    VMResult result = executeFile(vm, path);
+    dumpPairProfile(vm);
+    return result;
+#else
+    return executeFile(vm, path);
+#endif
 }
 
 //运行命令行
@@ -54,9 +89,46 @@ static void runCli(void) {
 }
 
 int main(int argc, const char **argv) {
-    if (argc == 1)
+    if (argc == 1) {
         runCli();
-    else
-        runFile(argv[1]);
-    return 0;
+        return 0;
+    }
+
+    //stove -o bundle a.stv b.stv ...把各脚本编译后打包，模块名相对于第一个脚本所在的目录
+    if (strcmp(argv[1], "-o") == 0 && argc > 3) {
+        setRootDir(argv[3]);
+        VM *vm = newVM();
+        VMResult result = buildBundle(vm, argv[2], argv + 3, argc - 3);
+        freeVM(vm);
+        return result == VM_RESULT_SUCCESS ? 0 : 1;
+    }
+
+    //选项：-r以寄存器指令执行，-q n限制每次执行的指令配额，-m n限制堆的字节数，-c使用字节码缓存，-b bundle使用模块包
+    bool useRegisterTier = false;
+    bool useBytecodeCache = false;
+    const char *bundlePath = NULL;
+    uint64_t instructionQuota = 0;
+    uint64_t maxHeapSize = 0;
+    int idx = 1;
+    while (idx < argc - 1) {
+        if (strcmp(argv[idx], "-r") == 0)
+            useRegisterTier = true;
+        else if (strcmp(argv[idx], "-c") == 0)
+            useBytecodeCache = true;
+        else if ((strcmp(argv[idx], "-q") == 0 || strcmp(argv[idx], "-m") == 0) && idx + 2 < argc) {
+            //非法的值不能悄悄当作0，否则就成了不限制
+            uint64_t *count = argv[idx][1] == 'q' ? &instructionQuota : &maxHeapSize;
+            if (!parseCount(argv[idx + 1], count)) {
+                fprintf(stderr, "invalid value for %s : \"%s\"\n", argv[idx], argv[idx + 1]);
+                return 1;
+            }
+            idx++;
+        }
+        else if (strcmp(argv[idx], "-b") == 0 && idx + 2 < argc)
+            bundlePath = argv[++idx];
+        else
+            break;
+        idx++;
+    }
+    return runFile(argv[idx], useRegisterTier, instructionQuota, maxHeapSize, useBytecodeCache, bundlePath) == VM_RESULT_SUCCESS ? 0 : 1;
 }
@@ -0,0 +1,929 @@
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../vm/core.h"
+#include "../objectAndClass/include/class.h"
+#include "../objectAndClass/include/obj_string.h"
+
+#if DEBUG
+#include "debug.h"
+#endif
+
+//缓存文件的格式，多字节整数一律按小端序存储：
+//文件头：魔数"STVC"，格式版本，编译选项标志，操作码个数，源码长度和源码的FNV-1a散列值，其后全部内容的散列值
+//模块变量名表：模块编译完成时的全部模块变量名，包括从核心模块继承的
+//方法名表：指令流中用到的方法名，指令流中的方法名索引都已改写为此表中的下标
+//函数树：模块函数，其常量表中的内层函数递归地跟在各自的位置上
+//指令流是校验之后、融合和翻译之前的，此时尚未被patchOperand回填，也没有快速化的指令
+
+#define CACHE_MAGIC "STVC"
+#define CACHE_FLAG_DEBUG 1 //DEBUG版的函数带有函数名，与非DEBUG版的缓存不通用
+#if DEBUG
+#define CACHE_FLAGS CACHE_FLAG_DEBUG
+#else
+#define CACHE_FLAGS 0
+#endif
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define CACHE_MAX_FUN_DEPTH 256 //函数嵌套层数的上限，避免损坏的缓存使载入时的递归过深
+
+//常量在缓存中的类型标记
+typedef enum {
+    CONST_NULL, //基类的占位符
+    CONST_FALSE,
+    CONST_TRUE,
+    CONST_NUM,
+    CONST_STRING,
+    CONST_FUN
+} ConstTag;
+
+typedef struct {
+    VM *vm;
+    ByteBuffer out;
+    int *methodMap; //全局方法名索引到缓存方法名表下标的映射，-1表示尚未用到，为NULL时保留全局索引
+    IntBuffer methodNames; //按下标顺序记录用到的全局方法名索引
+    bool ok; //常量表中有无法序列化的对象时置为false，不写缓存
+} CacheWriter;
+
+typedef struct {
+    VM *vm;
+    ObjModule *module;
+    const Byte *cur;
+    const Byte *end;
+    bool mapCode; //为true时函数的指令流直接指向所读的内容，不复制
+    bool ok; //读越界或内容不合法时置为false，之后的读取都返回0
+} CacheReader;
+
+//把length字节的data累加到FNV-1a散列值hash上，用于判断源码是否修改过和缓存是否损坏
+static uint64_t hashBytes(uint64_t hash, const void *data, uint32_t length) {
+    uint32_t idx = 0;
+    while (idx < length) {
+        hash ^= ((const Byte *) data)[idx++];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//第一个操作数是全局方法名索引的指令
+static bool hasMethodOperand(OpCode opCode) {
+    return (opCode >= OPCODE_ADD && opCode <= OPCODE_CALL_CLOSURE16) ||
+           opCode == OPCODE_INSTANCE_METHOD || opCode == OPCODE_STATIC_METHOD;
+}
+
+//源码路径对应的缓存路径，如a.stv对应a.stvc，由主调方释放
+char *getCachePath(const char *sourcePath) {
+    uint32_t length = strlen(sourcePath);
+    uint32_t extLength = strlen("." CACHE_FILE_EXT);
+    //源码以.stv结尾时只需补上c
+    bool hasSourceExt = length >= 4 && memcmp(sourcePath + length - 4, ".stv", 4) == 0;
+    uint32_t cacheLength = hasSourceExt ? length + 1 : length + extLength;
+    char *cachePath = (char *) malloc(cacheLength + 1);
+    if (cachePath == NULL)
+        MEM_ERROR("allocate memory for cache path failed.");
+    memcpy(cachePath, sourcePath, length);
+    if (hasSourceExt)
+        cachePath[length] = 'c';
+    else
+        memcpy(cachePath + length, "." CACHE_FILE_EXT, extLength);
+    cachePath[cacheLength] = EOS;
+    return cachePath;
+}
+
+static void writeU8(CacheWriter *writer, ByteBuffer *buf, uint8_t value) {
+    ByteBufferAdd(writer->vm, buf, value);
+}
+
+static void writeU32(CacheWriter *writer, ByteBuffer *buf, uint32_t value) {
+    int shift = 0;
+    while (shift < 32) {
+        ByteBufferAdd(writer->vm, buf, (Byte) (value >> shift));
+        shift += 8;
+    }
+}
+
+static void writeU64(CacheWriter *writer, ByteBuffer *buf, uint64_t value) {
+    writeU32(writer, buf, (uint32_t) value);
+    writeU32(writer, buf, (uint32_t) (value >> 32));
+}
+
+static void writeBytes(CacheWriter *writer, ByteBuffer *buf, const void *data, uint32_t length) {
+    uint32_t idx = 0;
+    while (idx < length)
+        ByteBufferAdd(writer->vm, buf, ((const Byte *) data)[idx++]);
+}
+
+static void writeString(CacheWriter *writer, ByteBuffer *buf, const char *str, uint32_t length) {
+    writeU32(writer, buf, length);
+    writeBytes(writer, buf, str, length);
+}
+
+//把全局方法名索引换成缓存方法名表的下标，首次用到的方法名追加到表尾
+static uint16_t getCacheMethodIndex(CacheWriter *writer, uint32_t methodIndex) {
+    if (writer->methodMap[methodIndex] == -1) {
+        writer->methodMap[methodIndex] = (int) writer->methodNames.count;
+        IntBufferAdd(writer->vm, &writer->methodNames, (int) methodIndex);
+    }
+    return (uint16_t) writer->methodMap[methodIndex];
+}
+
+//序列化函数fun，常量表中的内层函数递归地序列化
+static void writeFun(CacheWriter *writer, ObjFun *fun) {
+    ByteBuffer *out = &writer->out;
+    writeU32(writer, out, fun->maxStackSlotUsedNum);
+    writeU32(writer, out, fun->upvalueNum);
+    writeBytes(writer, out, fun->byValueUpvalues, (fun->upvalueNum + 7) / 8);
+    writeU8(writer, out, fun->argNum);
+    writeU32(writer, out, fun->inlineCacheNum);
+
+    //先原样写入指令流，再把其中的方法名索引就地改写为缓存中的下标
+    Byte *code = fun->instrStream.datas;
+    writeU32(writer, out, fun->instrStream.count);
+    uint32_t codeStart = out->count;
+    writeBytes(writer, out, code, fun->instrStream.count);
+    uint32_t ip = 0;
+    while (code[ip] != OPCODE_END) {
+        if (writer->methodMap != NULL && hasMethodOperand((OpCode) code[ip])) {
+            uint16_t cacheIndex = getCacheMethodIndex(writer, (code[ip + 1] << 8) | code[ip + 2]);
+            out->datas[codeStart + ip + 1] = (Byte) (cacheIndex >> 8);
+            out->datas[codeStart + ip + 2] = (Byte) cacheIndex;
+        }
+        ip += 1 + getBytesOfOperands(code, fun->constants.datas, (int) ip);
+    }
+
+    LineTable *lineTable = &fun->lineTable;
+    writeU32(writer, out, lineTable->firstLineNo);
+    writeU32(writer, out, lineTable->runLineNo);
+    writeU32(writer, out, lineTable->curLineNo);
+    writeU32(writer, out, lineTable->curBytes);
+    writeU32(writer, out, lineTable->runs.count);
+    writeBytes(writer, out, lineTable->runs.datas, lineTable->runs.count);
+
+#if DEBUG
+    const char *funName = fun->debug->funName == NULL ? "" : fun->debug->funName;
+    writeString(writer, out, funName, strlen(funName));
+#endif
+
+    writeU32(writer, out, fun->constants.count);
+    uint32_t idx = 0;
+    while (idx < fun->constants.count) {
+        Value constant = fun->constants.datas[idx++];
+        if (VALUE_IS_NULL(constant))
+            writeU8(writer, out, CONST_NULL);
+        else if (VALUE_IS_FALSE(constant))
+            writeU8(writer, out, CONST_FALSE);
+        else if (VALUE_IS_TRUE(constant))
+            writeU8(writer, out, CONST_TRUE);
+        else if (VALUE_IS_NUM(constant)) {
+            double num = VALUE_TO_NUM(constant);
+            uint64_t bits;
+            memcpy(&bits, &num, sizeof(bits));
+            writeU8(writer, out, CONST_NUM);
+            writeU64(writer, out, bits);
+        } else if (VALUE_IS_OBJSTR(constant)) {
+            ObjString *objString = VALUE_TO_OBJSTR(constant);
+            writeU8(writer, out, CONST_STRING);
+            writeString(writer, out, objString->value.start, objString->value.length);
+        } else if (VALUE_IS_OBJFUN(constant)) {
+            writeU8(writer, out, CONST_FUN);
+            writeFun(writer, VALUE_TO_OBJFUN(constant));
+        } else
+            writer->ok = false;
+    }
+}
+
+//写入模块objModule的全部模块变量名
+static void writeModuleVarNames(CacheWriter *writer, ByteBuffer *buf, ObjModule *objModule) {
+    writeU32(writer, buf, objModule->moduleVarName.count);
+    uint32_t idx = 0;
+    while (idx < objModule->moduleVarName.count) {
+        String *name = &objModule->moduleVarName.datas[idx++];
+        writeString(writer, buf, name->str, name->length);
+    }
+}
+
+//把parts中的partNum段内容依次写入文件path，先写到临时文件再改名，其他进程不会读到写了一半的文件
+static bool writeFileAtomically(const char *path, ByteBuffer *parts, uint32_t partNum) {
+    uint32_t pathLength = strlen(path);
+    char *tmpPath = (char *) malloc(pathLength + 5);
+    if (tmpPath == NULL)
+        MEM_ERROR("allocate memory for cache path failed.");
+    memcpy(tmpPath, path, pathLength);
+    memcpy(tmpPath + pathLength, ".tmp", 5);
+
+    //新建的文件组和其他用户不可写，否则载入时isCacheTrusted不会相信它
+    //先删掉上次残留的临时文件，O_EXCL保证写入的是自己新建的文件而不是别人预先放好的
+    bool written = false;
+    remove(tmpPath);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    FILE *file = fd == -1 ? NULL : fdopen(fd, "wb");
+    if (fd != -1 && file == NULL)
+        close(fd);
+    if (file != NULL) {
+        written = true;
+        uint32_t idx = 0;
+        while (written && idx < partNum) {
+            written = fwrite(parts[idx].datas, 1, parts[idx].count, file) == parts[idx].count;
+            idx++;
+        }
+        written = fclose(file) == 0 && written;
+        written = written && rename(tmpPath, path) == 0;
+        if (!written)
+            remove(tmpPath);
+    }
+    free(tmpPath);
+    return written;
+}
+
+//把刚编译出的模块函数fun写入缓存文件cachePath，必须在模块执行之前调用，执行时指令流会被回填和改写
+//缓存只是加速手段，写入失败时不报错
+void saveModuleCache(VM *vm, ObjModule *objModule, ObjFun *fun, const char *moduleCode, const char *cachePath) {
+    CacheWriter writer;
+    writer.vm = vm;
+    writer.ok = true;
+    ByteBufferInit(&writer.out);
+    IntBufferInit(&writer.methodNames);
+    uint32_t methodNum = vm->allMethodNames.count;
+    writer.methodMap = ALLOCATE_ARRAY(vm, int, methodNum);
+    uint32_t idx = 0;
+    while (idx < methodNum)
+        writer.methodMap[idx++] = -1;
+
+    //先序列化函数树，才知道用到了哪些方法名
+    writeFun(&writer, fun);
+
+    ByteBuffer head;
+    ByteBufferInit(&head);
+    writeBytes(&writer, &head, CACHE_MAGIC, 4);
+    writeU32(&writer, &head, CACHE_FORMAT_VERSION);
+    writeU32(&writer, &head, CACHE_FLAGS);
+    writeU32(&writer, &head, OPCODE_END);
+    uint32_t codeLength = strlen(moduleCode);
+    writeU32(&writer, &head, codeLength);
+    writeU64(&writer, &head, hashBytes(FNV_OFFSET_BASIS, moduleCode, codeLength));
+
+    ByteBuffer tables;
+    ByteBufferInit(&tables);
+    writeModuleVarNames(&writer, &tables, objModule);
+
+    writeU32(&writer, &tables, writer.methodNames.count);
+    idx = 0;
+    while (idx < writer.methodNames.count) {
+        String *name = &vm->allMethodNames.datas[writer.methodNames.datas[idx++]];
+        writeString(&writer, &tables, name->str, name->length);
+    }
+    uint64_t checksum = hashBytes(FNV_OFFSET_BASIS, tables.datas, tables.count);
+    writeU64(&writer, &head, hashBytes(checksum, writer.out.datas, writer.out.count));
+
+    if (writer.ok) {
+        ByteBuffer parts[] = {head, tables, writer.out};
+        writeFileAtomically(cachePath, parts, 3);
+    }
+
+    ByteBufferClear(vm, &head);
+    ByteBufferClear(vm, &tables);
+    ByteBufferClear(vm, &writer.out);
+    IntBufferClear(vm, &writer.methodNames);
+    DEALLOCATE_ARRAY(vm, writer.methodMap, methodNum);
+}
+
+static uint8_t readU8(CacheReader *reader) {
+    if (!reader->ok || reader->end - reader->cur < 1) {
+        reader->ok = false;
+        return 0;
+    }
+    return *reader->cur++;
+}
+
+static uint32_t readU32(CacheReader *reader) {
+    if (!reader->ok || reader->end - reader->cur < 4) {
+        reader->ok = false;
+        return 0;
+    }
+    const Byte *bytes = reader->cur;
+    reader->cur += 4;
+    return (uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) | ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+static uint64_t readU64(CacheReader *reader) {
+    uint64_t low = readU32(reader);
+    return low | ((uint64_t) readU32(reader) << 32);
+}
+
+//返回缓存中length字节的起始地址，不足length字节时返回NULL
+static const Byte *readBytes(CacheReader *reader, uint32_t length) {
+    if (!reader->ok || (uint64_t) (reader->end - reader->cur) < length) {
+        reader->ok = false;
+        return NULL;
+    }
+    const Byte *bytes = reader->cur;
+    reader->cur += length;
+    return bytes;
+}
+
+static const char *readString(CacheReader *reader, uint32_t *length) {
+    *length = readU32(reader);
+    return (const char *) readBytes(reader, *length);
+}
+
+//从缓存复制length字节到新分配的buffer中
+static void readByteBuffer(CacheReader *reader, ByteBuffer *buf, uint32_t length) {
+    const Byte *bytes = readBytes(reader, length);
+    if (bytes == NULL || length == 0)
+        return;
+    buf->datas = ALLOCATE_ARRAY(reader->vm, Byte, length);
+    memcpy(buf->datas, bytes, length);
+    buf->count = buf->capacity = length;
+}
+
+//读出一个函数，parent为NULL时是模块函数，将其加入临时根，否则存入parent常量表的第constIdx项
+//新建的对象一创建就可达，读取过程中触发gc也不会被回收
+static ObjFun *readFun(CacheReader *reader, ObjFun *parent, uint32_t constIdx, int depth) {
+    VM *vm = reader->vm;
+    if (depth > CACHE_MAX_FUN_DEPTH)
+        reader->ok = false;
+
+    uint32_t maxStackSlotUsedNum = readU32(reader);
+    uint32_t upvalueNum = readU32(reader);
+    const Byte *byValueUpvalues = upvalueNum <= MAX_UPVALUE_NUM ? readBytes(reader, (upvalueNum + 7) / 8) : NULL;
+    uint8_t argNum = readU8(reader);
+    uint32_t inlineCacheNum = readU32(reader);
+    uint32_t codeLength = readU32(reader);
+    //调用点索引只占2字节，栈上限不会超过指令数加局部变量和参数的上限，超出的是损坏的缓存，避免据此分配过多内存
+    if (!reader->ok || upvalueNum > MAX_UPVALUE_NUM || argNum > MAX_ARG_NUM || inlineCacheNum > UINT16_MAX + 1 ||
+        codeLength == 0 || maxStackSlotUsedNum > codeLength + MAX_LOCAL_VAR_NUM + MAX_ARG_NUM) {
+        reader->ok = false;
+        return NULL;
+    }
+
+    ObjFun *fun = newObjFun(vm, reader->module, maxStackSlotUsedNum);
+    if (parent == NULL)
+        pushTmpRoot(vm, (ObjHeader *) fun);
+    else
+        parent->constants.datas[constIdx] = OBJ_TO_VALUE(fun);
+    fun->upvalueNum = upvalueNum;
+    memcpy(fun->byValueUpvalues, byValueUpvalues, (upvalueNum + 7) / 8);
+    fun->argNum = argNum;
+    fun->inlineCacheNum = inlineCacheNum;
+    if (reader->mapCode) {
+        //指令流留在映射的bundle中，bundle在虚拟机释放时才解除映射
+        Byte *code = (Byte *) readBytes(reader, codeLength);
+        if (code != NULL) {
+            fun->instrStream.datas = code;
+            fun->instrStream.count = codeLength;
+            fun->isCodeMapped = true;
+        }
+    } else
+        readByteBuffer(reader, &fun->instrStream, codeLength);
+
+    LineTable *lineTable = &fun->lineTable;
+    lineTable->firstLineNo = readU32(reader);
+    lineTable->runLineNo = readU32(reader);
+    lineTable->curLineNo = readU32(reader);
+    lineTable->curBytes = readU32(reader);
+    //行号表每段2字节
+    uint32_t runsLength = readU32(reader);
+    if (runsLength % 2 != 0)
+        reader->ok = false;
+    readByteBuffer(reader, &lineTable->runs, runsLength);
+
+#if DEBUG
+    uint32_t nameLength;
+    const char *funName = readString(reader, &nameLength);
+    if (funName != NULL)
+        bindDebugFunName(vm, fun->debug, funName, nameLength);
+#endif
+
+    //每个常量至少占1字节，据此排除过大的常量个数；先用null占满常量表，读出的常量就地存入
+    uint32_t constantNum = readU32(reader);
+    if (!reader->ok || constantNum > (uint64_t) (reader->end - reader->cur)) {
+        reader->ok = false;
+        return fun;
+    }
+    if (constantNum > 0)
+        ValueBufferFillWrite(vm, &fun->constants, VT_TO_VALUE(VT_NULL), constantNum);
+    uint32_t idx = 0;
+    while (reader->ok && idx < constantNum) {
+        switch (readU8(reader)) {
+            case CONST_NULL:
+                break;
+            case CONST_FALSE:
+                fun->constants.datas[idx] = VT_TO_VALUE(VT_FALSE);
+                break;
+            case CONST_TRUE:
+                fun->constants.datas[idx] = VT_TO_VALUE(VT_TRUE);
+                break;
+            case CONST_NUM: {
+                uint64_t bits = readU64(reader);
+                double num;
+                memcpy(&num, &bits, sizeof(num));
+                fun->constants.datas[idx] = NUM_TO_VALUE(num);
+                break;
+            }
+            case CONST_STRING: {
+                uint32_t length;
+                const char *str = readString(reader, &length);
+                if (str != NULL)
+                    fun->constants.datas[idx] = OBJ_TO_VALUE(newObjString(vm, str, length));
+                break;
+            }
+            case CONST_FUN:
+                readFun(reader, fun, idx, depth + 1);
+                break;
+            default:
+                reader->ok = false;
+                break;
+        }
+        idx++;
+    }
+    return fun;
+}
+
+//校验函数树中的每个函数，同编译时一样
+static bool verifyFunTree(VM *vm, ObjFun *fun, bool isModule) {
+    uint32_t errorIp;
+    if (verifyFun(vm, fun, isModule, &errorIp) != NULL)
+        return false;
+    uint32_t idx = 0;
+    while (idx < fun->constants.count) {
+        if (VALUE_IS_OBJFUN(fun->constants.datas[idx]) &&
+            !verifyFunTree(vm, VALUE_TO_OBJFUN(fun->constants.datas[idx]), false))
+            return false;
+        idx++;
+    }
+    return true;
+}
+
+//把校验过的函数树中的方法名下标换回本虚拟机的全局方法名索引
+static bool remapMethodIndex(ObjFun *fun, const int *methodIndexes, uint32_t methodNum) {
+    Byte *code = fun->instrStream.datas;
+    uint32_t ip = 0;
+    while (code[ip] != OPCODE_END) {
+        OpCode opCode = (OpCode) code[ip];
+        //缓存的是融合之前的指令流
+        if (opCode > OPCODE_END)
+            return false;
+        if (hasMethodOperand(opCode)) {
+            uint32_t cacheIndex = (code[ip + 1] << 8) | code[ip + 2];
+            if (cacheIndex >= methodNum)
+                return false;
+            code[ip + 1] = (Byte) (methodIndexes[cacheIndex] >> 8);
+            code[ip + 2] = (Byte) methodIndexes[cacheIndex];
+        }
+        ip += 1 + getBytesOfOperands(code, fun->constants.datas, (int) ip);
+    }
+
+    uint32_t idx = 0;
+    while (idx < fun->constants.count) {
+        if (VALUE_IS_OBJFUN(fun->constants.datas[idx]) &&
+            !remapMethodIndex(VALUE_TO_OBJFUN(fun->constants.datas[idx]), methodIndexes, methodNum))
+            return false;
+        idx++;
+    }
+    return true;
+}
+
+//删掉载入缓存时新定义的模块变量，使模块变量表恢复到varNum个，随后重新编译时不会报重定义
+static void truncateModuleVars(VM *vm, ObjModule *objModule, uint32_t varNum) {
+    while (objModule->moduleVarName.count > varNum)
+        memManager(vm, objModule->moduleVarName.datas[--objModule->moduleVarName.count].str, 0, 0);
+    objModule->moduleVarValue.count = varNum;
+}
+
+//检查模块变量名表，已有的模块变量是从核心模块继承的，必须与表中的前缀一致，指令流中的模块变量索引才能沿用
+//返回表中名字的个数，表中的名字稍后由defineModuleVarNames定义
+static uint32_t checkModuleVarNames(CacheReader *reader, ObjModule *objModule) {
+    uint32_t varNum = readU32(reader);
+    uint32_t oldVarNum = objModule->moduleVarName.count;
+    if (varNum < oldVarNum)
+        reader->ok = false;
+    uint32_t idx = 0;
+    while (reader->ok && idx < varNum) {
+        uint32_t length;
+        const char *name = readString(reader, &length);
+        if (name == NULL || length == 0 || length > MAX_ID_LEN ||
+            (idx < oldVarNum && (objModule->moduleVarName.datas[idx].length != length ||
+                                 memcmp(objModule->moduleVarName.datas[idx].str, name, length) != 0)))
+            reader->ok = false;
+        idx++;
+    }
+    return varNum;
+}
+
+//把从varNames开始的varNum个名字中模块尚未定义的定义为模块变量，编译时定义的模块变量初值都是null
+//名字重复时定义出的变量个数不足varNum，返回false
+static bool defineModuleVarNames(CacheReader *reader, ObjModule *objModule, const Byte *varNames, uint32_t varNum) {
+    //varNames指向名字表开头的个数
+    reader->cur = varNames;
+    readU32(reader);
+    uint32_t idx = objModule->moduleVarName.count;
+    while (idx-- > 0) {
+        uint32_t length;
+        readString(reader, &length);
+    }
+    idx = objModule->moduleVarName.count;
+    while (idx < varNum) {
+        uint32_t length;
+        const char *name = readString(reader, &length);
+        defineModuleVar(reader->vm, objModule, name, length, VT_TO_VALUE(VT_NULL));
+        idx++;
+    }
+    return objModule->moduleVarName.count == varNum;
+}
+
+//缓存是否可信：必须是普通文件，属主与源码的属主相同，且组和其他用户不可写
+//别人放在源码旁的缓存会被当作指令流执行，不能只凭散列值相信它
+static bool isCacheTrusted(int fd, const char *sourcePath) {
+    struct stat cacheStat;
+    struct stat sourceStat;
+    if (fstat(fd, &cacheStat) != 0 || stat(sourcePath, &sourceStat) != 0)
+        return false;
+    return S_ISREG(cacheStat.st_mode) && cacheStat.st_uid == sourceStat.st_uid &&
+           (cacheStat.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+//读取源码sourcePath的缓存文件的全部内容，文件不存在、不可信或读取失败时返回NULL
+static Byte *readCacheFile(const char *cachePath, const char *sourcePath, uint32_t *length) {
+    FILE *file = fopen(cachePath, "rb");
+    if (file == NULL)
+        return NULL;
+    //对打开的文件检查，检查之后文件被替换也不影响所读的内容
+    if (!isCacheTrusted(fileno(file), sourcePath)) {
+        fclose(file);
+        return NULL;
+    }
+    Byte *content = NULL;
+    long fileSize;
+    if (fseek(file, 0, SEEK_END) == 0 && (fileSize = ftell(file)) > 0 && fileSize <= UINT32_MAX &&
+        fseek(file, 0, SEEK_SET) == 0 && (content = (Byte *) malloc(fileSize)) != NULL) {
+        if (fread(content, 1, fileSize, file) == (size_t) fileSize)
+            *length = (uint32_t) fileSize;
+        else {
+            free(content);
+            content = NULL;
+        }
+    }
+    fclose(file);
+    return content;
+}
+
+//从源码sourcePath的缓存cachePath载入模块objModule的模块函数，缓存不存在、不可信、已过期或不合法时返回NULL，由主调方重新编译
+//载入的函数与刚编译出的一样，还要经prepareFunToRun才能执行
+ObjFun *loadModuleCache(VM *vm, ObjModule *objModule, const char *moduleCode, const char *sourcePath,
+                        const char *cachePath) {
+    uint32_t fileLength;
+    Byte *content = readCacheFile(cachePath, sourcePath, &fileLength);
+    if (content == NULL)
+        return NULL;
+
+    CacheReader reader;
+    reader.vm = vm;
+    reader.module = objModule;
+    reader.cur = content;
+    reader.end = content + fileLength;
+    reader.mapCode = false;
+    reader.ok = true;
+
+    //文件头不符说明缓存来自别的版本或选项，或者源码已修改
+    uint32_t codeLength = strlen(moduleCode);
+    const Byte *magic = readBytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0 || readU32(&reader) != CACHE_FORMAT_VERSION ||
+        readU32(&reader) != CACHE_FLAGS || readU32(&reader) != OPCODE_END ||
+        readU32(&reader) != codeLength || readU64(&reader) != hashBytes(FNV_OFFSET_BASIS, moduleCode, codeLength)) {
+        free(content);
+        return NULL;
+    }
+    //散列值不符说明缓存已损坏
+    uint64_t checksum = readU64(&reader);
+    if (!reader.ok || checksum != hashBytes(FNV_OFFSET_BASIS, reader.cur, reader.end - reader.cur)) {
+        free(content);
+        return NULL;
+    }
+
+    uint32_t oldVarNum = objModule->moduleVarName.count;
+    const Byte *varNames = reader.cur;
+    uint32_t varNum = checkModuleVarNames(&reader, objModule);
+
+    //记下方法名表的位置，函数树读完之后再登记到vm->allMethodNames
+    uint32_t methodNum = readU32(&reader);
+    const Byte *methodNames = reader.cur;
+    uint32_t idx = 0;
+    while (reader.ok && idx < methodNum) {
+        uint32_t length;
+        readString(&reader, &length);
+        idx++;
+    }
+
+    ObjFun *fun = NULL;
+    if (reader.ok)
+        fun = readFun(&reader, NULL, 0, 0);
+    if (fun == NULL) {
+        free(content);
+        return NULL;
+    }
+
+    int *methodIndexes = NULL;
+    if (reader.ok && reader.cur == reader.end) {
+        bool defined = defineModuleVarNames(&reader, objModule, varNames, varNum);
+
+        reader.cur = methodNames;
+        methodIndexes = ALLOCATE_ARRAY(vm, int, methodNum);
+        idx = 0;
+        while (idx < methodNum) {
+            uint32_t length;
+            const char *name = readString(&reader, &length);
+            methodIndexes[idx++] = ensureSymbolExist(vm, &vm->allMethodNames, name, length);
+        }
+
+        //缓存可能被篡改，与编译出的指令流一样要先通过校验
+        //换回全局方法名索引之后才能核对调用的参数个数与方法签名，故再校验一次
+        if (!defined || !verifyFunTree(vm, fun, true) ||
+            !remapMethodIndex(fun, methodIndexes, methodNum) || !verifyFunTree(vm, fun, true)) {
+            truncateModuleVars(vm, objModule, oldVarNum);
+            reader.ok = false;
+        }
+        DEALLOCATE_ARRAY(vm, methodIndexes, methodNum);
+    } else
+        reader.ok = false;
+
+    popTmpRoot(vm);
+    free(content);
+    return reader.ok ? fun : NULL;
+}
+
+//模块包的格式，多字节整数同样按小端序存储：
+//文件头：魔数"STVB"，格式版本，编译选项标志，操作码个数
+//方法名表：打包时虚拟机的全部方法名，载入后本虚拟机的方法名索引与之相同，指令流不必改写
+//索引表：按模块名排序的定长索引项，每项是模块名和模块数据的位置、长度及模块数据的散列值
+//模块名和模块数据：模块数据是模块变量名表和函数树，指令流是融合过超级指令的，载入时先核对散列值再校验
+
+#define BUNDLE_MAGIC "STVB"
+#define BUNDLE_ENTRY_SIZE 24 //索引项依次是4字节的模块名偏移、模块名长度、数据偏移、数据长度和8字节的散列值
+
+void initBundleWriter(BundleWriter *writer) {
+    ByteBufferInit(&writer->data);
+    StringBufferInit(&writer->names);
+    IntBufferInit(&writer->offsets);
+}
+
+void freeBundleWriter(VM *vm, BundleWriter *writer) {
+    ByteBufferClear(vm, &writer->data);
+    symbolTableClear(vm, &writer->names);
+    IntBufferClear(vm, &writer->offsets);
+}
+
+//把已经过prepareFunToRun的模块函数fun以模块名name加入模块包，模块名重复或有无法序列化的常量时返回false
+bool addBundleModule(VM *vm, BundleWriter *writer, const char *name, uint32_t length, ObjModule *objModule, ObjFun *fun) {
+    if (length == 0 || getIndexFromSymbolTable(&writer->names, name, length) != -1)
+        return false;
+
+    //方法名索引保留为全局索引
+    CacheWriter cacheWriter;
+    cacheWriter.vm = vm;
+    cacheWriter.out = writer->data;
+    cacheWriter.methodMap = NULL;
+    cacheWriter.ok = true;
+    uint32_t offset = cacheWriter.out.count;
+    writeModuleVarNames(&cacheWriter, &cacheWriter.out, objModule);
+    writeFun(&cacheWriter, fun);
+    writer->data = cacheWriter.out;
+    if (!cacheWriter.ok) {
+        writer->data.count = offset;
+        return false;
+    }
+
+    addSymbol(vm, &writer->names, name, length);
+    IntBufferAdd(vm, &writer->offsets, (int) offset);
+    return true;
+}
+
+//按字节序比较模块名，较短的名字是较长者的前缀时较短者在前
+static int compareModuleName(const char *name1, uint32_t length1, const char *name2, uint32_t length2) {
+    int result = memcmp(name1, name2, length1 < length2 ? length1 : length2);
+    if (result != 0)
+        return result;
+    return length1 < length2 ? -1 : (length1 > length2 ? 1 : 0);
+}
+
+static int compareBundleName(const void *a, const void *b) {
+    const String *name1 = *(String *const *) a;
+    const String *name2 = *(String *const *) b;
+    return compareModuleName(name1->str, name1->length, name2->str, name2->length);
+}
+
+//把模块包写入文件bundlePath，失败时返回false
+bool saveBundle(VM *vm, BundleWriter *writer, const char *bundlePath) {
+    CacheWriter cacheWriter;
+    cacheWriter.vm = vm;
+    uint32_t moduleNum = writer->names.count;
+
+    ByteBuffer head;
+    ByteBufferInit(&head);
+    writeBytes(&cacheWriter, &head, BUNDLE_MAGIC, 4);
+    writeU32(&cacheWriter, &head, BUNDLE_FORMAT_VERSION);
+    writeU32(&cacheWriter, &head, CACHE_FLAGS);
+    writeU32(&cacheWriter, &head, OPCODE_END);
+    writeU32(&cacheWriter, &head, vm->allMethodNames.count);
+    uint32_t idx = 0;
+    while (idx < vm->allMethodNames.count) {
+        String *name = &vm->allMethodNames.datas[idx++];
+        writeString(&cacheWriter, &head, name->str, name->length);
+    }
+    writeU32(&cacheWriter, &head, moduleNum);
+
+    //索引项按模块名排序，载入时二分查找
+    String **sorted = ALLOCATE_ARRAY(vm, String *, moduleNum);
+    uint64_t namesLength = 0;
+    for (idx = 0; idx < moduleNum; idx++) {
+        sorted[idx] = &writer->names.datas[idx];
+        namesLength += sorted[idx]->length;
+    }
+    if (moduleNum > 0)
+        qsort(sorted, moduleNum, sizeof(String *), compareBundleName);
+
+    uint64_t namesStart = head.count + (uint64_t) BUNDLE_ENTRY_SIZE * moduleNum;
+    uint64_t dataStart = namesStart + namesLength;
+    bool saved = dataStart + writer->data.count <= UINT32_MAX;
+    uint32_t nameOffset = (uint32_t) namesStart;
+    for (idx = 0; saved && idx < moduleNum; idx++) {
+        uint32_t moduleIdx = sorted[idx] - writer->names.datas;
+        uint32_t dataOffset = writer->offsets.datas[moduleIdx];
+        uint32_t dataEnd = moduleIdx + 1 < moduleNum ? (uint32_t) writer->offsets.datas[moduleIdx + 1] : writer->data.count;
+        writeU32(&cacheWriter, &head, nameOffset);
+        writeU32(&cacheWriter, &head, sorted[idx]->length);
+        writeU32(&cacheWriter, &head, (uint32_t) dataStart + dataOffset);
+        writeU32(&cacheWriter, &head, dataEnd - dataOffset);
+        writeU64(&cacheWriter, &head, hashBytes(FNV_OFFSET_BASIS, writer->data.datas + dataOffset, dataEnd - dataOffset));
+        nameOffset += sorted[idx]->length;
+    }
+    for (idx = 0; saved && idx < moduleNum; idx++)
+        writeBytes(&cacheWriter, &head, sorted[idx]->str, sorted[idx]->length);
+    DEALLOCATE_ARRAY(vm, sorted, moduleNum);
+
+    if (saved) {
+        ByteBuffer parts[] = {head, writer->data};
+        saved = writeFileAtomically(bundlePath, parts, 2);
+    }
+    ByteBufferClear(vm, &head);
+    return saved;
+}
+
+//打开模块包bundlePath并映射到内存，文件不合法或与本虚拟机的方法名表冲突时返回NULL
+//须在编译任何模块之前打开，此时本虚拟机只有核心模块的方法名，是模块包方法名表的前缀
+Bundle *openBundle(VM *vm, const char *bundlePath) {
+    int fd = open(bundlePath, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0 || (uint64_t) fileStat.st_size > UINT32_MAX) {
+        close(fd);
+        return NULL;
+    }
+    //私有映射：打包的指令流中父类的属性索引要在运行时回填，写时只复制被写的页，其余的页与其他进程共享
+    size_t size = (size_t) fileStat.st_size;
+    Byte *base = (Byte *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    CacheReader reader;
+    reader.vm = vm;
+    reader.module = NULL;
+    reader.cur = base;
+    reader.end = base + size;
+    reader.mapCode = true;
+    reader.ok = true;
+
+    const Byte *magic = readBytes(&reader, 4);
+    reader.ok = magic != NULL && memcmp(magic, BUNDLE_MAGIC, 4) == 0 && readU32(&reader) == BUNDLE_FORMAT_VERSION &&
+                readU32(&reader) == CACHE_FLAGS && readU32(&reader) == OPCODE_END;
+
+    //先检查方法名表，全部合法后再把本虚拟机缺少的方法名按序补上
+    uint32_t methodNum = readU32(&reader);
+    const Byte *methodNames = reader.cur;
+    if (methodNum < vm->allMethodNames.count || methodNum > UINT16_MAX + 1)
+        reader.ok = false;
+    uint32_t idx = 0;
+    while (reader.ok && idx < methodNum) {
+        uint32_t length;
+        const char *name = readString(&reader, &length);
+        if (name == NULL || length == 0 ||
+            (idx < vm->allMethodNames.count && (vm->allMethodNames.datas[idx].length != length ||
+                                                memcmp(vm->allMethodNames.datas[idx].str, name, length) != 0)))
+            reader.ok = false;
+        idx++;
+    }
+
+    //索引项中的位置都要落在文件内
+    uint32_t moduleNum = readU32(&reader);
+    const Byte *index = reader.cur;
+    if (moduleNum > (size_t) (reader.end - reader.cur) / BUNDLE_ENTRY_SIZE)
+        reader.ok = false;
+    idx = 0;
+    while (reader.ok && idx < moduleNum) {
+        uint64_t nameOffset = readU32(&reader);
+        uint64_t nameLength = readU32(&reader);
+        uint64_t dataOffset = readU32(&reader);
+        uint64_t dataLength = readU32(&reader);
+        readU64(&reader);
+        if (nameOffset + nameLength > size || dataOffset + dataLength > size)
+            reader.ok = false;
+        idx++;
+    }
+
+    if (!reader.ok) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    reader.cur = methodNames;
+    idx = 0;
+    while (idx < methodNum) {
+        uint32_t length;
+        const char *name = readString(&reader, &length);
+        if (idx >= vm->allMethodNames.count)
+            addSymbol(vm, &vm->allMethodNames, name, length);
+        idx++;
+    }
+
+    Bundle *bundle = ALLOCATE(vm, Bundle);
+    bundle->base = base;
+    bundle->size = size;
+    bundle->index = index;
+    bundle->moduleNum = moduleNum;
+    return bundle;
+}
+
+//解除模块包的映射，指令流在其中的函数都已释放
+void closeBundle(VM *vm, Bundle *bundle) {
+    munmap(bundle->base, bundle->size);
+    DEALLOCATE(vm, bundle);
+}
+
+//读出索引项第offset字节起的4字节
+static uint32_t getEntryU32(const Byte *entry, uint32_t offset) {
+    return (uint32_t) entry[offset] | ((uint32_t) entry[offset + 1] << 8) |
+           ((uint32_t) entry[offset + 2] << 16) | ((uint32_t) entry[offset + 3] << 24);
+}
+
+//二分查找模块名为name的索引项，没有时返回NULL
+static const Byte *findBundleEntry(Bundle *bundle, const char *name, uint32_t length) {
+    uint32_t low = 0;
+    uint32_t high = bundle->moduleNum;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const Byte *entry = bundle->index + mid * BUNDLE_ENTRY_SIZE;
+        int result = compareModuleName(name, length, (const char *) bundle->base + getEntryU32(entry, 0),
+                                       getEntryU32(entry, 4));
+        if (result == 0)
+            return entry;
+        if (result < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+bool hasBundleModule(Bundle *bundle, const char *name, uint32_t length) {
+    return findBundleEntry(bundle, name, length) != NULL;
+}
+
+//从模块包中载入模块name的模块函数，指令流不复制，直接在映射的页上执行
+//模块不在包中或数据已损坏时返回NULL，载入的函数还要经prepareFunToRun才能执行
+ObjFun *loadBundleModule(VM *vm, ObjModule *objModule, Bundle *bundle, const char *name, uint32_t length) {
+    const Byte *entry = findBundleEntry(bundle, name, length);
+    if (entry == NULL)
+        return NULL;
+    const Byte *data = bundle->base + getEntryU32(entry, 8);
+    uint32_t dataLength = getEntryU32(entry, 12);
+    uint64_t checksum = getEntryU32(entry, 16) | ((uint64_t) getEntryU32(entry, 20) << 32);
+    if (checksum != hashBytes(FNV_OFFSET_BASIS, data, dataLength))
+        return NULL;
+
+    CacheReader reader;
+    reader.vm = vm;
+    reader.module = objModule;
+    reader.cur = data;
+    reader.end = data + dataLength;
+    reader.mapCode = true;
+    reader.ok = true;
+
+    const Byte *varNames = reader.cur;
+    uint32_t oldVarNum = objModule->moduleVarName.count;
+    uint32_t varNum = checkModuleVarNames(&reader, objModule);
+    ObjFun *fun = reader.ok ? readFun(&reader, NULL, 0, 0) : NULL;
+    if (fun == NULL)
+        return NULL;
+
+    //校验和只能发现意外损坏，包可能被人为构造，与字节码缓存一样要先通过校验，融合后的栈式指令也能校验
+    if (!reader.ok || reader.cur != reader.end || !defineModuleVarNames(&reader, objModule, varNames, varNum) ||
+        !verifyFunTree(vm, fun, true)) {
+        truncateModuleVars(vm, objModule, oldVarNum);
+        reader.ok = false;
+    }
+    popTmpRoot(vm);
+    return reader.ok ? fun : NULL;
+}
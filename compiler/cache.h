@@ -0,0 +1,41 @@
+#ifndef STOVE_CACHE_H
+#define STOVE_CACHE_H
+
+#include "compiler.h"
+
+//字节码缓存文件的扩展名，与源码文件同目录，如a.stv的缓存是a.stvc
+#define CACHE_FILE_EXT "stvc"
+//缓存格式的版本号，序列化的内容有变化时加1，旧版本的缓存会被忽略
+#define CACHE_FORMAT_VERSION 2
+//模块包格式的版本号
+#define BUNDLE_FORMAT_VERSION 2
+
+//模块包，多个编译好的模块打包成的单个文件，映射到内存后按模块名查找
+struct bundle {
+    Byte *base; //映射的起址
+    size_t size; //文件大小
+    const Byte *index; //按模块名排序的索引表
+    uint32_t moduleNum;
+};
+
+//正在生成的模块包
+typedef struct {
+    ByteBuffer data; //各模块的数据依次相接
+    SymbolTable names; //各模块的模块名
+    IntBuffer offsets; //各模块的数据在data中的起始偏移
+} BundleWriter;
+
+char *getCachePath(const char *sourcePath);
+ObjFun *loadModuleCache(VM *vm, ObjModule *objModule, const char *moduleCode, const char *sourcePath,
+                        const char *cachePath);
+void saveModuleCache(VM *vm, ObjModule *objModule, ObjFun *fun, const char *moduleCode, const char *cachePath);
+void initBundleWriter(BundleWriter *writer);
+void freeBundleWriter(VM *vm, BundleWriter *writer);
+bool addBundleModule(VM *vm, BundleWriter *writer, const char *name, uint32_t length, ObjModule *objModule, ObjFun *fun);
+bool saveBundle(VM *vm, BundleWriter *writer, const char *bundlePath);
+Bundle *openBundle(VM *vm, const char *bundlePath);
+void closeBundle(VM *vm, Bundle *bundle);
+bool hasBundleModule(Bundle *bundle, const char *name, uint32_t length);
+ObjFun *loadBundleModule(VM *vm, ObjModule *objModule, Bundle *bundle, const char *name, uint32_t length);
+
+#endif //STOVE_CACHE_H
@@ -11,6 +11,23 @@
 #include "debug.h"
 #endif
 
+//编译状态的快照，常量折叠时据此丢弃已生成的指令
+typedef struct {
+    uint32_t instrNum; //指令流长度
+    uint32_t constantNum; //常量表长度
+    uint32_t stackSlotNum;
+    uint32_t inlineCacheNum;
+    uint32_t callEndIndex;
+    LineTable lineTable; //行号表的段只会追加，恢复时只用其计数和标量
+} CompileMark;
+
+//最近生成的常量表达式，其指令是从mark.instrNum到end的一条装载常量的指令
+typedef struct {
+    Value value;
+    CompileMark mark;
+    uint32_t end;
+} ConstExpr;
+
 struct compileUnit {
     ObjFun *fun; //所编译的函数
     LocalVar localVars[MAX_LOCAL_VAR_NUM]; //作用域中允许的局部变量的个数上限
@@ -18,6 +35,12 @@ struct compileUnit {
     Upvalue upvalues[MAX_UPVALUE_NUM]; //记录本层函数所引用的upvalue
     int scopeDepth; //此项表示当前正在编译的代码所处的作用域
     uint32_t stackSlotNum; //当前使用的slot个数
+    uint32_t callEndIndex; //最近一条方法调用指令之后的指令流位置，用于识别return后的尾调用
+    //内层函数引用本单元局部变量时，记下CREATE_CLOSURE中捕获方式字节的位置和它是内层函数的第几个upvalue，每处占2项
+    //待变量离开作用域时回填
+    IntBuffer captureSites;
+    ConstExpr lastConstExpr; //最近生成的常量表达式，用于常量折叠
+    uint32_t exprStart; //调用led方法前设置为左操作数的指令起始位置，led据此判断左操作数是否为常量
     Loop *curLoop; //当前正在编译的循环层
     ClassBookKeep *enclosingClassBK; //当前正在编译的类的编译信息
     struct compileUnit *enclosingUnit; //包含此编译单元的编译单元，即直接外层
@@ -118,6 +141,7 @@ static void initCompileUnit(Parser *parser, CompileUnit *cu, CompileUnit *enclos
         //第0个局部变量的特殊性使其作用域为模块级别
         cu->localVars[0].scopeDepth = -1;
         cu->localVars[0].isUpvalue = false;
+        cu->localVars[0].isReassigned = false;
         cu->localVarNum = 1; //localVars[0]被分配
         //对于函数和方法来说，初始作用域就是局部作用域
         //0表示局部作用域的最外层
@@ -126,15 +150,18 @@ static void initCompileUnit(Parser *parser, CompileUnit *cu, CompileUnit *enclos
 
     //局部变量保存在栈中，初始时栈中已使用的slot数量等于局部变量的数量
     cu->stackSlotNum = cu->localVarNum;
+    cu->callEndIndex = 0;
+    IntBufferInit(&cu->captureSites);
+    //end不可能等于指令流长度，初始时没有常量表达式
+    cu->lastConstExpr.end = UINT32_MAX;
+    cu->exprStart = 0;
     cu->fun = newObjFun(cu->curParser->vm, cu->curParser->curModule, cu->localVarNum);
 }
 
 //往函数的指令流中写入1个字节，返回其索引
 static int writeByte(CompileUnit *cu, int byte) {
-    //若在调试状态，额外在debug->lineNo中写入当前token行号
-#if DEBUG
-    IntBufferAdd(cu->curParser->vm, &cu->fun->debug->lineNo, cu->curParser->preToken.lineNo);
-#endif
+    //在行号表中记下当前token的行号
+    lineTableAdd(cu->curParser->vm, &cu->fun->lineTable, cu->curParser->preToken.lineNo);
     ByteBufferAdd(cu->curParser->vm, &cu->fun->instrStream, (uint8_t) byte);
     return cu->fun->instrStream.count - 1;
 }
@@ -171,6 +198,13 @@ static void writeOpCodeShortOperand(CompileUnit *cu, OpCode opCode, int operand)
     writeShortOperand(cu, operand);
 }
 
+//写入CALLx指令的内联缓存索引，每个调用点在函数的内联缓存表中独占一项
+static void writeInlineCacheOperand(CompileUnit *cu) {
+    if (cu->fun->inlineCacheNum > UINT16_MAX)
+        COMPILE_ERROR(cu->curParser, "the number of call sites exceeds %d.", UINT16_MAX + 1);
+    writeShortOperand(cu, cu->fun->inlineCacheNum++);
+}
+
 //在模块objModule中定义名为name，值为value的模块变量
 int defineModuleVar(VM *vm, ObjModule *objModule, const char *name, uint32_t length, Value value) {
     if (length > MAX_ID_LEN) {
@@ -302,10 +336,124 @@ static void emitLoadConstant(CompileUnit *cu, Value value) {
     writeOpCodeShortOperand(cu, OPCODE_LOAD_CONSTANT, index);
 }
 
+//记录当前的编译状态
+static void saveCompileMark(CompileUnit *cu, CompileMark *mark) {
+    mark->instrNum = cu->fun->instrStream.count;
+    mark->constantNum = cu->fun->constants.count;
+    mark->stackSlotNum = cu->stackSlotNum;
+    mark->inlineCacheNum = cu->fun->inlineCacheNum;
+    mark->callEndIndex = cu->callEndIndex;
+    mark->lineTable = cu->fun->lineTable;
+}
+
+//退回到mark记录的编译状态，丢弃其后生成的指令和常量
+static void rewindToMark(CompileUnit *cu, CompileMark *mark) {
+    cu->fun->instrStream.count = mark->instrNum;
+    cu->fun->constants.count = mark->constantNum;
+    cu->stackSlotNum = mark->stackSlotNum;
+    cu->fun->inlineCacheNum = mark->inlineCacheNum;
+    cu->callEndIndex = mark->callEndIndex;
+
+    LineTable *lineTable = &cu->fun->lineTable;
+    lineTable->runs.count = mark->lineTable.runs.count;
+    lineTable->firstLineNo = mark->lineTable.firstLineNo;
+    lineTable->runLineNo = mark->lineTable.runLineNo;
+    lineTable->curLineNo = mark->lineTable.curLineNo;
+    lineTable->curBytes = mark->lineTable.curBytes;
+}
+
+//生成装载常量value的指令，并记为最近的常量表达式
+static void emitConstExpr(CompileUnit *cu, Value value) {
+    ConstExpr *constExpr = &cu->lastConstExpr;
+    saveCompileMark(cu, &constExpr->mark);
+    if (VALUE_IS_TRUE(value))
+        writeOpCode(cu, OPCODE_PUSH_TRUE);
+    else if (VALUE_IS_FALSE(value))
+        writeOpCode(cu, OPCODE_PUSH_FALSE);
+    else if (VALUE_IS_NULL(value))
+        writeOpCode(cu, OPCODE_PUSH_NULL);
+    else
+        emitLoadConstant(cu, value);
+    constExpr->value = value;
+    constExpr->end = cu->fun->instrStream.count;
+}
+
+//从start开始到指令流末尾恰好是一个常量表达式时返回true，并把它复制到constExpr
+static bool getConstExpr(CompileUnit *cu, uint32_t start, ConstExpr *constExpr) {
+    ConstExpr *last = &cu->lastConstExpr;
+    if (last->mark.instrNum != start || last->end != cu->fun->instrStream.count)
+        return false;
+    *constExpr = *last;
+    return true;
+}
+
+//在编译期对以常量为参数的调用求值，结果存入args[0]
+//只求值数字、字符串、bool和null的原生方法，这些核心类不能被脚本重新打开，原生方法不会被覆盖
+//所求值的原生方法都没有副作用，且按参数类型筛选过，不会出现运行时错误
+static bool evalConstCall(VM *vm, OpCode opCode, uint32_t methodIndex, Value *args) {
+    Class *class = getClassOfObj(vm, args[0]);
+    if (class != vm->numClass && class != vm->stringClass && class != vm->boolClass && class != vm->nullClass)
+        return false;
+
+    switch (opCode) {
+        case OPCODE_CALL0:
+        case OPCODE_NEG:
+        case OPCODE_BIT_NOT:
+        case OPCODE_EQ:
+        case OPCODE_NEQ:
+            //这些类无参的原生方法和相等比较对任何参数都不会出错
+            break;
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_LT:
+        case OPCODE_LE:
+        case OPCODE_GT:
+        case OPCODE_GE:
+        case OPCODE_BIT_AND:
+        case OPCODE_BIT_OR:
+        case OPCODE_BIT_SHIFT_LEFT:
+        case OPCODE_BIT_SHIFT_RIGHT:
+            //其余运算符的原生方法要求右操作数和左操作数同类，否则报运行时错误
+            if (getClassOfObj(vm, args[1]) != class)
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    Method *method = findMethod(vm, class, methodIndex);
+    if (method == NULL || method->methodType != MT_PRIMITIVE || !method->primFun(vm, args))
+        return false;
+    //..生成的range、type返回的类等不能作为常量
+    return VALUE_IS_NUM(args[0]) || VALUE_IS_TRUE(args[0]) || VALUE_IS_FALSE(args[0]) ||
+           VALUE_IS_NULL(args[0]) || VALUE_IS_OBJSTR(args[0]);
+}
+
+//callStart处是刚生成的以常量为参数的调用指令，能在编译期求值时，
+//丢弃从mark开始的操作数和调用指令，改为装载结果的指令
+static void foldConstCall(CompileUnit *cu, CompileMark *mark, Value *args, uint32_t callStart) {
+    //调用指令的操作数是2字节的方法名索引和2字节的内联缓存索引，后面不能再有参数或块参数
+    if (cu->fun->instrStream.count != callStart + 5)
+        return;
+    //编译核心模块时数字等核心类还未绑定原生方法，不折叠
+    if (cu->curParser->curModule->name == NULL)
+        return;
+    Byte *code = cu->fun->instrStream.datas;
+    uint32_t methodIndex = (code[callStart + 1] << 8) | code[callStart + 2];
+    //求值时操作数仍在常量表中，不会被gc回收
+    if (!evalConstCall(cu->curParser->vm, (OpCode) code[callStart], methodIndex, args))
+        return;
+    rewindToMark(cu, mark);
+    emitConstExpr(cu, args[0]);
+}
+
 //数字和字符串.nud() 编译字面量
 static void literal(CompileUnit *cu, bool canAssign UNUSED) {
     //literal是常量（数字和字符串）的nud方法，用来返回字面值
-    emitLoadConstant(cu, cu->curParser->preToken.value);
+    emitConstExpr(cu, cu->curParser->preToken.value);
 }
 
 //通过签名编译方法调用，包括callX和superX指令
@@ -314,17 +462,27 @@ static void emitCallBySignature(CompileUnit *cu, Signature *signature, OpCode op
     uint32_t length = signToString(signature, signBuffer);
     //确保签名录入到vm->allMethodNames中
     int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, signBuffer, length);
+
+    //形如f.call(...)的调用多数是在调用闭包，改用CALL_CLOSUREx，运行时receiver是闭包就不必查找方法
+    if (opCode == OPCODE_CALL0 && signature->signatureType == SIGN_METHOD &&
+        signature->length == 4 && memcmp(signature->name, "call", 4) == 0)
+        opCode = OPCODE_CALL_CLOSURE0;
     writeOpCodeShortOperand(cu, opCode + signature->argNum, symbolIndex);
 
     //此时在常量表中预创建一个空slot占位，将来绑定方法时再装入基类
     if (opCode == OPCODE_SUPER0)
         writeShortOperand(cu, addConstant(cu, VT_TO_VALUE(VT_NULL)));
+    else
+        writeInlineCacheOperand(cu);
+    cu->callEndIndex = cu->fun->instrStream.count;
 }
 
 //生成方法调用的指令，仅限callX指令
 static void emitCall(CompileUnit *cu, int numArgs, const char *name, int length) {
     int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, name, length);
     writeOpCodeShortOperand(cu, OPCODE_CALL0 + numArgs, symbolIndex);
+    writeInlineCacheOperand(cu);
+    cu->callEndIndex = cu->fun->instrStream.count;
 }
 
 //添加局部变量到cu
@@ -334,6 +492,7 @@ static uint32_t addLocalVar(CompileUnit *cu, const char *name, uint32_t length)
     var->length = length;
     var->scopeDepth = cu->scopeDepth;
     var->isUpvalue = false;
+    var->isReassigned = false;
     return cu->localVarNum++;
 }
 
@@ -384,10 +543,70 @@ static void enterScope(CompileUnit *cu) {
     cu->scopeDepth++;
 }
 
+//把已编译完的函数fun的第upvalueIdx个upvalue改为按值捕获，读取它的LOAD_UPVALUE改为LOAD_CAPTURED
+//该变量不会再被赋值，指令流中没有对它的STORE_UPVALUE，继承它的内层函数也递归地改为按值捕获
+static void captureUpvalueByValue(ObjFun *fun, uint32_t upvalueIdx) {
+    fun->byValueUpvalues[upvalueIdx >> 3] |= (uint8_t) (1 << (upvalueIdx & 7));
+    Byte *code = fun->instrStream.datas;
+    uint32_t ip = 0;
+    while (code[ip] != OPCODE_END) {
+        ASSERT(code[ip] != OPCODE_STORE_UPVALUE || code[ip + 1] != upvalueIdx, "upvalue captured by value is reassigned.");
+        if (code[ip] == OPCODE_LOAD_UPVALUE && code[ip + 1] == upvalueIdx)
+            code[ip] = OPCODE_LOAD_CAPTURED;
+        else if (code[ip] == OPCODE_CREATE_CLOSURE) {
+            ObjFun *innerFun = VALUE_TO_OBJFUN(fun->constants.datas[(code[ip + 1] << 8) | code[ip + 2]]);
+            uint32_t idx = 0;
+            while (idx < innerFun->upvalueNum) {
+                if (code[ip + 3 + idx * 2] == CAPTURE_UPVALUE && code[ip + 4 + idx * 2] == upvalueIdx)
+                    captureUpvalueByValue(innerFun, idx);
+                idx++;
+            }
+        }
+        ip += 1 + getBytesOfOperands(code, fun->constants.datas, (int) ip);
+    }
+}
+
+//回填引用了局部变量localIdx的CREATE_CLOSURE，若该变量定义后再未被赋值就改为按值捕获，返回是否改成了按值捕获
+//localIdx为-1时回填本单元剩余的全部捕获
+static bool captureLocalVarByValue(CompileUnit *cu, int localIdx) {
+    Byte *instrStream = cu->fun->instrStream.datas;
+    bool byValue = localIdx == -1 || !cu->localVars[localIdx].isReassigned;
+    uint32_t idx = 0;
+    uint32_t remain = 0;
+    while (idx < cu->captureSites.count) {
+        int site = cu->captureSites.datas[idx];
+        int upvalueIdx = cu->captureSites.datas[idx + 1];
+        idx += 2;
+        //捕获方式字节之后是局部变量的索引
+        int varIdx = instrStream[site + 1];
+        if (localIdx == -1 || varIdx == localIdx) {
+            if (!cu->localVars[varIdx].isReassigned) {
+                instrStream[site] = CAPTURE_LOCAL_VAR_BY_VALUE;
+                //各对捕获参数之前是2字节的函数常量索引
+                int funIdx = (instrStream[site - upvalueIdx * 2 - 2] << 8) | instrStream[site - upvalueIdx * 2 - 1];
+                captureUpvalueByValue(VALUE_TO_OBJFUN(cu->fun->constants.datas[funIdx]), upvalueIdx);
+            }
+        } else {
+            cu->captureSites.datas[remain++] = site;
+            cu->captureSites.datas[remain++] = upvalueIdx;
+        }
+    }
+    cu->captureSites.count = remain;
+    return byValue;
+}
+
 //退出作用域
 static void leaveScope(CompileUnit *cu) {
-    //对于非模块编译单元，丢弃局部变量
-    if (cu->enclosingUnit != NULL) {
+    //模块作用域之内的代码块也有局部变量，离开时同样要丢弃
+    if (cu->scopeDepth > -1) {
+        //变量的所有赋值都已编译，按值捕获的变量不必再关闭upvalue
+        int localIdx = (int) cu->localVarNum - 1;
+        while (localIdx >= 0 && cu->localVars[localIdx].scopeDepth >= cu->scopeDepth) {
+            if (cu->localVars[localIdx].isUpvalue && captureLocalVarByValue(cu, localIdx))
+                cu->localVars[localIdx].isUpvalue = false;
+            localIdx--;
+        }
+
         //出作用域后丢弃本作用域以内的局部变量
         uint32_t discardNum = discardLocalVar(cu, cu->scopeDepth);
         cu->localVarNum -= discardNum;
@@ -659,16 +878,27 @@ static void emitLoadVariable(CompileUnit *cu, Variable var) {
     }
 }
 
+//upvalue被赋值时，沿外层函数找到它最初引用的局部变量并标记为被赋值过
+static void markUpvalueReassigned(CompileUnit *cu, uint32_t upvalueIdx) {
+    Upvalue *upvalue = &cu->upvalues[upvalueIdx];
+    if (upvalue->isEnclosingLocalVar)
+        cu->enclosingUnit->localVars[upvalue->index].isReassigned = true;
+    else
+        markUpvalueReassigned(cu->enclosingUnit, upvalue->index);
+}
+
 //为变量var生成存储的指令
 static void emitStoreVariable(CompileUnit *cu, Variable var) {
     switch (var.scopeType) {
         case VAR_SCOPE_LOCAL:
             //生成存储到局部变量的指令
             writeOpCodeByteOperand(cu, OPCODE_STORE_LOCAL_VAR, var.index);
+            cu->localVars[var.index].isReassigned = true;
             break;
         case VAR_SCOPE_UPVALUE:
             //生成存储到upvalue的指令
             writeOpCodeByteOperand(cu, OPCODE_STORE_UPVALUE, var.index);
+            markUpvalueReassigned(cu, var.index);
             break;
         case VAR_SCOPE_MODULE:
             //生成存储模块变量的指令
@@ -729,6 +959,23 @@ static ObjFun *endCompileUnit(CompileUnit *cu) {
 #endif
     //标识单元编译结束
     writeOpCode(cu, OPCODE_END);
+
+    //函数最外层作用域的局部变量不经leaveScope，在此回填对它们的捕获
+    captureLocalVarByValue(cu, -1);
+    IntBufferClear(cu->curParser->vm, &cu->captureSites);
+
+    //模块编译单元结束时已不会被grayCompileUnit标记，故临时保护fun
+    VM *vm = cu->curParser->vm;
+    pushTmpRoot(vm, (ObjHeader *) cu->fun);
+
+    //融合和翻译之前校验指令流，执行时不再检查校验已证明的性质
+    //融合、翻译和分配内联缓存留给prepareFunToRun，使字节码缓存保存的是未经改写的指令流
+    uint32_t errorIp;
+    const char *error = verifyFun(vm, cu->fun, cu->enclosingUnit == NULL, &errorIp);
+    if (error != NULL)
+        COMPILE_ERROR(cu->curParser, "bytecode verification failed at %d: %s.", errorIp, error);
+    popTmpRoot(vm);
+
     if (cu->enclosingUnit != NULL) {
         //把当前编译的objFun作为常量添加到父编译单元的常量表
         uint32_t index = addConstant(cu->enclosingUnit, OBJ_TO_VALUE(cu->fun));
@@ -738,7 +985,13 @@ static ObjFun *endCompileUnit(CompileUnit *cu) {
         //为vm在创建闭包时判断引用的是局部变量还是upvalue，下面为每个upvalue生成参数
         index = 0;
         while (index < cu->fun->upvalueNum) {
-            writeByte(cu->enclosingUnit, cu->upvalues[index].isEnclosingLocalVar ? 1 : 0);
+            if (cu->upvalues[index].isEnclosingLocalVar) {
+                //是否按值捕获要等该局部变量离开作用域、确知其是否再被赋值时回填
+                IntBufferAdd(cu->curParser->vm, &cu->enclosingUnit->captureSites,
+                             writeByte(cu->enclosingUnit, CAPTURE_LOCAL_VAR));
+                IntBufferAdd(cu->curParser->vm, &cu->enclosingUnit->captureSites, (int) index);
+            } else
+                writeByte(cu->enclosingUnit, CAPTURE_UPVALUE);
             writeByte(cu->enclosingUnit, cu->upvalues[index].index);
             index++;
         }
@@ -942,13 +1195,12 @@ static void stringInterpolation(CompileUnit *cu, bool canAssign UNUSED) {
 //编译bool
 static void boolean(CompileUnit *cu, bool canAssign UNUSED) {
     //true和false的nud方法
-    OpCode opCode = cu->curParser->preToken.tokenType == TOKEN_TRUE ? OPCODE_PUSH_TRUE : OPCODE_PUSH_FALSE;
-    writeOpCode(cu, opCode);
+    emitConstExpr(cu, BOOL_TO_VALUE(cu->curParser->preToken.tokenType == TOKEN_TRUE));
 }
 
 //生成OPCODE_PUSH_NULL指令
 static void null(CompileUnit *cu, bool canAssign UNUSED) {
-    writeOpCode(cu, OPCODE_PUSH_NULL);
+    emitConstExpr(cu, VT_TO_VALUE(VT_NULL));
 }
 
 //"self".nud()
@@ -1040,9 +1292,17 @@ static void subscriptMethodSignature(CompileUnit *cu, Signature *signature) {
 //'.'.led()，编译方法调用，所有调用的入口
 static void callEntry(CompileUnit *cu, bool canAssign) {
     //本函数是'.'.led()，curToken是TOKEN_ID
+    ConstExpr receiver;
+    bool isConst = getConstExpr(cu, cu->exprStart, &receiver);
     consumeCurToken(cu->curParser, TOKEN_ID, "expect method name after '.'.");
     //生成方法调用指令
     emitMethodCall(cu, cu->curParser->preToken.start, cu->curParser->preToken.length, OPCODE_CALL0, canAssign);
+
+    //常量的无参方法调用，如2.sqrt和"abc".count，尝试在编译期求值
+    if (isConst) {
+        Value args[2] = {receiver.value, VT_TO_VALUE(VT_NULL)};
+        foldConstCall(cu, &receiver.mark, args, receiver.end);
+    }
 }
 
 //map对象字面量
@@ -1289,42 +1549,124 @@ static void expression(CompileUnit *cu, BindPower rbp) {
     //进入expression时，curToken为操作数w，preToken是运算符S
     DenotationFun nud = Rules[cu->curParser->curToken.tokenType].nud;
 
-    //表达式开头的要么是操作数要么是前缀运算符，必然有nud方法
-    ASSERT(nud != NULL, "nud is NULL.");
+    //表达式开头的要么是操作数要么是前缀运算符，必然有nud方法，否则是缺少操作数
+    if (nud == NULL)
+        COMPILE_ERROR(cu->curParser, "expect expression.");
     getNextToken(cu->curParser); //执行后curToken为运算符T
     bool canAssign = rbp < BP_ASSIGN;
+    uint32_t start = cu->fun->instrStream.count;
     nud(cu, canAssign); //计算操作数w的值
 
     while (rbp < Rules[cu->curParser->curToken.tokenType].lbp) {
         DenotationFun led = Rules[cu->curParser->curToken.tokenType].led;
         getNextToken(cu->curParser); //执行后curToken为e
+        cu->exprStart = start; //此前从start开始的指令都是led的左操作数
         led(cu, canAssign); //计算运算符T.led方法
     }
 }
 
+//获取中缀运算符对应的专用指令，没有专用指令的返回OPCODE_CALL0
+static OpCode getInfixOpCode(TokenType tokenType) {
+    switch (tokenType) {
+        case TOKEN_ADD:
+            return OPCODE_ADD;
+        case TOKEN_SUB:
+            return OPCODE_SUB;
+        case TOKEN_MUL:
+            return OPCODE_MUL;
+        case TOKEN_DIV:
+            return OPCODE_DIV;
+        case TOKEN_MOD:
+            return OPCODE_MOD;
+        case TOKEN_LESS:
+            return OPCODE_LT;
+        case TOKEN_LESS_EQUAL:
+            return OPCODE_LE;
+        case TOKEN_MORE:
+            return OPCODE_GT;
+        case TOKEN_MORE_EQUAL:
+            return OPCODE_GE;
+        case TOKEN_EQUAL:
+            return OPCODE_EQ;
+        case TOKEN_NOT_EQUAL:
+            return OPCODE_NEQ;
+        case TOKEN_BIT_AND:
+            return OPCODE_BIT_AND;
+        case TOKEN_BIT_OR:
+            return OPCODE_BIT_OR;
+        case TOKEN_BIT_SHIFT_LEFT:
+            return OPCODE_BIT_SHIFT_LEFT;
+        case TOKEN_BIT_SHIFT_RIGHT:
+            return OPCODE_BIT_SHIFT_RIGHT;
+        case TOKEN_IS:
+            return OPCODE_IS;
+        default:
+            return OPCODE_CALL0;
+    }
+}
+
 //中缀运算符.led方法
 static void infixOperator(CompileUnit *cu, bool canAssign UNUSED) {
     SymbolBindRule *rule = &Rules[cu->curParser->preToken.tokenType];
+    OpCode opCode = getInfixOpCode(cu->curParser->preToken.tokenType);
+
+    ConstExpr lhs, rhs;
+    bool isConst = getConstExpr(cu, cu->exprStart, &lhs);
+    uint32_t rhsStart = cu->fun->instrStream.count;
 
     //中缀运算符对左右操作数的绑定权值一样
     BindPower rbp = rule->lbp;
     expression(cu, rbp); //解析右操作数
+    isConst = isConst && getConstExpr(cu, rhsStart, &rhs);
 
     //生成一个参数的签名
     Signature signature = {SIGN_METHOD, rule->id, strlen(rule->id), 1};
-    emitCallBySignature(cu, &signature, OPCODE_CALL0);
+    if (opCode == OPCODE_CALL0) {
+        emitCallBySignature(cu, &signature, OPCODE_CALL0);
+        return;
+    }
+
+    //专用指令的操作数和CALL1一样是方法名索引和内联缓存索引，不满足快速路径的条件时vm据此回退到方法调用
+    char signBuffer[MAX_SIGN_LEN];
+    uint32_t length = signToString(&signature, signBuffer);
+    int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, signBuffer, length);
+    writeOpCodeShortOperand(cu, opCode, symbolIndex);
+    writeInlineCacheOperand(cu);
+
+    //两个操作数都是常量时尝试在编译期求值，如60 * 60 * 24和"a" + "b"
+    if (isConst) {
+        Value args[2] = {lhs.value, rhs.value};
+        foldConstCall(cu, &lhs.mark, args, rhs.end);
+    }
 }
 
 //前缀运算符.nud方法，-,!等
 static void unaryOperator(CompileUnit *cu, bool canAssign UNUSED) {
     SymbolBindRule *rule = &Rules[cu->curParser->preToken.tokenType];
+    TokenType tokenType = cu->curParser->preToken.tokenType;
+    uint32_t operandStart = cu->fun->instrStream.count;
 
     //BP_UNARY作为rbp去调用expression解析右操作数
     expression(cu, BP_UNARY);
+    ConstExpr operand;
+    bool isConst = getConstExpr(cu, operandStart, &operand);
+
+    //-和~有对应的数字运算指令，操作数同样是方法名索引
+    if (tokenType == TOKEN_SUB || tokenType == TOKEN_BIT_NOT) {
+        int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, rule->id, 1);
+        writeOpCodeShortOperand(cu, tokenType == TOKEN_SUB ? OPCODE_NEG : OPCODE_BIT_NOT, symbolIndex);
+        writeInlineCacheOperand(cu);
+    } else {
+        //生成调用前缀运算符的指令
+        //0个参数，前缀运算符都是1个字符，长度为1
+        emitCall(cu, 0, rule->id, 1);
+    }
 
-    //生成调用前缀运算符的指令
-    //0个参数，前缀运算符都是1个字符，长度为1
-    emitCall(cu, 0, rule->id, 1);
+    //操作数是常量时尝试在编译期求值，如-1和!true
+    if (isConst) {
+        Value args[2] = {operand.value, VT_TO_VALUE(VT_NULL)};
+        foldConstCall(cu, &operand.mark, args, operand.end);
+    }
 }
 
 //编译变量定义
@@ -1364,6 +1706,8 @@ static void compileVarDefinition(CompileUnit *cu, bool isStatic) {
                 if (matchToken(cu->curParser, TOKEN_ASSIGN)) {
                     expression(cu, BP_LOWEST);
                     emitStoreVariable(cu, var);
+                    //初始值已存入静态域，弹出栈顶，否则类体中的局部变量与栈中的slot错位
+                    writeOpCode(cu, OPCODE_POP);
                 }
             } else
                 COMPILE_ERROR(cu->curParser, "static field '%s' redefinition.", strchr(staticFieldId, ' ') + 1);
@@ -1449,6 +1793,7 @@ uint32_t getBytesOfOperands(Byte *instrStream, Value *constants, int ip) {
     switch ((OpCode) instrStream[ip]) {
         case OPCODE_CONSTRUCT:
         case OPCODE_RETURN:
+        case OPCODE_TAIL_RETURN:
         case OPCODE_END:
         case OPCODE_CLOSE_UPVALUE:
         case OPCODE_PUSH_NULL:
@@ -1458,6 +1803,9 @@ uint32_t getBytesOfOperands(Byte *instrStream, Value *constants, int ip) {
             return 0;
 
         case OPCODE_CREATE_CLASS:
+        case OPCODE_LOAD_LOCAL_VAR_CONSTANT:
+        case OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR:
+        case OPCODE_STORE_LOCAL_VAR_POP:
         case OPCODE_LOAD_SELF_FIELD:
         case OPCODE_STORE_SELF_FIELD:
         case OPCODE_LOAD_FIELD:
@@ -1466,28 +1814,62 @@ uint32_t getBytesOfOperands(Byte *instrStream, Value *constants, int ip) {
         case OPCODE_STORE_LOCAL_VAR:
         case OPCODE_LOAD_UPVALUE:
         case OPCODE_STORE_UPVALUE:
+        case OPCODE_LOAD_CAPTURED:
+        case OPCODE_REG_SET_TOP:
+        case OPCODE_REG_LOAD_NULL:
+        case OPCODE_REG_LOAD_TRUE:
+        case OPCODE_REG_LOAD_FALSE:
+        case OPCODE_REG_RETURN:
             return 1;
 
-        case OPCODE_CALL0:
-        case OPCODE_CALL1:
-        case OPCODE_CALL2:
-        case OPCODE_CALL3:
-        case OPCODE_CALL4:
-        case OPCODE_CALL5:
-        case OPCODE_CALL6:
-        case OPCODE_CALL7:
-        case OPCODE_CALL8:
-        case OPCODE_CALL9:
-        case OPCODE_CALL10:
-        case OPCODE_CALL11:
-        case OPCODE_CALL12:
-        case OPCODE_CALL13:
-        case OPCODE_CALL14:
-        case OPCODE_CALL15:
-        case OPCODE_CALL16:
+        case OPCODE_REG_MOVE:
+        case OPCODE_REG_LOAD_UPVALUE:
+        case OPCODE_REG_STORE_UPVALUE:
+        case OPCODE_REG_LOAD_CAPTURED:
+            //寄存器指令：1字节的目的slot和1字节的源slot或upvalue索引
+            return 2;
+
+        case OPCODE_REG_LOAD_CONSTANT:
+        case OPCODE_REG_LOAD_MODULE_VAR:
+        case OPCODE_REG_STORE_MODULE_VAR:
+        case OPCODE_REG_JUMP_IF_FALSE:
+            //寄存器指令：1字节的slot和2字节的常量索引、模块变量索引或跳转偏移量
+            return 3;
+
+        case OPCODE_REG_NEG:
+        case OPCODE_REG_BIT_NOT:
+            //1字节的目的slot，1字节的操作数slot和2字节的方法名索引
+            return 4;
+
+        case OPCODE_REG_ADD:
+        case OPCODE_REG_SUB:
+        case OPCODE_REG_MUL:
+        case OPCODE_REG_DIV:
+        case OPCODE_REG_MOD:
+        case OPCODE_REG_LT:
+        case OPCODE_REG_LE:
+        case OPCODE_REG_GT:
+        case OPCODE_REG_GE:
+        case OPCODE_REG_EQ:
+        case OPCODE_REG_NEQ:
+        case OPCODE_REG_BIT_AND:
+        case OPCODE_REG_BIT_OR:
+        case OPCODE_REG_BIT_SHIFT_LEFT:
+        case OPCODE_REG_BIT_SHIFT_RIGHT:
+        case OPCODE_REG_LT_JUMP_IF_FALSE:
+        case OPCODE_REG_LE_JUMP_IF_FALSE:
+        case OPCODE_REG_GT_JUMP_IF_FALSE:
+        case OPCODE_REG_GE_JUMP_IF_FALSE:
+        case OPCODE_REG_EQ_JUMP_IF_FALSE:
+        case OPCODE_REG_NEQ_JUMP_IF_FALSE:
+            //1字节的目的slot，2个1字节的操作数slot和2字节的方法名索引
+            return 5;
+
         case OPCODE_LOAD_CONSTANT:
         case OPCODE_LOAD_MODULE_VAR:
         case OPCODE_STORE_MODULE_VAR:
+        case OPCODE_LOAD_MODULE_VAR_CONSTANT:
+        case OPCODE_STORE_MODULE_VAR_POP:
         case OPCODE_LOOP:
         case OPCODE_JUMP:
         case OPCODE_JUMP_IF_FALSE:
@@ -1517,6 +1899,71 @@ uint32_t getBytesOfOperands(Byte *instrStream, Value *constants, int ip) {
             //OPCODE_SUPERX的操作数是分别由writeOpCodeShortOperand和writeShortOperand写入的，共1个操作码和4个字节的操作数
             return 4;
 
+        case OPCODE_CALL0:
+        case OPCODE_CALL1:
+        case OPCODE_CALL2:
+        case OPCODE_CALL3:
+        case OPCODE_CALL4:
+        case OPCODE_CALL5:
+        case OPCODE_CALL6:
+        case OPCODE_CALL7:
+        case OPCODE_CALL8:
+        case OPCODE_CALL9:
+        case OPCODE_CALL10:
+        case OPCODE_CALL11:
+        case OPCODE_CALL12:
+        case OPCODE_CALL13:
+        case OPCODE_CALL14:
+        case OPCODE_CALL15:
+        case OPCODE_CALL16:
+        case OPCODE_CALL_CLOSURE0:
+        case OPCODE_CALL_CLOSURE1:
+        case OPCODE_CALL_CLOSURE2:
+        case OPCODE_CALL_CLOSURE3:
+        case OPCODE_CALL_CLOSURE4:
+        case OPCODE_CALL_CLOSURE5:
+        case OPCODE_CALL_CLOSURE6:
+        case OPCODE_CALL_CLOSURE7:
+        case OPCODE_CALL_CLOSURE8:
+        case OPCODE_CALL_CLOSURE9:
+        case OPCODE_CALL_CLOSURE10:
+        case OPCODE_CALL_CLOSURE11:
+        case OPCODE_CALL_CLOSURE12:
+        case OPCODE_CALL_CLOSURE13:
+        case OPCODE_CALL_CLOSURE14:
+        case OPCODE_CALL_CLOSURE15:
+        case OPCODE_CALL_CLOSURE16:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_LT:
+        case OPCODE_LE:
+        case OPCODE_GT:
+        case OPCODE_GE:
+        case OPCODE_EQ:
+        case OPCODE_NEQ:
+        case OPCODE_BIT_AND:
+        case OPCODE_BIT_OR:
+        case OPCODE_BIT_SHIFT_LEFT:
+        case OPCODE_BIT_SHIFT_RIGHT:
+        case OPCODE_NEG:
+        case OPCODE_BIT_NOT:
+        case OPCODE_ITERATE:
+        case OPCODE_ITERATOR_VALUE:
+        case OPCODE_IS:
+        case OPCODE_CALL_NUM:
+        case OPCODE_CALL_OBJ:
+        case OPCODE_LT_JUMP_IF_FALSE:
+        case OPCODE_LE_JUMP_IF_FALSE:
+        case OPCODE_GT_JUMP_IF_FALSE:
+        case OPCODE_GE_JUMP_IF_FALSE:
+        case OPCODE_EQ_JUMP_IF_FALSE:
+        case OPCODE_NEQ_JUMP_IF_FALSE:
+            //2字节的方法名索引和2字节的内联缓存索引
+            return 4;
+
         case OPCODE_CREATE_CLOSURE: {
             //获得操作码OPCODE_CLOSURE操作数，2字节，该操作数是待创建闭包的函数在常量表中的索引
             uint32_t funIdx = (instrStream[ip + 1] << 8) | instrStream[ip + 2];
@@ -1530,6 +1977,886 @@ uint32_t getBytesOfOperands(Byte *instrStream, Value *constants, int ip) {
     }
 }
 
+//方法签名中的参数个数，参数在签名中都是紧跟在'('、'['或','之后的'_'
+uint32_t getSignatureArgNum(const char *signature, uint32_t length) {
+    uint32_t argNum = 0;
+    uint32_t idx = 1;
+    while (idx < length) {
+        char prev = signature[idx - 1];
+        if (signature[idx] == '_' && (prev == '(' || prev == '[' || prev == ','))
+            argNum++;
+        idx++;
+    }
+    return argNum;
+}
+
+//获取指令对(first, second)融合后的超级指令，不能融合的返回OPCODE_END
+OpCode getSuperInstruction(OpCode first, OpCode second) {
+    switch (first) {
+        case OPCODE_LOAD_LOCAL_VAR:
+            if (second == OPCODE_LOAD_CONSTANT)
+                return OPCODE_LOAD_LOCAL_VAR_CONSTANT;
+            if (second == OPCODE_LOAD_LOCAL_VAR)
+                return OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR;
+            break;
+        case OPCODE_LOAD_MODULE_VAR:
+            if (second == OPCODE_LOAD_CONSTANT)
+                return OPCODE_LOAD_MODULE_VAR_CONSTANT;
+            break;
+        case OPCODE_STORE_LOCAL_VAR:
+            if (second == OPCODE_POP)
+                return OPCODE_STORE_LOCAL_VAR_POP;
+            break;
+        case OPCODE_STORE_MODULE_VAR:
+            if (second == OPCODE_POP)
+                return OPCODE_STORE_MODULE_VAR_POP;
+            break;
+        //比较运算后紧跟条件跳转，比较结果不必再入栈
+        case OPCODE_LT:
+            if (second == OPCODE_JUMP_IF_FALSE)
+                return OPCODE_LT_JUMP_IF_FALSE;
+            break;
+        case OPCODE_LE:
+            if (second == OPCODE_JUMP_IF_FALSE)
+                return OPCODE_LE_JUMP_IF_FALSE;
+            break;
+        case OPCODE_GT:
+            if (second == OPCODE_JUMP_IF_FALSE)
+                return OPCODE_GT_JUMP_IF_FALSE;
+            break;
+        case OPCODE_GE:
+            if (second == OPCODE_JUMP_IF_FALSE)
+                return OPCODE_GE_JUMP_IF_FALSE;
+            break;
+        case OPCODE_EQ:
+            if (second == OPCODE_JUMP_IF_FALSE)
+                return OPCODE_EQ_JUMP_IF_FALSE;
+            break;
+        case OPCODE_NEQ:
+            if (second == OPCODE_JUMP_IF_FALSE)
+                return OPCODE_NEQ_JUMP_IF_FALSE;
+            break;
+        default:
+            break;
+    }
+    return OPCODE_END;
+}
+
+//超级指令融合，把函数中常见的相邻指令对合并为一条超级指令
+//只改写前一条指令的操作码，后一条指令原样保留，超级指令执行时一并完成后一条指令并跳过它
+//因此指令长度不变，跳转到后一条指令的地址依然有效
+static void fuseSuperInstructions(ObjFun *fun) {
+    Byte *instrStream = fun->instrStream.datas;
+    Value *constants = fun->constants.datas;
+    uint32_t ip = 0;
+    while (instrStream[ip] != OPCODE_END) {
+        uint32_t next = ip + 1 + getBytesOfOperands(instrStream, constants, ip);
+        OpCode superOpCode = getSuperInstruction((OpCode) instrStream[ip], (OpCode) instrStream[next]);
+        if (superOpCode != OPCODE_END) {
+            instrStream[ip] = superOpCode;
+            //后一条指令已被融合，从它之后开始继续寻找
+            next += 1 + getBytesOfOperands(instrStream, constants, next);
+        }
+        ip = next;
+    }
+}
+
+//翻译时模拟栈中操作数的来源，除OPERAND_TEMP外的操作数都尚未写入自己所在的slot
+typedef enum {
+    OPERAND_TEMP, //值已在自己所在的slot中
+    OPERAND_LOCAL, //尚未读出的局部变量，值在index所指的slot中
+    OPERAND_CONSTANT, //尚未装载的常量，index是常量表索引
+    OPERAND_NULL,
+    OPERAND_TRUE,
+    OPERAND_FALSE
+} OperandType;
+
+typedef struct {
+    OperandType type;
+    uint32_t index;
+} Operand;
+
+#define NOT_LABEL (-2) //不是跳转目标
+#define UNKNOWN_DEPTH (-1) //是跳转目标但栈深度尚未确定
+
+typedef struct {
+    VM *vm;
+    ByteBuffer instrStream; //翻译出的寄存器指令流
+    LineTable lineTable; //翻译出的指令流的行号表
+    uint32_t curLineNo; //正在翻译的栈式指令所在的行号
+    Operand *operands; //模拟的运行时栈，下标即slot编号
+    int capacity;
+    int depth; //模拟栈的深度
+    int espDepth; //运行时esp实际对应的栈深度，不确定时为UNKNOWN_DEPTH
+    int lastCompare; //刚写入的比较指令的地址，没有则为-1
+    IntBuffer jumps; //待重定位的跳转，每项依次为新操作数地址，原跳转目标，是否向回跳转
+} RegisterTranslator;
+
+static void regWriteByte(RegisterTranslator *rt, int byte) {
+    lineTableAdd(rt->vm, &rt->lineTable, rt->curLineNo);
+    ByteBufferAdd(rt->vm, &rt->instrStream, (uint8_t) byte);
+}
+
+static void regWriteShort(RegisterTranslator *rt, int operand) {
+    regWriteByte(rt, (operand >> 8) & 0xff);
+    regWriteByte(rt, operand & 0xff);
+}
+
+//写入跳转指令的2字节偏移量占位符，待翻译结束后按新地址重定位
+static void regWriteJumpOffset(RegisterTranslator *rt, int target, bool isBackward) {
+    IntBufferAdd(rt->vm, &rt->jumps, (int) rt->instrStream.count);
+    IntBufferAdd(rt->vm, &rt->jumps, target);
+    IntBufferAdd(rt->vm, &rt->jumps, isBackward);
+    regWriteShort(rt, 0xffff);
+}
+
+//把slot处尚未写入的操作数写到slot中
+static void regMaterialize(RegisterTranslator *rt, int slot) {
+    Operand *operand = &rt->operands[slot];
+    switch (operand->type) {
+        case OPERAND_TEMP:
+            return;
+        case OPERAND_LOCAL:
+            regWriteByte(rt, OPCODE_REG_MOVE);
+            regWriteByte(rt, slot);
+            regWriteByte(rt, (int) operand->index);
+            break;
+        case OPERAND_CONSTANT:
+            regWriteByte(rt, OPCODE_REG_LOAD_CONSTANT);
+            regWriteByte(rt, slot);
+            regWriteShort(rt, (int) operand->index);
+            break;
+        case OPERAND_NULL:
+            regWriteByte(rt, OPCODE_REG_LOAD_NULL);
+            regWriteByte(rt, slot);
+            break;
+        case OPERAND_TRUE:
+            regWriteByte(rt, OPCODE_REG_LOAD_TRUE);
+            regWriteByte(rt, slot);
+            break;
+        case OPERAND_FALSE:
+            regWriteByte(rt, OPCODE_REG_LOAD_FALSE);
+            regWriteByte(rt, slot);
+            break;
+    }
+    operand->type = OPERAND_TEMP;
+}
+
+//把模拟栈中所有操作数写回运行时栈，用于跳转、跳转目标和栈式指令之前
+static void regFlush(RegisterTranslator *rt) {
+    int slot = 0;
+    while (slot < rt->depth) {
+        regMaterialize(rt, slot);
+        slot++;
+    }
+}
+
+//获得slot处操作数的值实际所在的slot，局部变量直接使用其自身的slot
+static int regSlotOf(RegisterTranslator *rt, int slot) {
+    if (rt->operands[slot].type == OPERAND_LOCAL)
+        return (int) rt->operands[slot].index;
+    regMaterialize(rt, slot);
+    return slot;
+}
+
+static bool regPush(RegisterTranslator *rt, OperandType type, uint32_t index) {
+    if (rt->depth >= rt->capacity)
+        return false;
+    rt->operands[rt->depth].type = type;
+    rt->operands[rt->depth].index = index;
+    rt->depth++;
+    return true;
+}
+
+//执行栈式指令前使运行时的esp与模拟栈深度一致
+static void regSyncTop(RegisterTranslator *rt) {
+    if (rt->espDepth != rt->depth) {
+        regWriteByte(rt, OPCODE_REG_SET_TOP);
+        regWriteByte(rt, rt->depth);
+        rt->espDepth = rt->depth;
+    }
+}
+
+//记录跳转目标处的栈深度，各来源的深度必须一致
+static bool regRecordLabel(int *labelDepth, uint32_t codeLen, int target, int depth) {
+    if (target < 0 || (uint32_t) target >= codeLen || labelDepth[target] == NOT_LABEL)
+        return false;
+    if (labelDepth[target] == UNKNOWN_DEPTH)
+        labelDepth[target] = depth;
+    return labelDepth[target] == depth;
+}
+
+//获得ip处跳转指令的跳转目标
+static int getJumpTarget(Byte *instrStream, int ip) {
+    int offset = (instrStream[ip + 1] << 8) | instrStream[ip + 2];
+    return instrStream[ip] == OPCODE_LOOP ? ip + 3 - offset : ip + 3 + offset;
+}
+
+//翻译一条栈式指令，不能翻译时返回false
+static bool translateInstruction(RegisterTranslator *rt, ObjFun *fun, int *labelDepth, int ip, bool *fallsThrough) {
+    Byte *code = fun->instrStream.datas;
+    uint32_t codeLen = fun->instrStream.count;
+    OpCode opCode = (OpCode) code[ip];
+    int lastCompare = rt->lastCompare;
+    rt->lastCompare = -1;
+
+    switch (opCode) {
+        case OPCODE_LOAD_CONSTANT:
+            return regPush(rt, OPERAND_CONSTANT, (code[ip + 1] << 8) | code[ip + 2]);
+        case OPCODE_PUSH_NULL:
+            return regPush(rt, OPERAND_NULL, 0);
+        case OPCODE_PUSH_TRUE:
+            return regPush(rt, OPERAND_TRUE, 0);
+        case OPCODE_PUSH_FALSE:
+            return regPush(rt, OPERAND_FALSE, 0);
+
+        case OPCODE_LOAD_LOCAL_VAR: {
+            int slot = code[ip + 1];
+            if (slot >= rt->depth || !regPush(rt, OPERAND_LOCAL, slot))
+                return false;
+            //局部变量自身尚未写入slot时直接沿用它的来源
+            if (rt->operands[slot].type != OPERAND_TEMP)
+                rt->operands[rt->depth - 1] = rt->operands[slot];
+            return true;
+        }
+
+        case OPCODE_STORE_LOCAL_VAR: {
+            int slot = code[ip + 1];
+            int top = rt->depth - 1;
+            if (slot > top)
+                return false;
+            //先写出所有尚未读出该局部变量的操作数，以免读到新值
+            int idx = 0;
+            while (idx < rt->depth) {
+                if (idx != slot && rt->operands[idx].type == OPERAND_LOCAL && rt->operands[idx].index == (uint32_t) slot)
+                    regMaterialize(rt, idx);
+                idx++;
+            }
+            if (slot != top) {
+                Operand value = rt->operands[top];
+                if (value.type == OPERAND_TEMP || value.type == OPERAND_LOCAL) {
+                    regWriteByte(rt, OPCODE_REG_MOVE);
+                    regWriteByte(rt, slot);
+                    regWriteByte(rt, value.type == OPERAND_TEMP ? top : (int) value.index);
+                } else {
+                    //常量直接装载到局部变量
+                    rt->operands[slot] = value;
+                    regMaterialize(rt, slot);
+                }
+            }
+            rt->operands[slot].type = OPERAND_TEMP;
+            return true;
+        }
+
+        case OPCODE_POP:
+            rt->depth--;
+            return rt->depth >= 0;
+
+        case OPCODE_LOAD_MODULE_VAR:
+        case OPCODE_LOAD_UPVALUE:
+        case OPCODE_LOAD_CAPTURED:
+            if (!regPush(rt, OPERAND_TEMP, 0))
+                return false;
+            if (opCode == OPCODE_LOAD_MODULE_VAR)
+                regWriteByte(rt, OPCODE_REG_LOAD_MODULE_VAR);
+            else
+                regWriteByte(rt, opCode == OPCODE_LOAD_UPVALUE ? OPCODE_REG_LOAD_UPVALUE : OPCODE_REG_LOAD_CAPTURED);
+            regWriteByte(rt, rt->depth - 1);
+            regWriteByte(rt, code[ip + 1]);
+            if (opCode == OPCODE_LOAD_MODULE_VAR)
+                regWriteByte(rt, code[ip + 2]);
+            return true;
+
+        case OPCODE_STORE_MODULE_VAR:
+        case OPCODE_STORE_UPVALUE: {
+            if (rt->depth < 1)
+                return false;
+            int src = regSlotOf(rt, rt->depth - 1);
+            regWriteByte(rt, opCode == OPCODE_STORE_MODULE_VAR ? OPCODE_REG_STORE_MODULE_VAR : OPCODE_REG_STORE_UPVALUE);
+            regWriteByte(rt, code[ip + 1]);
+            if (opCode == OPCODE_STORE_MODULE_VAR)
+                regWriteByte(rt, code[ip + 2]);
+            regWriteByte(rt, src);
+            return true;
+        }
+
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_LT:
+        case OPCODE_LE:
+        case OPCODE_GT:
+        case OPCODE_GE:
+        case OPCODE_EQ:
+        case OPCODE_NEQ:
+        case OPCODE_BIT_AND:
+        case OPCODE_BIT_OR:
+        case OPCODE_BIT_SHIFT_LEFT:
+        case OPCODE_BIT_SHIFT_RIGHT: {
+            if (rt->depth < 2)
+                return false;
+            int dst = rt->depth - 2;
+            int left = regSlotOf(rt, dst);
+            int right = regSlotOf(rt, dst + 1);
+            if (opCode >= OPCODE_LT && opCode <= OPCODE_NEQ)
+                rt->lastCompare = (int) rt->instrStream.count;
+            regWriteByte(rt, OPCODE_REG_ADD + (opCode - OPCODE_ADD));
+            regWriteByte(rt, dst);
+            regWriteByte(rt, left);
+            regWriteByte(rt, right);
+            //方法名索引留给操作数不是数字时回退调用，内联缓存索引不再需要
+            regWriteByte(rt, code[ip + 1]);
+            regWriteByte(rt, code[ip + 2]);
+            rt->depth--;
+            rt->operands[dst].type = OPERAND_TEMP;
+            //回退调用会改变esp
+            rt->espDepth = UNKNOWN_DEPTH;
+            return true;
+        }
+
+        case OPCODE_NEG:
+        case OPCODE_BIT_NOT: {
+            if (rt->depth < 1)
+                return false;
+            int dst = rt->depth - 1;
+            int src = regSlotOf(rt, dst);
+            regWriteByte(rt, OPCODE_REG_ADD + (opCode - OPCODE_ADD));
+            regWriteByte(rt, dst);
+            regWriteByte(rt, src);
+            regWriteByte(rt, code[ip + 1]);
+            regWriteByte(rt, code[ip + 2]);
+            rt->operands[dst].type = OPERAND_TEMP;
+            rt->espDepth = UNKNOWN_DEPTH;
+            return true;
+        }
+
+        case OPCODE_JUMP:
+            regFlush(rt);
+            if (!regRecordLabel(labelDepth, codeLen, getJumpTarget(code, ip), rt->depth))
+                return false;
+            regWriteByte(rt, OPCODE_JUMP);
+            regWriteJumpOffset(rt, getJumpTarget(code, ip), false);
+            *fallsThrough = false;
+            return true;
+
+        case OPCODE_LOOP:
+            //向回跳转的目标此前已翻译过，栈深度必须一致
+            regFlush(rt);
+            if (!regRecordLabel(labelDepth, codeLen, getJumpTarget(code, ip), rt->depth))
+                return false;
+            regWriteByte(rt, OPCODE_LOOP);
+            regWriteJumpOffset(rt, getJumpTarget(code, ip), true);
+            *fallsThrough = false;
+            return true;
+
+        case OPCODE_JUMP_IF_FALSE: {
+            if (rt->depth < 1)
+                return false;
+            rt->depth--;
+            regFlush(rt);
+            int cond = rt->depth;
+            //比较指令与本指令之间没有其它指令时，将比较指令改写为融合的比较跳转指令
+            if (lastCompare != -1 && lastCompare + 6 == (int) rt->instrStream.count &&
+                rt->operands[cond].type == OPERAND_TEMP && rt->instrStream.datas[lastCompare + 1] == cond)
+                rt->instrStream.datas[lastCompare] += OPCODE_REG_LT_JUMP_IF_FALSE - OPCODE_REG_LT;
+            cond = regSlotOf(rt, cond);
+            if (!regRecordLabel(labelDepth, codeLen, getJumpTarget(code, ip), rt->depth))
+                return false;
+            regWriteByte(rt, OPCODE_REG_JUMP_IF_FALSE);
+            regWriteByte(rt, cond);
+            regWriteJumpOffset(rt, getJumpTarget(code, ip), false);
+            return true;
+        }
+
+        case OPCODE_AND:
+        case OPCODE_OR:
+            //跳转时条件值留在栈顶，仍按栈式指令执行
+            regFlush(rt);
+            regSyncTop(rt);
+            if (!regRecordLabel(labelDepth, codeLen, getJumpTarget(code, ip), rt->depth))
+                return false;
+            regWriteByte(rt, opCode);
+            regWriteJumpOffset(rt, getJumpTarget(code, ip), false);
+            rt->depth--;
+            rt->espDepth = rt->depth;
+            return true;
+
+        case OPCODE_RETURN: {
+            if (rt->depth < 1)
+                return false;
+            int src = regSlotOf(rt, rt->depth - 1);
+            regWriteByte(rt, OPCODE_REG_RETURN);
+            regWriteByte(rt, src);
+            *fallsThrough = false;
+            return true;
+        }
+
+        case OPCODE_TAIL_RETURN:
+            //仍按栈式指令返回，须紧跟在调用指令之后才能被识别为尾调用
+            regFlush(rt);
+            regSyncTop(rt);
+            regWriteByte(rt, opCode);
+            *fallsThrough = false;
+            return true;
+
+        case OPCODE_END:
+            regWriteByte(rt, OPCODE_END);
+            return true;
+
+        default: {
+            //其余指令按栈式指令原样执行
+            if (opCode >= OPCODE_LOAD_LOCAL_VAR_CONSTANT)
+                return false;
+            regFlush(rt);
+            regSyncTop(rt);
+            uint32_t next = ip + 1 + getBytesOfOperands(code, fun->constants.datas, ip);
+            while ((uint32_t) ip < next)
+                regWriteByte(rt, code[ip++]);
+            int depth = rt->depth + opCodeSlotsUsed[opCode];
+            if (depth < 0 || depth > rt->capacity)
+                return false;
+            while (rt->depth < depth)
+                rt->operands[rt->depth++].type = OPERAND_TEMP;
+            rt->depth = depth;
+            rt->espDepth = depth;
+            return true;
+        }
+    }
+}
+
+//把函数的栈式指令流翻译为寄存器指令流
+//寄存器指令直接以本帧运行时栈的slot为操作数，局部变量和常量不必先入栈，省去大部分压栈出栈的指令
+//栈深度在跳转处不一致等无法翻译的情况返回false，此时指令流不变
+static bool translateToRegisterTier(VM *vm, ObjFun *fun, bool isModule) {
+    Byte *code = fun->instrStream.datas;
+    uint32_t codeLen = fun->instrStream.count;
+
+    //slot编号只占1字节
+    if (fun->maxStackSlotUsedNum >= UINT8_MAX)
+        return false;
+
+    RegisterTranslator rt;
+    rt.vm = vm;
+    ByteBufferInit(&rt.instrStream);
+    initLineTable(&rt.lineTable);
+    IntBufferInit(&rt.jumps);
+    rt.capacity = (int) fun->maxStackSlotUsedNum + 1;
+    rt.operands = ALLOCATE_ARRAY(vm, Operand, rt.capacity);
+    //模块的运行时栈初始为空，函数和方法的栈底是闭包或self及各参数
+    rt.depth = isModule ? 0 : fun->argNum + 1;
+    rt.espDepth = rt.depth;
+    rt.lastCompare = -1;
+    int idx = 0;
+    while (idx < rt.depth)
+        rt.operands[idx++].type = OPERAND_TEMP;
+
+    int *labelDepth = ALLOCATE_ARRAY(vm, int, codeLen);
+    int *newIndex = ALLOCATE_ARRAY(vm, int, codeLen);
+    //顺序翻译时逐字节查行号，先把行号表展开
+    uint32_t *lineNos = ALLOCATE_ARRAY(vm, uint32_t, codeLen);
+    expandLineTable(&fun->lineTable, lineNos, codeLen);
+    for (idx = 0; idx < (int) codeLen; idx++) {
+        labelDepth[idx] = NOT_LABEL;
+        newIndex[idx] = -1;
+    }
+
+    //先找出所有跳转目标
+    bool ok = rt.depth <= rt.capacity;
+    int ip = 0;
+    while (ok && code[ip] != OPCODE_END) {
+        OpCode opCode = (OpCode) code[ip];
+        if (opCode == OPCODE_JUMP || opCode == OPCODE_LOOP || opCode == OPCODE_JUMP_IF_FALSE ||
+            opCode == OPCODE_AND || opCode == OPCODE_OR) {
+            int target = getJumpTarget(code, ip);
+            if (target < 0 || (uint32_t) target >= codeLen)
+                ok = false;
+            else
+                labelDepth[target] = UNKNOWN_DEPTH;
+        }
+        ip += 1 + getBytesOfOperands(code, fun->constants.datas, ip);
+    }
+
+    //逐条翻译
+    bool fallsThrough = true;
+    ip = 0;
+    while (ok) {
+        rt.curLineNo = lineNos[ip];
+        if (labelDepth[ip] != NOT_LABEL) {
+            if (fallsThrough) {
+                regFlush(&rt);
+                ok = regRecordLabel(labelDepth, codeLen, ip, rt.depth);
+            } else if (labelDepth[ip] == UNKNOWN_DEPTH)
+                //只能由后面的LOOP跳来的不可达代码，沿用之前的栈深度
+                labelDepth[ip] = rt.depth;
+            else
+                rt.depth = labelDepth[ip];
+            //从各处跳来时操作数均已写回运行时栈
+            for (idx = 0; idx < rt.depth; idx++)
+                rt.operands[idx].type = OPERAND_TEMP;
+            rt.espDepth = UNKNOWN_DEPTH;
+            rt.lastCompare = -1;
+        }
+        newIndex[ip] = (int) rt.instrStream.count;
+        fallsThrough = true;
+        OpCode opCode = (OpCode) code[ip];
+        uint32_t next = ip + 1 + getBytesOfOperands(code, fun->constants.datas, ip);
+        ok = ok && translateInstruction(&rt, fun, labelDepth, ip, &fallsThrough);
+        if (opCode == OPCODE_END)
+            break;
+        ip = (int) next;
+    }
+
+    //重定位跳转偏移量
+    idx = 0;
+    while (ok && idx < (int) rt.jumps.count) {
+        int operandIdx = rt.jumps.datas[idx];
+        int target = newIndex[rt.jumps.datas[idx + 1]];
+        int offset = rt.jumps.datas[idx + 2] ? operandIdx + 2 - target : target - operandIdx - 2;
+        if (target < 0 || offset < 0 || offset > INT16_MAX)
+            ok = false;
+        else {
+            rt.instrStream.datas[operandIdx] = (offset >> 8) & 0xff;
+            rt.instrStream.datas[operandIdx + 1] = offset & 0xff;
+        }
+        idx += 3;
+    }
+
+    if (ok) {
+        if (!fun->isCodeMapped)
+            ByteBufferClear(vm, &fun->instrStream);
+        fun->instrStream = rt.instrStream;
+        fun->isCodeMapped = false;
+        ByteBufferClear(vm, &fun->lineTable.runs);
+        fun->lineTable = rt.lineTable;
+    } else {
+        ByteBufferClear(vm, &rt.instrStream);
+        ByteBufferClear(vm, &rt.lineTable.runs);
+    }
+    IntBufferClear(vm, &rt.jumps);
+    DEALLOCATE_ARRAY(vm, rt.operands, rt.capacity);
+    DEALLOCATE_ARRAY(vm, labelDepth, codeLen);
+    DEALLOCATE_ARRAY(vm, newIndex, codeLen);
+    DEALLOCATE_ARRAY(vm, lineNos, codeLen);
+    return ok;
+}
+
+#undef NOT_LABEL
+#undef UNKNOWN_DEPTH
+
+//字节码校验时尚未到达的指令和不是指令起始的位置
+#define VERIFY_UNVISITED (-1)
+#define VERIFY_NOT_INSTRUCTION (-2)
+
+//超级指令的长度和栈影响只计前一条指令，校验时按前一条指令处理，后一条指令另行校验
+OpCode getFusedFirstOpCode(OpCode opCode) {
+    switch (opCode) {
+        case OPCODE_LOAD_LOCAL_VAR_CONSTANT:
+        case OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR:
+            return OPCODE_LOAD_LOCAL_VAR;
+        case OPCODE_LOAD_MODULE_VAR_CONSTANT:
+            return OPCODE_LOAD_MODULE_VAR;
+        case OPCODE_STORE_LOCAL_VAR_POP:
+            return OPCODE_STORE_LOCAL_VAR;
+        case OPCODE_STORE_MODULE_VAR_POP:
+            return OPCODE_STORE_MODULE_VAR;
+        case OPCODE_LT_JUMP_IF_FALSE:
+        case OPCODE_LE_JUMP_IF_FALSE:
+        case OPCODE_GT_JUMP_IF_FALSE:
+        case OPCODE_GE_JUMP_IF_FALSE:
+        case OPCODE_EQ_JUMP_IF_FALSE:
+        case OPCODE_NEQ_JUMP_IF_FALSE:
+            return (OpCode) (opCode - OPCODE_LT_JUMP_IF_FALSE + OPCODE_LT);
+        default:
+            return opCode;
+    }
+}
+
+//指令执行前栈中至少要有的slot数
+static int getStackInputs(OpCode opCode) {
+    if (opCode >= OPCODE_CALL0 && opCode <= OPCODE_CALL16)
+        return opCode - OPCODE_CALL0 + 1;
+    if (opCode >= OPCODE_SUPER0 && opCode <= OPCODE_SUPER16)
+        return opCode - OPCODE_SUPER0 + 1;
+    if (opCode >= OPCODE_CALL_CLOSURE0 && opCode <= OPCODE_CALL_CLOSURE16)
+        return opCode - OPCODE_CALL_CLOSURE0 + 1;
+
+    switch (opCode) {
+        case OPCODE_STORE_FIELD:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_MOD:
+        case OPCODE_LT:
+        case OPCODE_LE:
+        case OPCODE_GT:
+        case OPCODE_GE:
+        case OPCODE_EQ:
+        case OPCODE_NEQ:
+        case OPCODE_BIT_AND:
+        case OPCODE_BIT_OR:
+        case OPCODE_BIT_SHIFT_LEFT:
+        case OPCODE_BIT_SHIFT_RIGHT:
+        case OPCODE_ITERATE:
+        case OPCODE_ITERATOR_VALUE:
+        case OPCODE_IS:
+        case OPCODE_CREATE_CLASS:
+        case OPCODE_INSTANCE_METHOD:
+        case OPCODE_STATIC_METHOD:
+            return 2;
+
+        //LOAD_SELF_FIELD、STORE_SELF_FIELD和CONSTRUCT访问栈底的self
+        case OPCODE_LOAD_SELF_FIELD:
+        case OPCODE_STORE_SELF_FIELD:
+        case OPCODE_CONSTRUCT:
+        case OPCODE_STORE_LOCAL_VAR:
+        case OPCODE_STORE_UPVALUE:
+        case OPCODE_STORE_MODULE_VAR:
+        case OPCODE_LOAD_FIELD:
+        case OPCODE_POP:
+        case OPCODE_NEG:
+        case OPCODE_BIT_NOT:
+        case OPCODE_JUMP_IF_FALSE:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_CLOSE_UPVALUE:
+        case OPCODE_RETURN:
+        case OPCODE_TAIL_RETURN:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+//从ip处读取2字节的操作数
+static uint32_t readShortOperand(Byte *instrStream, uint32_t ip) {
+    return (instrStream[ip] << 8) | instrStream[ip + 1];
+}
+
+//记录从某处到达target时的栈深度，首次到达时加入待校验的列表
+static const char *verifyReach(int *depths, IntBuffer *workList, VM *vm, uint32_t codeLen, int target, int depth) {
+    if (target < 0 || (uint32_t) target >= codeLen || depths[target] == VERIFY_NOT_INSTRUCTION)
+        return "jump target is not an instruction";
+    if (depths[target] == VERIFY_UNVISITED) {
+        depths[target] = depth;
+        IntBufferAdd(vm, workList, target);
+        return NULL;
+    }
+    return depths[target] == depth ? NULL : "inconsistent stack depth at join point";
+}
+
+//校验一条指令的操作数，depth是指令执行前的栈深度
+static const char *verifyOperands(VM *vm, ObjFun *fun, OpCode opCode, uint32_t ip, int depth) {
+    Byte *code = fun->instrStream.datas;
+
+    //OPCODE_ADD到OPCODE_CALL_CLOSURE16的操作数同CALLx，第一个是方法名索引，除SUPERx外第二个是内联缓存索引
+    if (opCode >= OPCODE_ADD && opCode <= OPCODE_CALL_CLOSURE16) {
+        if (readShortOperand(code, ip + 1) >= vm->allMethodNames.count)
+            return "method name index out of range";
+        //方法按签名从栈中取参数，调用时入栈的参数个数须与之相同，否则方法会读到栈顶之外
+        String *name = &vm->allMethodNames.datas[readShortOperand(code, ip + 1)];
+        if (getSignatureArgNum(name->str, name->length) != (uint32_t) getStackInputs(opCode) - 1)
+            return "argument number doesn't match the method signature";
+        //super的基类常量是占位的null，绑定方法时由patchOperand改写，指向别的常量会把它覆盖掉
+        if (opCode >= OPCODE_SUPER0 && opCode <= OPCODE_SUPER16)
+            return readShortOperand(code, ip + 3) < fun->constants.count &&
+                   VALUE_IS_NULL(fun->constants.datas[readShortOperand(code, ip + 3)]) ? NULL : "invalid superclass constant";
+        return readShortOperand(code, ip + 3) < fun->inlineCacheNum ? NULL : "inline cache index out of range";
+    }
+
+    switch (opCode) {
+        case OPCODE_LOAD_CONSTANT:
+            return readShortOperand(code, ip + 1) < fun->constants.count ? NULL : "constant index out of range";
+
+        case OPCODE_LOAD_LOCAL_VAR:
+        case OPCODE_STORE_LOCAL_VAR:
+            return code[ip + 1] < depth ? NULL : "local variable index out of range";
+
+        case OPCODE_LOAD_UPVALUE:
+        case OPCODE_STORE_UPVALUE:
+            if (code[ip + 1] >= fun->upvalueNum)
+                return "upvalue index out of range";
+            return isUpvalueByValue(fun, code[ip + 1]) ? "upvalue captured by value has no ObjUpvalue" : NULL;
+
+        case OPCODE_LOAD_CAPTURED:
+            if (code[ip + 1] >= fun->upvalueNum)
+                return "upvalue index out of range";
+            return isUpvalueByValue(fun, code[ip + 1]) ? NULL : "upvalue captured by reference has no value";
+
+        case OPCODE_LOAD_MODULE_VAR:
+        case OPCODE_STORE_MODULE_VAR:
+            return readShortOperand(code, ip + 1) < fun->module->moduleVarValue.count ? NULL : "module variable index out of range";
+
+        case OPCODE_CREATE_CLASS:
+            return code[ip + 1] <= MAX_FIELD_NUM ? NULL : "too many fields";
+
+        case OPCODE_INSTANCE_METHOD:
+        case OPCODE_STATIC_METHOD:
+            return readShortOperand(code, ip + 1) < vm->allMethodNames.count ? NULL : "method name index out of range";
+
+        case OPCODE_CREATE_CLOSURE: {
+            //每个upvalue一对参数：捕获方式和外层函数的局部变量或upvalue索引
+            //捕获方式要与内层函数中该upvalue是否按值捕获相符，继承的upvalue两层的方式也要相同
+            ObjFun *objFun = VALUE_TO_OBJFUN(fun->constants.datas[readShortOperand(code, ip + 1)]);
+            uint32_t idx = 0;
+            while (idx < objFun->upvalueNum) {
+                Byte captureType = code[ip + 3 + idx * 2];
+                Byte index = code[ip + 4 + idx * 2];
+                bool byValue = isUpvalueByValue(objFun, idx);
+                if (captureType == CAPTURE_UPVALUE) {
+                    if (index >= fun->upvalueNum)
+                        return "captured upvalue index out of range";
+                    if (isUpvalueByValue(fun, index) != byValue)
+                        return "capture type does not match the upvalue";
+                } else if (captureType == CAPTURE_LOCAL_VAR || captureType == CAPTURE_LOCAL_VAR_BY_VALUE) {
+                    if (index >= depth)
+                        return "captured local variable index out of range";
+                    if ((captureType == CAPTURE_LOCAL_VAR_BY_VALUE) != byValue)
+                        return "capture type does not match the upvalue";
+                } else
+                    return "invalid capture type";
+                idx++;
+            }
+            return NULL;
+        }
+
+        default:
+            return NULL;
+    }
+}
+
+//校验函数的指令流，通过返回NULL，否则返回原因并把出错指令的地址写入errorIp
+//按控制流推演每条指令执行前的栈深度，证明以下性质，执行指令时便不必再检查：
+//1. 操作码合法，操作数不越出指令流，指令流以不可达的OPCODE_END结尾
+//2. 跳转偏移量为正且能以int16_t表示，跳转目标是某条指令的起始
+//3. 常量、局部变量、upvalue、模块变量、方法名和内联缓存的索引都在范围内，调用的参数个数与方法签名相符
+//   按值捕获的upvalue只由LOAD_CAPTURED读取，其余upvalue只由LOAD_UPVALUE和STORE_UPVALUE访问，创建闭包时的捕获方式与之相符
+//4. 各条路径汇合处的栈深度相同，出栈不越过栈底，入栈不超出按maxStackSlotUsedNum预留的栈空间
+//字段的接收者和索引、类名、待绑定的类和super的基类取决于运行时的值，不在此证明，由解释器执行到时检查
+//超级指令可以校验，运行时快速化和寄存器层的指令则不行，应在融合和翻译之前校验
+const char *verifyFun(VM *vm, ObjFun *fun, bool isModule, uint32_t *errorIp) {
+    Byte *code = fun->instrStream.datas;
+    uint32_t codeLen = fun->instrStream.count;
+    const char *error = NULL;
+    *errorIp = 0;
+    if (codeLen == 0)
+        return "empty instruction stream";
+
+    int *depths = ALLOCATE_ARRAY(vm, int, codeLen);
+    IntBuffer workList;
+    IntBufferInit(&workList);
+
+    //先顺序解码，标记出每条指令的起始
+    uint32_t ip = 0;
+    for (ip = 0; ip < codeLen; ip++)
+        depths[ip] = VERIFY_NOT_INSTRUCTION;
+    ip = 0;
+    while (error == NULL) {
+        OpCode opCode = (OpCode) code[ip];
+        depths[ip] = VERIFY_UNVISITED;
+        if (opCode == OPCODE_END) {
+            if (ip != codeLen - 1)
+                error = "OPCODE_END before the end of instruction stream";
+            break;
+        }
+        if (opCode > OPCODE_NEQ_JUMP_IF_FALSE || opCode == OPCODE_CALL_NUM || opCode == OPCODE_CALL_OBJ) {
+            error = "invalid opcode";
+            break;
+        }
+        //CREATE_CLOSURE的长度取决于常量表中的函数，要先确认该常量
+        if (opCode == OPCODE_CREATE_CLOSURE &&
+            (ip + 2 >= codeLen || readShortOperand(code, ip + 1) >= fun->constants.count ||
+             !VALUE_IS_OBJFUN(fun->constants.datas[readShortOperand(code, ip + 1)]))) {
+            error = "closure constant is not a function";
+            break;
+        }
+        uint32_t next = ip + 1 + getBytesOfOperands(code, fun->constants.datas, (int) ip);
+        if (next >= codeLen) {
+            error = "instruction runs past the end of instruction stream";
+            break;
+        }
+        ip = next;
+    }
+
+    //模块的运行时栈初始为空，函数和方法的栈底是闭包或self及各参数
+    //编译时参数不计入maxStackSlotUsedNum，而调用时参数已在栈中，createFrame在其上再预留maxStackSlotUsedNum个slot
+    int maxDepth = (int) (fun->maxStackSlotUsedNum + fun->argNum);
+    int entryDepth = isModule ? 0 : fun->argNum + 1;
+    if (error == NULL) {
+        ip = 0;
+        error = verifyReach(depths, &workList, vm, codeLen, 0, entryDepth);
+    }
+
+    //按控制流推演栈深度
+    while (error == NULL && workList.count > 0) {
+        ip = (uint32_t) workList.datas[--workList.count];
+        int depth = depths[ip];
+        OpCode opCode = getFusedFirstOpCode((OpCode) code[ip]);
+        uint32_t next = ip + 1 + getBytesOfOperands(code, fun->constants.datas, (int) ip);
+
+        if (depth < getStackInputs(opCode)) {
+            error = "stack underflow";
+            break;
+        }
+        if ((error = verifyOperands(vm, fun, opCode, ip, depth)) != NULL)
+            break;
+        //超级指令执行时直接读取后一条指令的操作数，后一条指令必须是融合前的那条
+        if (opCode != (OpCode) code[ip] && getSuperInstruction(opCode, (OpCode) code[next]) != (OpCode) code[ip]) {
+            error = "superinstruction is not followed by its second instruction";
+            break;
+        }
+        int newDepth = depth + opCodeSlotsUsed[opCode];
+        if (newDepth > maxDepth) {
+            error = "stack depth exceeds maxStackSlotUsedNum";
+            break;
+        }
+
+        switch (opCode) {
+            case OPCODE_END:
+                error = "OPCODE_END is reachable";
+                break;
+
+            case OPCODE_RETURN:
+            case OPCODE_TAIL_RETURN:
+                break;
+
+            case OPCODE_JUMP:
+            case OPCODE_LOOP:
+            case OPCODE_JUMP_IF_FALSE:
+            case OPCODE_AND:
+            case OPCODE_OR: {
+                uint32_t offset = readShortOperand(code, ip + 1);
+                if (offset == 0 || offset > INT16_MAX) {
+                    error = "jump offset must be positive";
+                    break;
+                }
+                //AND和OR跳转时保留栈顶的条件
+                int targetDepth = opCode == OPCODE_AND || opCode == OPCODE_OR ? depth : newDepth;
+                error = verifyReach(depths, &workList, vm, codeLen, getJumpTarget(code, (int) ip), targetDepth);
+                if (error == NULL && opCode != OPCODE_JUMP && opCode != OPCODE_LOOP)
+                    error = verifyReach(depths, &workList, vm, codeLen, (int) next, newDepth);
+                break;
+            }
+
+            default:
+                error = verifyReach(depths, &workList, vm, codeLen, (int) next, newDepth);
+                break;
+        }
+    }
+
+    if (error != NULL)
+        *errorIp = ip;
+    IntBufferClear(vm, &workList);
+    DEALLOCATE_ARRAY(vm, depths, codeLen);
+    return error;
+}
+
+#undef VERIFY_UNVISITED
+#undef VERIFY_NOT_INSTRUCTION
+
 //离开循环体时的相关设置
 static void leaveLoopPatch(CompileUnit *cu) {
     //获取往回跳转的偏移量，偏移量都为正数
@@ -1592,7 +2919,12 @@ static void compileReturn(CompileUnit *cu) {
     else
         //有返回值
         expression(cu, BP_LOWEST);
-    writeOpCode(cu, OPCODE_RETURN); //将上面栈顶的值返回
+
+    //返回值由紧挨着的方法调用得出时是尾调用，以TAIL_RETURN标记，运行时被调方复用本函数的frame
+    if (cu->callEndIndex == cu->fun->instrStream.count)
+        writeOpCode(cu, OPCODE_TAIL_RETURN);
+    else
+        writeOpCode(cu, OPCODE_RETURN); //将上面栈顶的值返回
 }
 
 //编译break
@@ -1619,6 +2951,13 @@ static void compileContinue(CompileUnit *cu) {
     writeOpCodeShortOperand(cu, OPCODE_LOOP, loopBackOffset);
 }
 
+//生成for循环的迭代指令，操作数同CALL1，序列不是内建序列时vm据此回退到方法调用
+static void emitIterate(CompileUnit *cu, OpCode opCode, const char *name, int length) {
+    int symbolIndex = ensureSymbolExist(cu->curParser->vm, &cu->curParser->vm->allMethodNames, name, length);
+    writeOpCodeShortOperand(cu, opCode, symbolIndex);
+    writeInlineCacheOperand(cu);
+}
+
 //编译for循环
 static void compileForStatement(CompileUnit *cu) {
     /*
@@ -1664,8 +3003,8 @@ static void compileForStatement(CompileUnit *cu) {
     writeOpCodeByteOperand(cu, OPCODE_LOAD_LOCAL_VAR, seqSlot);
     //2. 再压入参数iter，即seq.iterate(iter)中的iter
     writeOpCodeByteOperand(cu, OPCODE_LOAD_LOCAL_VAR, iterSlot);
-    //3. 调用seq.iterate(iter)
-    emitCall(cu, 1, "iterate(_)", 10);
+    //3. 调用seq.iterate(iter)，内建序列由vm直接迭代
+    emitIterate(cu, OPCODE_ITERATE, "iterate(_)", 10);
 
     //seq.iterate(iter)把结果（下一个迭代器）存储到args[0]（栈顶），现在将其同步到变量iter
     writeOpCodeByteOperand(cu, OPCODE_STORE_LOCAL_VAR, iterSlot);
@@ -1680,7 +3019,7 @@ static void compileForStatement(CompileUnit *cu) {
     //2.
     writeOpCodeByteOperand(cu, OPCODE_LOAD_LOCAL_VAR, iterSlot);
     //3.
-    emitCall(cu, 1, "iteratorValue(_)", 16);
+    emitIterate(cu, OPCODE_ITERATOR_VALUE, "iteratorValue(_)", 16);
 
     //为循环变量i创建作用域
     enterScope(cu);
@@ -1759,12 +3098,16 @@ static void defineMethod(CompileUnit *cu, Variable classVar, bool isStatic, int
 static void emitCreateInstance(CompileUnit *cu, Signature *signature, uint32_t constructorIndex) {
     CompileUnit methodCU;
     initCompileUnit(cu->curParser, &methodCU, cu, true);
+    methodCU.fun->argNum = signature->argNum;
+    //参数由调用方压栈且未声明为局部变量，计入栈的使用量，否则下面的CALLx会使计数下溢
+    methodCU.stackSlotNum += signature->argNum;
 
     //1. 生成OPCODE_CONSTRUCT指令，该指令生成新实例存储到stack[0]
     writeOpCode(&methodCU, OPCODE_CONSTRUCT);
 
     //2. 生成OPCODE_CALLx指令，该指令调用新实例的构造函数
     writeOpCodeShortOperand(&methodCU, (OpCode) (OPCODE_CALL0 + signature->argNum), constructorIndex);
+    writeInlineCacheOperand(&methodCU);
 
     //生成return指令，将栈顶中的实例返回
     writeOpCode(&methodCU, OPCODE_RETURN);
@@ -1800,6 +3143,7 @@ static void compileMethod(CompileUnit *cu, Variable classVar, bool isStatic) {
 
     //构造签名
     methodSign(&methodCU, &signature);
+    methodCU.fun->argNum = signature.argNum;
     consumeCurToken(cu->curParser, TOKEN_LEFT_BRACE, "expect '{' at the beginning of method body.");
 
     if (cu->enclosingClassBK->inStatic && signature.signatureType == SIGN_CONSTRUCT)
@@ -2061,7 +3405,26 @@ static void compileProgram(CompileUnit *cu) {
         compileStatement(cu);
 }
 
-//编译模块
+//函数执行前的准备：开启寄存器层时把指令流翻译为寄存器指令，无法翻译的仍以栈式指令执行并融合超级指令，再为调用点分配内联缓存表
+//常量表中的内层函数一并处理。编译出的和从字节码缓存载入的模块函数都经过这一步，调用方要保证fun可达
+void prepareFunToRun(VM *vm, ObjFun *fun, bool isModule) {
+    uint32_t idx = 0;
+    while (idx < fun->constants.count) {
+        if (VALUE_IS_OBJFUN(fun->constants.datas[idx]))
+            prepareFunToRun(vm, VALUE_TO_OBJFUN(fun->constants.datas[idx]), false);
+        idx++;
+    }
+
+    //bundle中的指令流打包时已融合过
+    if ((!vm->config.useRegisterTier || !translateToRegisterTier(vm, fun, isModule)) && !fun->isCodeMapped)
+        fuseSuperInstructions(fun);
+
+    fun->inlineCaches = ALLOCATE_ARRAY(vm, InlineCache, fun->inlineCacheNum);
+    if (fun->inlineCaches != NULL)
+        memset(fun->inlineCaches, 0, sizeof(InlineCache) * fun->inlineCacheNum);
+}
+
+//编译模块，返回的模块函数还要经prepareFunToRun才能执行
 ObjFun *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode) {
     //各源码模块文件需要单独的parser
     Parser parser;
@@ -9,7 +9,6 @@
 #include "../gc/gc.h"
 
 #define MAX_LOCAL_VAR_NUM 128
-#define MAX_UPVALUE_NUM 128
 #define MAX_ID_LEN 128 //变量名最大长度
 
 #define MAX_METHOD_NAME_LEN MAX_ID_LEN
@@ -34,8 +33,14 @@ typedef struct {
     int scopeDepth; //局部变量作用域
 
     bool isUpvalue; //当其内层函数引用此变量时，由其内层函数设置此为true
+    bool isReassigned; //定义之后又被赋值过，为false时内层函数可按值捕获它
 } LocalVar;
 
+//CREATE_CLOSURE中每个upvalue的捕获方式
+#define CAPTURE_UPVALUE 0 //继承直接外层函数的upvalue
+#define CAPTURE_LOCAL_VAR 1 //引用直接外层函数的局部变量
+#define CAPTURE_LOCAL_VAR_BY_VALUE 2 //复制直接外层函数中定义后不再被赋值的局部变量
+
 typedef enum {
     SIGN_CONSTRUCT, //构造函数
     SIGN_METHOD, //普通方法
@@ -72,7 +77,12 @@ typedef struct {
 typedef struct compileUnit CompileUnit;
 
 uint32_t getBytesOfOperands(Byte *instrStream, Value *constants, int ip);
+OpCode getSuperInstruction(OpCode first, OpCode second);
+OpCode getFusedFirstOpCode(OpCode opCode);
+uint32_t getSignatureArgNum(const char *signature, uint32_t length);
+const char *verifyFun(VM *vm, ObjFun *fun, bool isModule, uint32_t *errorIp);
 int defineModuleVar(VM *vm, ObjModule *objModule, const char *name, uint32_t length, Value value);
+void prepareFunToRun(VM *vm, ObjFun *fun, bool isModule);
 ObjFun *compileModule(VM *vm, ObjModule *objModule, const char *moduleCode);
 void grayCompileUnit(VM *vm, CompileUnit *cu);
 
@@ -8,6 +8,7 @@
 #include "../vm/vm.h"
 #include <string.h>
 #include "../objectAndClass/include/class.h"
+#include "compiler.h"
 
 //在funDebug中绑定函数名
 void bindDebugFunName(VM *vm, FunDebug *funDebug, const char *name, uint32_t length) {
@@ -73,7 +74,7 @@ static void dumpObject(ObjHeader *obj) {
 
 //打印value
 void dumpValue(Value value) {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VT_FALSE:
             printf("false");
             break;
@@ -100,7 +101,7 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
     uint8_t *bytecode = fun->instrStream.datas;
     OpCode opCode = (OpCode) bytecode[i];
 
-    int lineNo = fun->debug->lineNo.datas[i];
+    int lineNo = (int) getLineNo(&fun->lineTable, i);
 
     if (lastLine == NULL || *lastLine != lineNo) {
         printf("%4d:", lineNo); //输出源码行号
@@ -118,6 +119,32 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
     printf("%-16s %5d\n", name, READ_BYTE()); \
     break; \
 
+//数字运算指令，操作数是回退时调用的方法名索引和内联缓存索引
+#define METHOD_INSTRUCTION(name) { \
+    int symbol = READ_SHORT(); \
+    int cacheIdx = READ_SHORT(); \
+    printf("%-16s %5d '%s' ic:%d\n", name, symbol, vm->allMethodNames.datas[symbol].str, cacheIdx); \
+    break; \
+}
+
+//寄存器运算指令，操作数是目的slot、操作数slot和回退时调用的方法名索引
+#define REG_BINARY_INSTRUCTION(name) { \
+    int dst = READ_BYTE(); \
+    int left = READ_BYTE(); \
+    int right = READ_BYTE(); \
+    int symbol = READ_SHORT(); \
+    printf("%-16s r%d = r%d, r%d '%s'\n", name, dst, left, right, vm->allMethodNames.datas[symbol].str); \
+    break; \
+}
+
+#define REG_UNARY_INSTRUCTION(name) { \
+    int dst = READ_BYTE(); \
+    int src = READ_BYTE(); \
+    int symbol = READ_SHORT(); \
+    printf("%-16s r%d = r%d '%s'\n", name, dst, src, vm->allMethodNames.datas[symbol].str); \
+    break; \
+}
+
     switch (opCode) {
         case OPCODE_LOAD_CONSTANT: {
             int constant = READ_SHORT();
@@ -144,6 +171,8 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
         BYTE_INSTRUCTION("LOAD_UPVALUE")
         case OPCODE_STORE_UPVALUE:
         BYTE_INSTRUCTION("STORE_UPVALUE")
+        case OPCODE_LOAD_CAPTURED:
+        BYTE_INSTRUCTION("LOAD_CAPTURED")
 
         case OPCODE_LOAD_MODULE_VAR: {
             int slot = READ_SHORT();
@@ -156,6 +185,24 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
             break;
         }
 
+        case OPCODE_LOAD_LOCAL_VAR_CONSTANT:
+        BYTE_INSTRUCTION("LOAD_LOCAL_VAR_CONSTANT")
+        case OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR:
+        BYTE_INSTRUCTION("LOAD_LOCAL_VAR_LOCAL_VAR")
+        case OPCODE_STORE_LOCAL_VAR_POP:
+        BYTE_INSTRUCTION("STORE_LOCAL_VAR_POP")
+
+        case OPCODE_LOAD_MODULE_VAR_CONSTANT: {
+            int slot = READ_SHORT();
+            printf("%-16s %5d '%s'\n", "LOAD_MODULE_VAR_CONSTANT", slot, fun->module->moduleVarName.datas[slot].str);
+            break;
+        }
+        case OPCODE_STORE_MODULE_VAR_POP: {
+            int slot = READ_SHORT();
+            printf("%-16s %5d '%s'\n", "STORE_MODULE_VAR_POP", slot, fun->module->moduleVarName.datas[slot].str);
+            break;
+        }
+
         case OPCODE_LOAD_SELF_FIELD:
         BYTE_INSTRUCTION("LOAD_SELF_FIELD")
         case OPCODE_STORE_SELF_FIELD:
@@ -188,10 +235,92 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
         case OPCODE_CALL16: {
             int numArgs = bytecode[i - 1] - OPCODE_CALL0;
             int symbol = READ_SHORT();
-            printf("CALL%-11d %5d '%s'\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str);
+            int cacheIdx = READ_SHORT();
+            printf("CALL%-11d %5d '%s' ic:%d\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str, cacheIdx);
+            break;
+        }
+
+        case OPCODE_CALL_CLOSURE0:
+        case OPCODE_CALL_CLOSURE1:
+        case OPCODE_CALL_CLOSURE2:
+        case OPCODE_CALL_CLOSURE3:
+        case OPCODE_CALL_CLOSURE4:
+        case OPCODE_CALL_CLOSURE5:
+        case OPCODE_CALL_CLOSURE6:
+        case OPCODE_CALL_CLOSURE7:
+        case OPCODE_CALL_CLOSURE8:
+        case OPCODE_CALL_CLOSURE9:
+        case OPCODE_CALL_CLOSURE10:
+        case OPCODE_CALL_CLOSURE11:
+        case OPCODE_CALL_CLOSURE12:
+        case OPCODE_CALL_CLOSURE13:
+        case OPCODE_CALL_CLOSURE14:
+        case OPCODE_CALL_CLOSURE15:
+        case OPCODE_CALL_CLOSURE16: {
+            int numArgs = bytecode[i - 1] - OPCODE_CALL_CLOSURE0;
+            int symbol = READ_SHORT();
+            int cacheIdx = READ_SHORT();
+            printf("CALL_CLOSURE%-3d %5d '%s' ic:%d\n", numArgs, symbol, vm->allMethodNames.datas[symbol].str, cacheIdx);
             break;
         }
 
+        case OPCODE_ADD:
+        METHOD_INSTRUCTION("ADD")
+        case OPCODE_SUB:
+        METHOD_INSTRUCTION("SUB")
+        case OPCODE_MUL:
+        METHOD_INSTRUCTION("MUL")
+        case OPCODE_DIV:
+        METHOD_INSTRUCTION("DIV")
+        case OPCODE_MOD:
+        METHOD_INSTRUCTION("MOD")
+        case OPCODE_LT:
+        METHOD_INSTRUCTION("LT")
+        case OPCODE_LE:
+        METHOD_INSTRUCTION("LE")
+        case OPCODE_GT:
+        METHOD_INSTRUCTION("GT")
+        case OPCODE_GE:
+        METHOD_INSTRUCTION("GE")
+        case OPCODE_EQ:
+        METHOD_INSTRUCTION("EQ")
+        case OPCODE_NEQ:
+        METHOD_INSTRUCTION("NEQ")
+        case OPCODE_BIT_AND:
+        METHOD_INSTRUCTION("BIT_AND")
+        case OPCODE_BIT_OR:
+        METHOD_INSTRUCTION("BIT_OR")
+        case OPCODE_BIT_SHIFT_LEFT:
+        METHOD_INSTRUCTION("BIT_SHIFT_LEFT")
+        case OPCODE_BIT_SHIFT_RIGHT:
+        METHOD_INSTRUCTION("BIT_SHIFT_RIGHT")
+        case OPCODE_NEG:
+        METHOD_INSTRUCTION("NEG")
+        case OPCODE_BIT_NOT:
+        METHOD_INSTRUCTION("BIT_NOT")
+        case OPCODE_ITERATE:
+        METHOD_INSTRUCTION("ITERATE")
+        case OPCODE_ITERATOR_VALUE:
+        METHOD_INSTRUCTION("ITERATOR_VALUE")
+        case OPCODE_IS:
+        METHOD_INSTRUCTION("IS")
+        case OPCODE_LT_JUMP_IF_FALSE:
+        METHOD_INSTRUCTION("LT_JUMP_IF_FALSE")
+        case OPCODE_LE_JUMP_IF_FALSE:
+        METHOD_INSTRUCTION("LE_JUMP_IF_FALSE")
+        case OPCODE_GT_JUMP_IF_FALSE:
+        METHOD_INSTRUCTION("GT_JUMP_IF_FALSE")
+        case OPCODE_GE_JUMP_IF_FALSE:
+        METHOD_INSTRUCTION("GE_JUMP_IF_FALSE")
+        case OPCODE_EQ_JUMP_IF_FALSE:
+        METHOD_INSTRUCTION("EQ_JUMP_IF_FALSE")
+        case OPCODE_NEQ_JUMP_IF_FALSE:
+        METHOD_INSTRUCTION("NEQ_JUMP_IF_FALSE")
+        case OPCODE_CALL_NUM:
+        METHOD_INSTRUCTION("CALL_NUM")
+        case OPCODE_CALL_OBJ:
+        METHOD_INSTRUCTION("CALL_OBJ")
+
         case OPCODE_SUPER0:
         case OPCODE_SUPER1:
         case OPCODE_SUPER2:
@@ -254,6 +383,10 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
             printf("RETURN\n");
             break;
 
+        case OPCODE_TAIL_RETURN:
+            printf("TAIL_RETURN\n");
+            break;
+
         case OPCODE_CREATE_CLOSURE: {
             int constant = READ_SHORT();
             printf("%-16s %5d ", "CREATE_CLOSURE", constant);
@@ -266,7 +399,7 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
                 int index = READ_BYTE();
                 if (j > 0)
                     printf(", ");
-                printf("%s %d", isLocal ? "local" : "upvalue", index);
+                printf("%s %d", isLocal == CAPTURE_LOCAL_VAR_BY_VALUE ? "value" : (isLocal ? "local" : "upvalue"), index);
             }
             printf("\n");
             break;
@@ -298,6 +431,128 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
             printf("END\n");
             break;
 
+        case OPCODE_REG_SET_TOP:
+            BYTE_INSTRUCTION("REG_SET_TOP")
+
+        case OPCODE_REG_MOVE: {
+            int dst = READ_BYTE();
+            int src = READ_BYTE();
+            printf("%-16s r%d = r%d\n", "REG_MOVE", dst, src);
+            break;
+        }
+
+        case OPCODE_REG_LOAD_CONSTANT: {
+            int dst = READ_BYTE();
+            int constant = READ_SHORT();
+            printf("%-16s r%d = %d '", "REG_LOAD_CONSTANT", dst, constant);
+            dumpValue(fun->constants.datas[constant]);
+            printf("'\n");
+            break;
+        }
+
+        case OPCODE_REG_LOAD_NULL:
+            BYTE_INSTRUCTION("REG_LOAD_NULL")
+
+        case OPCODE_REG_LOAD_TRUE:
+            BYTE_INSTRUCTION("REG_LOAD_TRUE")
+
+        case OPCODE_REG_LOAD_FALSE:
+            BYTE_INSTRUCTION("REG_LOAD_FALSE")
+
+        case OPCODE_REG_LOAD_MODULE_VAR: {
+            int dst = READ_BYTE();
+            int slot = READ_SHORT();
+            printf("%-16s r%d = %d '%s'\n", "REG_LOAD_MODULE_VAR", dst, slot,
+                   fun->module->moduleVarName.datas[slot].str);
+            break;
+        }
+
+        case OPCODE_REG_STORE_MODULE_VAR: {
+            int slot = READ_SHORT();
+            int src = READ_BYTE();
+            printf("%-16s %d '%s' = r%d\n", "REG_STORE_MODULE_VAR", slot,
+                   fun->module->moduleVarName.datas[slot].str, src);
+            break;
+        }
+
+        case OPCODE_REG_LOAD_UPVALUE: {
+            int dst = READ_BYTE();
+            int upvalue = READ_BYTE();
+            printf("%-16s r%d = %d\n", "REG_LOAD_UPVALUE", dst, upvalue);
+            break;
+        }
+
+        case OPCODE_REG_LOAD_CAPTURED: {
+            int dst = READ_BYTE();
+            int upvalue = READ_BYTE();
+            printf("%-16s r%d = %d\n", "REG_LOAD_CAPTURED", dst, upvalue);
+            break;
+        }
+
+        case OPCODE_REG_STORE_UPVALUE: {
+            int upvalue = READ_BYTE();
+            int src = READ_BYTE();
+            printf("%-16s %d = r%d\n", "REG_STORE_UPVALUE", upvalue, src);
+            break;
+        }
+
+        case OPCODE_REG_ADD:
+            REG_BINARY_INSTRUCTION("REG_ADD")
+        case OPCODE_REG_SUB:
+            REG_BINARY_INSTRUCTION("REG_SUB")
+        case OPCODE_REG_MUL:
+            REG_BINARY_INSTRUCTION("REG_MUL")
+        case OPCODE_REG_DIV:
+            REG_BINARY_INSTRUCTION("REG_DIV")
+        case OPCODE_REG_MOD:
+            REG_BINARY_INSTRUCTION("REG_MOD")
+        case OPCODE_REG_LT:
+            REG_BINARY_INSTRUCTION("REG_LT")
+        case OPCODE_REG_LE:
+            REG_BINARY_INSTRUCTION("REG_LE")
+        case OPCODE_REG_GT:
+            REG_BINARY_INSTRUCTION("REG_GT")
+        case OPCODE_REG_GE:
+            REG_BINARY_INSTRUCTION("REG_GE")
+        case OPCODE_REG_EQ:
+            REG_BINARY_INSTRUCTION("REG_EQ")
+        case OPCODE_REG_NEQ:
+            REG_BINARY_INSTRUCTION("REG_NEQ")
+        case OPCODE_REG_BIT_AND:
+            REG_BINARY_INSTRUCTION("REG_BIT_AND")
+        case OPCODE_REG_BIT_OR:
+            REG_BINARY_INSTRUCTION("REG_BIT_OR")
+        case OPCODE_REG_BIT_SHIFT_LEFT:
+            REG_BINARY_INSTRUCTION("REG_BIT_SHIFT_LEFT")
+        case OPCODE_REG_BIT_SHIFT_RIGHT:
+            REG_BINARY_INSTRUCTION("REG_BIT_SHIFT_RIGHT")
+        case OPCODE_REG_LT_JUMP_IF_FALSE:
+            REG_BINARY_INSTRUCTION("REG_LT_JUMP_IF_FALSE")
+        case OPCODE_REG_LE_JUMP_IF_FALSE:
+            REG_BINARY_INSTRUCTION("REG_LE_JUMP_IF_FALSE")
+        case OPCODE_REG_GT_JUMP_IF_FALSE:
+            REG_BINARY_INSTRUCTION("REG_GT_JUMP_IF_FALSE")
+        case OPCODE_REG_GE_JUMP_IF_FALSE:
+            REG_BINARY_INSTRUCTION("REG_GE_JUMP_IF_FALSE")
+        case OPCODE_REG_EQ_JUMP_IF_FALSE:
+            REG_BINARY_INSTRUCTION("REG_EQ_JUMP_IF_FALSE")
+        case OPCODE_REG_NEQ_JUMP_IF_FALSE:
+            REG_BINARY_INSTRUCTION("REG_NEQ_JUMP_IF_FALSE")
+        case OPCODE_REG_NEG:
+            REG_UNARY_INSTRUCTION("REG_NEG")
+        case OPCODE_REG_BIT_NOT:
+            REG_UNARY_INSTRUCTION("REG_BIT_NOT")
+
+        case OPCODE_REG_JUMP_IF_FALSE: {
+            int cond = READ_BYTE();
+            int offset = READ_SHORT();
+            printf("%-16s r%d offset:%-5d abs:%d\n", "REG_JUMP_IF_FALSE", cond, offset, i + offset);
+            break;
+        }
+
+        case OPCODE_REG_RETURN:
+            BYTE_INSTRUCTION("REG_RETURN")
+
         default:
             printf("UNKNOWN! [%d]\n", bytecode[i - 1]);
             break;
@@ -310,6 +565,10 @@ static int dumpOneInstruction(VM *vm, ObjFun *fun, int i, int *lastLine) {
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef BYTE_INSTRUCTION
+#undef METHOD_INSTRUCTION
+#undef REG_BINARY_INSTRUCTION
+#undef REG_UNARY_INSTRUCTION
 }
 
 //打印指令
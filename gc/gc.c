@@ -5,7 +5,9 @@
 #include "gc.h"
 #include "../compiler/compiler.h"
 #include "../objectAndClass/include/obj_list.h"
+#include "../vm/jit.h"
 #include "../lexicalParser/include/parser.h"
+#include <string.h>
 
 #if DEBUG
 #include "../compiler/debug.h"
@@ -51,16 +53,16 @@ static void grayBuffer(VM *vm, ValueBuffer *buffer) {
 //标黑class
 static void blackClass(VM *vm, Class *class) {
     //标灰meta类
-    grayObject(vm, (ObjHeader *) class->objHeader.class);
+    grayObject(vm, (ObjHeader *) OBJ_CLASS(class));
 
     //标灰父类
     grayObject(vm, (ObjHeader *) class->superClass);
 
     //标灰方法
     uint32_t idx = 0;
-    while (idx < class->methods.count) {
-        if (class->methods.datas[idx].methodType == MT_SCRIPT)
-            grayObject(vm, (ObjHeader *) class->methods.datas[idx].obj);
+    while (idx < class->methods.capacity) {
+        if (class->methods.entries[idx].method.methodType == MT_SCRIPT)
+            grayObject(vm, (ObjHeader *) class->methods.entries[idx].method.obj);
         idx++;
     }
 
@@ -69,7 +71,8 @@ static void blackClass(VM *vm, Class *class) {
 
     //累计类大小
     vm->allocatedBytes += sizeof(Class);
-    vm->allocatedBytes += sizeof(Method) * class->methods.capacity;
+    vm->allocatedBytes += sizeof(MethodEntry) * class->methods.capacity;
+    vm->allocatedBytes += sizeof(Class *) * (class->depth + 1);
 }
 
 //标灰闭包
@@ -77,16 +80,19 @@ static void blackClosure(VM *vm, ObjClosure *objClosure) {
     //标灰闭包中的函数
     grayObject(vm, (ObjHeader *) objClosure->fun);
 
-    //标灰闭包中的upvalue
+    //标灰闭包中的upvalue，按值捕获的变量直接标灰其值
     uint32_t idx = 0;
     while (idx < objClosure->fun->upvalueNum) {
-        grayObject(vm, (ObjHeader *) objClosure->upvalues[idx]);
+        if (isUpvalueByValue(objClosure->fun, idx))
+            grayValue(vm, objClosure->upvalues[idx].value);
+        else
+            grayObject(vm, (ObjHeader *) objClosure->upvalues[idx].upvalue);
         idx++;
     }
 
     //累计闭包大小
     vm->allocatedBytes += sizeof(ObjClosure);
-    vm->allocatedBytes += sizeof(ObjUpvalue *) * objClosure->fun->upvalueNum;
+    vm->allocatedBytes += sizeof(CapturedVar) * objClosure->fun->upvalueNum;
 }
 
 //标黑objThread
@@ -118,8 +124,7 @@ static void blackThread(VM *vm, ObjThread *objThread) {
 
     //累计线程大小
     vm->allocatedBytes += sizeof(ObjThread);
-    vm->allocatedBytes += objThread->frameCapacity * sizeof(Frame);
-    vm->allocatedBytes += objThread->stackCapacity * sizeof(Value);
+    vm->allocatedBytes += getThreadStackBytes(objThread);
 }
 
 //标黑Fun
@@ -127,32 +132,46 @@ static void blackFun(VM *vm, ObjFun *fun) {
     //标灰常量
     grayBuffer(vm, &fun->constants);
 
+    grayObject(vm, (ObjHeader *) fun->sharedClosure);
+
+    //标灰内联缓存中的类，避免类被回收后地址被复用而误命中
+    uint32_t idx = 0;
+    while (idx < fun->inlineCacheNum) {
+        InlineCache *inlineCache = &fun->inlineCaches[idx];
+        if (inlineCache->epoch == vm->methodEpoch) {
+            uint32_t entryIdx = 0;
+            while (entryIdx < inlineCache->entryNum) {
+                grayObject(vm, (ObjHeader *) inlineCache->entries[entryIdx].class);
+                entryIdx++;
+            }
+        } else
+            inlineCache->entryNum = 0;
+        idx++;
+    }
+
     //累计ObjFun空间
     vm->allocatedBytes += sizeof(ObjFun);
+    vm->allocatedBytes += sizeof(InlineCache) * fun->inlineCacheNum;
     vm->allocatedBytes += sizeof(uint8_t *) * fun->instrStream.capacity;
     vm->allocatedBytes += sizeof(Value) * fun->constants.capacity;
-
-#if DEBUG
-    //再加上debug信息占用的内存
-    vm->allocatedBytes += sizeof(Int) * fun->instrStream.capacity;
-#endif
+    vm->allocatedBytes += sizeof(Byte) * fun->lineTable.runs.capacity;
 }
 
 //标黑objInstance
 static void blackInstance(VM *vm, ObjInstance *objInstance) {
     //标灰元类
-    grayObject(vm, (ObjHeader *) objInstance->objHeader.class);
+    grayObject(vm, (ObjHeader *) OBJ_CLASS(objInstance));
 
     //标灰实例中所有域，域的个数在class->fieldNum
     uint32_t idx = 0;
-    while (idx < objInstance->objHeader.class->fieldNum) {
+    while (idx < OBJ_CLASS(objInstance)->fieldNum) {
         grayValue(vm, objInstance->fields[idx]);
         idx++;
     }
 
     //累计objInstance空间
     vm->allocatedBytes += sizeof(ObjInstance);
-    vm->allocatedBytes += sizeof(Value) * objInstance->objHeader.class->fieldNum;
+    vm->allocatedBytes += sizeof(Value) * OBJ_CLASS(objInstance)->fieldNum;
 }
 
 //标黑objList
@@ -289,20 +308,26 @@ void freeObject(VM *vm, ObjHeader *obj) {
     //根据对象类型分别处理
     switch (obj->objType) {
         case OT_CLASS:
-            MethodBufferClear(vm, &((Class *) obj)->methods);
+            DEALLOCATE_ARRAY(vm, ((Class *) obj)->methods.entries, ((Class *) obj)->methods.capacity);
+            DEALLOCATE_ARRAY(vm, ((Class *) obj)->display, (((Class *) obj)->depth + 1));
             break;
         case OT_THREAD: {
             ObjThread *objThread = (ObjThread *) obj;
-            DEALLOCATE(vm, objThread->frames);
-            DEALLOCATE(vm, objThread->stack);
+            freeThreadStack(vm, objThread);
             break;
         }
         case OT_FUNCTION: {
             ObjFun *objFun = (ObjFun *) obj;
             ValueBufferClear(vm, &objFun->constants);
-            ByteBufferClear(vm, &objFun->instrStream);
+            if (!objFun->isCodeMapped)
+                ByteBufferClear(vm, &objFun->instrStream);
+            ByteBufferClear(vm, &objFun->lineTable.runs);
+            DEALLOCATE_ARRAY(vm, objFun->inlineCaches, objFun->inlineCacheNum);
+#if ENABLE_JIT
+            if (objFun->jitCode != NULL)
+                freeJitCode(vm, objFun->jitCode);
+#endif
 #if DEBUG
-            IntBufferClear(vm, &objFun->debug->lineNo);
             DEALLOCATE(vm, objFun->debug->funName);
             DEALLOCATE(vm, objFun->debug);
 #endif
@@ -325,7 +350,7 @@ void freeObject(VM *vm, ObjHeader *obj) {
         case OT_UPVALUE:
             break;
     }
-    DEALLOCATE(vm, obj);
+    DEALLOCATE_OBJ(vm, obj);
 }
 
 //立即运行垃圾回收器去释放未用的内存
@@ -362,26 +387,52 @@ void startGC(VM *vm) {
     //置黑所有灰色对象
     blackObjectInGray(vm);
 
+    //此时allocatedBytes是存活对象的大小，清扫时释放对象会经memManager再减去其大小，故先记下
+    uint32_t liveBytes = vm->allocatedBytes;
+
     //清扫阶段：回收白色对象
-    ObjHeader **obj = &vm->allObjects;
-    while (*obj != NULL) {
+    //链表指针可能被压缩为偏移，故记下前一个对象而不是前一个next域的地址
+    ObjHeader *prev = NULL;
+    ObjHeader *obj = vm->allObjects;
+    while (obj != NULL) {
+        ObjHeader *next = OBJ_NEXT(obj);
         //回收白色对象
-        if (!((*obj)->isDark)) {
-            ObjHeader *unreached = *obj;
-            *obj = unreached->next;
-            freeObject(vm, unreached);
+        if (!obj->isDark) {
+            if (prev == NULL)
+                vm->allObjects = next;
+            else
+                OBJ_SET_NEXT(prev, next);
+            freeObject(vm, obj);
         } else {
             //如果已经是黑色对象，为了下一次gc重新判定，现在将其恢复为未标记状态，避免被gc遗忘
-            (*obj)->isDark = false;
-            obj = &(*obj)->next;
+            obj->isDark = false;
+            prev = obj;
         }
+        obj = next;
     }
 
+    vm->allocatedBytes = liveBytes;
+
+    //被回收的类的地址可能被新对象复用，清空全局方法查找缓存
+    memset(vm->methodCache, 0, sizeof(MethodCacheEntry) * METHOD_CACHE_SIZE);
+
     //更新下一次触发gc的阈值
-    vm->config.nextGC = vm->allocatedBytes * vm->config.heapGrowthFactor;
+    vm->config.nextGC = (uint32_t) (vm->allocatedBytes * vm->config.heapGrowthFactor);
     if (vm->config.nextGC < vm->config.minHeapSize)
         vm->config.nextGC = vm->config.minHeapSize;
 
+    //设置了堆上限时，不等超过上限才回收
+    if (vm->config.maxHeapSize != 0) {
+        if (vm->config.nextGC > vm->config.maxHeapSize)
+            vm->config.nextGC = vm->config.maxHeapSize;
+        //回收后仍超过上限说明存活对象太多，由vm在下一个回边或函数调用处中止当前线程
+        if (vm->allocatedBytes > vm->config.maxHeapSize && vm->curThread != NULL && !vm->isHeapExhausted) {
+            vm->isHeapExhausted = true;
+            vm->suspendedBudget = vm->instructionBudget;
+            vm->instructionBudget = 1;
+        }
+    }
+
 #ifdef DEBUG
     double elapsed = ((double) clock() / CLOCKS_PER_SEC) - startTime;
     printf("GC %lu before, %lu after (%lu collected), next at %lu. take %.3fs.\n",
@@ -8,31 +8,29 @@
 #include "../../vm/core.h"
 #include "../../compiler/compiler.h"
 
-DEFINE_BUFFER_METHOD(Method)
-
 //判断a和b是否相等
 bool valueIsEqual(Value a, Value b) {
     //类型不同则无需进行后面的比较
-    if (a.type != b.type)
+    if (VALUE_TYPE(a) != VALUE_TYPE(b))
         return false;
 
-    if (a.type == VT_NUM)
-        return (bool) (a.num == b.num);
+    if (VALUE_IS_NUM(a))
+        return (bool) (VALUE_TO_NUM(a) == VALUE_TO_NUM(b));
 
-    if (a.objHeader == b.objHeader)
+    if (VALUE_TO_OBJ(a) == VALUE_TO_OBJ(b))
         return true;
 
-    if (a.objHeader->objType != b.objHeader->objType)
+    if (VALUE_TO_OBJ(a)->objType != VALUE_TO_OBJ(b)->objType)
         return false;
 
-    if (a.objHeader->objType == OT_STRING) {
+    if (VALUE_TO_OBJ(a)->objType == OT_STRING) {
         ObjString *strA = VALUE_TO_OBJSTR(a);
         ObjString *strB = VALUE_TO_OBJSTR(b);
         return (bool) (strA->value.length == strB->value.length &&
                        memcmp(strA->value.start, strB->value.start, strA->value.length) == 0);
     }
 
-    if (a.objHeader->objType == OT_RANGE) {
+    if (VALUE_TO_OBJ(a)->objType == OT_RANGE) {
         ObjRange *rgA = VALUE_TO_OBJRANGE(a);
         ObjRange *rgB = VALUE_TO_OBJRANGE(b);
         return (bool) (rgA->from == rgB->from && rgA->to == rgB->to);
@@ -43,16 +41,22 @@ bool valueIsEqual(Value a, Value b) {
 
 //新建裸类
 Class *newRawClass(VM *vm, const char *name, uint32_t fieldNum) {
-    Class *class = ALLOCATE(vm, Class);
+    Class *class = ALLOCATE_OBJ(vm, Class);
 
     //裸类无元类
     initObjHeader(vm, &class->objHeader, OT_CLASS, NULL);
     class->name = newObjString(vm, name, strlen(name));
     class->fieldNum = fieldNum;
     class->superClass = NULL; //裸类无基类
+    class->isLookedUp = false;
 
     pushTmpRoot(vm, (ObjHeader *) class);
-    MethodBufferInit(&class->methods);
+    class->methods.entries = NULL;
+    class->methods.count = class->methods.capacity = 0;
+    class->depth = 0;
+    class->display = NULL;
+    class->display = ALLOCATE_ARRAY(vm, Class *, 1);
+    class->display[0] = class;
     popTmpRoot(vm);
     return class;
 }
@@ -69,7 +73,7 @@ Class *newClass(VM *vm, ObjString *className, uint32_t fieldNum, Class *superCla
 
     //先创建子类的meta类
     Class *metaClass = newRawClass(vm, newClassName, 0);
-    metaClass->objHeader.class = vm->classOfClass;
+    OBJ_SET_CLASS(metaClass, vm->classOfClass);
     pushTmpRoot(vm, (ObjHeader *) metaClass);
 
     //绑定classOfClass为meta类的基类，所有类的meta类的基类都是classOfClass
@@ -81,7 +85,7 @@ Class *newClass(VM *vm, ObjString *className, uint32_t fieldNum, Class *superCla
     Class *class = newRawClass(vm, newClassName, fieldNum);
     pushTmpRoot(vm, (ObjHeader *) class);
 
-    className->objHeader.class = metaClass;
+    OBJ_SET_CLASS(class, metaClass);
     bindSuperClass(vm, class, superClass);
 
     popTmpRoot(vm); //metaclass
@@ -92,7 +96,7 @@ Class *newClass(VM *vm, ObjString *className, uint32_t fieldNum, Class *superCla
 
 //数字等Value也被视为对象，因此参数为Value，获得对象obj所属的类
 Class *getClassOfObj(VM *vm, Value object) {
-    switch (object.type) {
+    switch (VALUE_TYPE(object)) {
         case VT_NULL:
             return vm->nullClass;
         case VT_FALSE:
@@ -101,8 +105,97 @@ Class *getClassOfObj(VM *vm, Value object) {
         case VT_NUM:
             return vm->numClass;
         case VT_OBJ:
-            return VALUE_TO_OBJ(object)->class;
+            return OBJ_CLASS(VALUE_TO_OBJ(object));
         default:
             NOT_REACHED()
     }
 }
+
+//在entries中写入方法，若是新的方法名则返回true
+static bool addMethodEntry(MethodEntry *entries, uint32_t capacity, uint32_t index, Method method) {
+    uint32_t slot = index & (capacity - 1);
+
+    //开放探测定址，找到同名方法或空位
+    while (entries[slot].method.methodType != MT_NONE) {
+        if (entries[slot].index == index) {
+            entries[slot].method = method;
+            return false;
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+    entries[slot].index = index;
+    entries[slot].method = method;
+    return true;
+}
+
+//使方法表的容量调整到newCapacity
+static void resizeMethodTable(VM *vm, MethodTable *table, uint32_t newCapacity) {
+    MethodEntry *newEntries = ALLOCATE_ARRAY(vm, MethodEntry, newCapacity);
+    uint32_t idx = 0;
+    while (idx < newCapacity) {
+        newEntries[idx].method.methodType = MT_NONE;
+        idx++;
+    }
+
+    //把原entries中的方法插入到newEntries
+    idx = 0;
+    while (idx < table->capacity) {
+        if (table->entries[idx].method.methodType != MT_NONE)
+            addMethodEntry(newEntries, newCapacity, table->entries[idx].index, table->entries[idx].method);
+        idx++;
+    }
+
+    DEALLOCATE_ARRAY(vm, table->entries, table->capacity);
+    table->entries = newEntries;
+    table->capacity = newCapacity;
+}
+
+//在方法表中设置方法名索引为index的方法
+void methodTableSet(VM *vm, MethodTable *table, uint32_t index, Method method) {
+    //装载因子超过0.75时扩容
+    if ((table->count + 1) * 4 > table->capacity * 3)
+        resizeMethodTable(vm, table, table->capacity == 0 ? 8 : table->capacity * 2);
+
+    if (addMethodEntry(table->entries, table->capacity, index, method))
+        table->count++;
+}
+
+//在类自身的方法表中查找方法，没有则返回NULL
+static Method *findOwnMethod(Class *class, uint32_t index) {
+    MethodTable *table = &class->methods;
+    if (table->capacity == 0)
+        return NULL;
+
+    uint32_t slot = index & (table->capacity - 1);
+    while (table->entries[slot].method.methodType != MT_NONE) {
+        if (table->entries[slot].index == index)
+            return &table->entries[slot].method;
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+//查找类class响应的方法，自身没有就沿基类链向上查找，没有则返回NULL
+//结果记入全局方法查找缓存，bindMethod改变vm->methodEpoch后缓存失效
+//途经的类都标记为查找过，只有向这些类绑定方法才会改变vm->methodEpoch
+Method *findMethod(VM *vm, Class *class, uint32_t index) {
+    uint32_t hash = (uint32_t) ((uintptr_t) class >> 4) ^ (index * 2654435761u);
+    MethodCacheEntry *cacheEntry = &vm->methodCache[hash & (METHOD_CACHE_SIZE - 1)];
+    if (cacheEntry->class == class && cacheEntry->index == index && cacheEntry->epoch == vm->methodEpoch)
+        return cacheEntry->method;
+
+    Method *method = NULL;
+    Class *cur = class;
+    while (cur != NULL) {
+        cur->isLookedUp = true;
+        if ((method = findOwnMethod(cur, index)) != NULL)
+            break;
+        cur = cur->superClass;
+    }
+
+    cacheEntry->class = class;
+    cacheEntry->index = index;
+    cacheEntry->epoch = vm->methodEpoch;
+    cacheEntry->method = method;
+    return method;
+}
@@ -20,9 +20,27 @@ typedef enum {
     MT_FUN_CALL   // 函数对象的调用方法，用来实现函数重载
 } MethodType;     // 方法类型
 
+#if NAN_BOXING
+//数字直接存储为double的位模式，其余值都编码在quiet NaN中
+//置了符号位的是对象，低48位是对象指针；否则低3位是标签，标签为ValueType加1，0留给真正的NaN
+#define SIGN_BIT ((uint64_t) 1 << 63)
+#define QNAN ((uint64_t) 0x7ffc000000000000)
+
+#define VT_TO_VALUE(vt) ((Value) (QNAN | ((uint64_t) (vt) + 1)))
+#define VALUE_TYPE(value) getValueType(value)
+
+#define VALUE_TO_BOOL(value) ((value) == VT_TO_VALUE(VT_TRUE))
+
+#define NUM_TO_VALUE(num) numToValue(num)
+#define VALUE_TO_NUM(value) valueToNum(value)
+
+#define OBJ_TO_VALUE(objPtr) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (objPtr)))
+
+#define VALUE_TO_OBJ(value) ((ObjHeader *) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+#else
 #define VT_TO_VALUE(vt) ((Value){vt, {0}})
+#define VALUE_TYPE(value) ((value).type)
 
-#define BOOL_TO_VALUE(boolean) (boolean ? VT_TO_VALUE(VT_TRUE) : VT_TO_VALUE(VT_FALSE))
 #define VALUE_TO_BOOL(value) ((value).type == VT_TRUE ? true : false)
 
 #define NUM_TO_VALUE(num) ((Value){VT_NUM, {num}})
@@ -36,6 +54,10 @@ typedef enum {
         })
 
 #define VALUE_TO_OBJ(value) (value.objHeader)
+#endif
+
+#define BOOL_TO_VALUE(boolean) (boolean ? VT_TO_VALUE(VT_TRUE) : VT_TO_VALUE(VT_FALSE))
+
 #define VALUE_TO_OBJSTR(value) ((ObjString *) VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJFUN(value) ((ObjFun *) VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJRANGE(value) ((ObjRange *) VALUE_TO_OBJ(value))
@@ -47,19 +69,29 @@ typedef enum {
 #define VALUE_TO_OBJTHREAD(value) ((ObjThread *) VALUE_TO_OBJ(value))
 #define VALUE_TO_OBJMODULE(value) ((ObjModule *) VALUE_TO_OBJ(value))
 
+#if NAN_BOXING
+#define VALUE_IS_UNDEFINED(value) ((value) == VT_TO_VALUE(VT_UNDEFINED))
+#define VALUE_IS_NULL(value) ((value) == VT_TO_VALUE(VT_NULL))
+#define VALUE_IS_TRUE(value) ((value) == VT_TO_VALUE(VT_TRUE))
+#define VALUE_IS_FALSE(value) ((value) == VT_TO_VALUE(VT_FALSE))
+#define VALUE_IS_NUM(value) (((value) & QNAN) != QNAN)
+#define VALUE_IS_OBJ(value) (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+#else
 #define VALUE_IS_UNDEFINED(value) ((value).type == VT_UNDEFINED)
 #define VALUE_IS_NULL(value) ((value).type == VT_NULL)
 #define VALUE_IS_TRUE(value) ((value).type == VT_TRUE)
 #define VALUE_IS_FALSE(value) ((value).type == VT_FALSE)
 #define VALUE_IS_NUM(value) ((value).type == VT_NUM)
 #define VALUE_IS_OBJ(value) ((value).type == VT_OBJ)
+#endif
 #define VALUE_IS_CERTAIN_OBJ(value, type) (VALUE_IS_OBJ(value) && VALUE_TO_OBJ(value)->objType == type)
 #define VALUE_IS_OBJSTR(value) (VALUE_IS_CERTAIN_OBJ(value, OT_STRING))
 #define VALUE_IS_OBJINSTANCE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_INSTANCE))
 #define VALUE_IS_OBJCLOSURE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_CLOSURE))
+#define VALUE_IS_OBJFUN(value) (VALUE_IS_CERTAIN_OBJ(value, OT_FUNCTION))
 #define VALUE_IS_OBJRANGE(value) (VALUE_IS_CERTAIN_OBJ(value, OT_RANGE))
 #define VALUE_IS_CLASS(value) (VALUE_IS_CERTAIN_OBJ(value, OT_CLASS))
-#define VALUE_IS_0(value) (VALUE_IS_NUM(value) && (value).num == 0)
+#define VALUE_IS_0(value) (VALUE_IS_NUM(value) && VALUE_TO_NUM(value) == 0)
 
 //原生方法指针
 typedef bool (*Primitive)(VM *vm, Value *args);
@@ -74,23 +106,91 @@ typedef struct {
     };
 } Method;
 
-DECLARE_BUFFER_TYPE(Method)
+typedef struct {
+    uint32_t index; //方法名在vm->allMethodNames中的索引
+    Method method; //methodType为MT_NONE表示空位
+} MethodEntry;
+
+typedef struct {
+    MethodEntry *entries;
+    uint32_t count; //已绑定的方法数
+    uint32_t capacity; //entries的容量，为0或2的幂
+} MethodTable; //类自身定义的方法，以方法名索引开放定址，继承的方法沿基类链查找
+
+#define METHOD_CACHE_SIZE 1024 //全局方法查找缓存的项数，须为2的幂
+
+struct methodCacheEntry {
+    Class *class; //查找方法的类
+    uint32_t index; //方法名索引
+    uint32_t epoch; //建立缓存时的vm->methodEpoch
+    Method *method; //找到的方法，NULL表示类及其基类都没有该方法
+};
+
+#define INLINE_CACHE_SIZE 4 //多态内联缓存最多记录的receiver类个数
+
+typedef struct {
+    Class *class; //receiver的类
+    Method method; //在该类中查找到的方法
+} InlineCacheEntry;
+
+struct inlineCache {
+    uint32_t epoch; //建立缓存时的vm->methodEpoch，不相等说明有方法被重新绑定，缓存已失效
+    uint8_t entryNum; //已缓存的receiver类个数
+    bool isMegamorphic; //receiver类超过INLINE_CACHE_SIZE个后不再缓存，直接查方法表
+    uint8_t argNum; //调用点的参数个数（含receiver），供快速化后的指令使用
+    uint8_t genericOpCode; //快速化之前的指令，守卫失败时据此还原
+    InlineCacheEntry entries[INLINE_CACHE_SIZE];
+};
 
 //类是对象的模板
 struct class {
     ObjHeader objHeader;
     struct class *superClass; //父类
     uint32_t fieldNum; //类的字段数，包括基类的字段数
-    MethodBuffer methods; //类方法
+    MethodTable methods; //类自身定义的方法
     ObjString *name; //类名
+
+    //findMethod是否查找过本类，查找过才可能有缓存记下了本类或其祖先的方法，此后再绑定方法需使缓存失效
+    bool isLookedUp;
+
+    //继承链的display，display[i]是深度为i的祖先，display[depth]是类自身，判断子类只需一次比较
+    uint32_t depth; //在继承链中的深度，没有基类的类为0
+    struct class **display;
 }; //对象类
 
+//class是否为baseClass或其子类
+static inline bool isSubClass(Class *class, Class *baseClass) {
+    return class->depth >= baseClass->depth && class->display[baseClass->depth] == baseClass;
+}
+
 typedef union {
     uint64_t bits64;
     uint32_t bits32[2];
     double num;
 } Bits64; //存储64位数据
 
+#if NAN_BOXING
+static inline Value numToValue(double num) {
+    Bits64 bits64;
+    bits64.num = num;
+    return bits64.bits64;
+}
+
+static inline double valueToNum(Value value) {
+    Bits64 bits64;
+    bits64.bits64 = value;
+    return bits64.num;
+}
+
+static inline ValueType getValueType(Value value) {
+    if (VALUE_IS_NUM(value))
+        return VT_NUM;
+    if (VALUE_IS_OBJ(value))
+        return VT_OBJ;
+    return (ValueType) ((value & 7) - 1);
+}
+#endif
+
 #define CAPACITY_GROW_FACTOR 4
 #define MIN_CAPACITY 64
 
@@ -98,5 +198,7 @@ bool valueIsEqual(Value a, Value b);
 Class *newRawClass(VM *vm, const char *name, uint32_t fieldNum);
 Class *newClass(VM *vm, ObjString *className, uint32_t fieldNum, Class *superClass);
 Class *getClassOfObj(VM *vm, Value object);
+void methodTableSet(VM *vm, MethodTable *table, uint32_t index, Method method);
+Method *findMethod(VM *vm, Class *class, uint32_t index);
 
 #endif // STOVE_CLASS_H
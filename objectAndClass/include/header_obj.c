@@ -11,7 +11,7 @@ DEFINE_BUFFER_METHOD(Value)
 void initObjHeader(VM *vm, ObjHeader *objHeader, ObjType objType, Class *class) {
     objHeader->objType = objType;
     objHeader->isDark = false;
-    objHeader->class = class; //设置meta类
-    objHeader->next = vm->allObjects;
+    OBJ_SET_CLASS(objHeader, class); //设置meta类
+    OBJ_SET_NEXT(objHeader, vm->allObjects);
     vm->allObjects = objHeader;
 }
@@ -21,6 +21,24 @@ typedef enum {
     OT_THREAD
 } ObjType; //对象类型
 
+#if COMPRESSED_HEAP
+typedef struct objHeader {
+    uint8_t objType; //ObjType
+    bool isDark; //对象是否可达
+    uint32_t classRef; //对象所属类在对象堆中的偏移
+    uint32_t nextRef; //链接所有分配的对象，下一个对象在对象堆中的偏移
+} ObjHeader; //对象头，用于记录元信息和GC
+
+//对象堆中的32位偏移与指针互转，偏移0表示NULL
+#define HEAP_REF_TO_PTR(ref) ((ref) == 0 ? NULL : (void *) (objHeapBase + (ref)))
+#define PTR_TO_HEAP_REF(ptr) ((ptr) == NULL ? 0 : (uint32_t) ((char *) (ptr) - objHeapBase))
+
+//对象头中的类和链表指针都经由下面的宏存取，obj是任意以对象头开头的对象指针
+#define OBJ_CLASS(obj) ((Class *) HEAP_REF_TO_PTR(((ObjHeader *) (obj))->classRef))
+#define OBJ_SET_CLASS(obj, cls) (((ObjHeader *) (obj))->classRef = PTR_TO_HEAP_REF(cls))
+#define OBJ_NEXT(obj) ((ObjHeader *) HEAP_REF_TO_PTR(((ObjHeader *) (obj))->nextRef))
+#define OBJ_SET_NEXT(obj, nextObj) (((ObjHeader *) (obj))->nextRef = PTR_TO_HEAP_REF(nextObj))
+#else
 typedef struct objHeader {
     ObjType objType;
     bool isDark; //对象是否可达
@@ -28,6 +46,12 @@ typedef struct objHeader {
     struct objHeader *next; //链接所有分配的对象，链表
 } ObjHeader; //对象头，用于记录元信息和GC
 
+#define OBJ_CLASS(obj) (((ObjHeader *) (obj))->class)
+#define OBJ_SET_CLASS(obj, cls) (((ObjHeader *) (obj))->class = (cls))
+#define OBJ_NEXT(obj) (((ObjHeader *) (obj))->next)
+#define OBJ_SET_NEXT(obj, nextObj) (((ObjHeader *) (obj))->next = (nextObj))
+#endif
+
 typedef enum {
     VT_UNDEFINED,
     VT_NULL,
@@ -37,6 +61,9 @@ typedef enum {
     VT_OBJ //值为对象，指向对象头
 } ValueType; //value类型
 
+#if NAN_BOXING
+typedef uint64_t Value; //通用的值，NaN-boxing编码，各类型的存取见class.h中的宏
+#else
 typedef struct {
     ValueType type;
     union {
@@ -44,6 +71,7 @@ typedef struct {
         ObjHeader *objHeader;
     };
 } Value; //通用的值结构
+#endif
 
 DECLARE_BUFFER_TYPE(Value)
 
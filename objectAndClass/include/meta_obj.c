@@ -8,7 +8,7 @@
 
 //新建模块
 ObjModule *newObjModule(VM *vm, const char *modName) {
-    ObjModule *objModule = ALLOCATE(vm, ObjModule);
+    ObjModule *objModule = ALLOCATE_OBJ(vm, ObjModule);
     if (objModule == NULL)
         MEM_ERROR("allocate ObjModule memory failed.");
 
@@ -29,7 +29,7 @@ ObjModule *newObjModule(VM *vm, const char *modName) {
 //创建类实例
 ObjInstance *newObjInstance(VM *vm, Class *class) {
     //参数class主要作用是提供类中field的数目
-    ObjInstance *objInstance = ALLOCATE_EXTRA(vm, ObjInstance, sizeof(Value) * class->fieldNum);
+    ObjInstance *objInstance = ALLOCATE_OBJ_EXTRA(vm, ObjInstance, sizeof(Value) * class->fieldNum);
 
     //在此关联对象的类为参数class
     initObjHeader(vm, &objInstance->objHeader, OT_INSTANCE, class);
@@ -4,36 +4,127 @@
 
 #include "obj_fun.h"
 #include "class.h"
+#include <string.h>
 
 //创建一个空函数
 ObjFun *newObjFun(VM *vm, ObjModule *objModule, uint32_t slotNum) {
-    ObjFun *objFun = ALLOCATE(vm, ObjFun);
+    ObjFun *objFun = ALLOCATE_OBJ(vm, ObjFun);
     if (objFun == NULL)
         MEM_ERROR("allocate ObjFun failed.");
     initObjHeader(vm, &objFun->objHeader, OT_FUNCTION, vm->funClass);
     ByteBufferInit(&objFun->instrStream);
+    objFun->isCodeMapped = false;
     ValueBufferInit(&objFun->constants);
     objFun->module = objModule;
     objFun->maxStackSlotUsedNum = slotNum;
     objFun->upvalueNum = objFun->argNum = 0;
+    memset(objFun->byValueUpvalues, 0, sizeof(objFun->byValueUpvalues));
+    objFun->inlineCaches = NULL;
+    objFun->inlineCacheNum = 0;
+    objFun->sharedClosure = NULL;
+    initLineTable(&objFun->lineTable);
+#if ENABLE_JIT
+    objFun->callCount = objFun->loopCount = 0;
+    objFun->jitCode = NULL;
+    objFun->jitFailed = false;
+#endif
 #ifdef DEBUG
     objFun->debug = ALLOCATE(vm, FunDebug);
     objFun->debug->funName = NULL;
-    IntBufferInit(&objFun->debug->lineNo);
 #endif
     return objFun;
 }
 
+void initLineTable(LineTable *lineTable) {
+    ByteBufferInit(&lineTable->runs);
+    lineTable->firstLineNo = lineTable->runLineNo = lineTable->curLineNo = 0;
+    lineTable->curBytes = 0;
+}
+
+//把当前段写入runs
+static void flushLineRun(VM *vm, LineTable *lineTable) {
+    int delta = (int) lineTable->curLineNo - (int) lineTable->runLineNo;
+    while (delta > INT8_MAX) {
+        ByteBufferAdd(vm, &lineTable->runs, 0);
+        ByteBufferAdd(vm, &lineTable->runs, (Byte) INT8_MAX);
+        delta -= INT8_MAX;
+    }
+    while (delta < INT8_MIN) {
+        ByteBufferAdd(vm, &lineTable->runs, 0);
+        ByteBufferAdd(vm, &lineTable->runs, (Byte) INT8_MIN);
+        delta -= INT8_MIN;
+    }
+
+    uint32_t bytes = lineTable->curBytes;
+    while (bytes > UINT8_MAX) {
+        ByteBufferAdd(vm, &lineTable->runs, UINT8_MAX);
+        ByteBufferAdd(vm, &lineTable->runs, (Byte) delta);
+        bytes -= UINT8_MAX;
+        delta = 0;
+    }
+    ByteBufferAdd(vm, &lineTable->runs, (Byte) bytes);
+    ByteBufferAdd(vm, &lineTable->runs, (Byte) delta);
+    lineTable->runLineNo = lineTable->curLineNo;
+}
+
+//记录指令流中新写入的1字节位于源码第lineNo行
+void lineTableAdd(VM *vm, LineTable *lineTable, uint32_t lineNo) {
+    if (lineTable->curBytes == 0 && lineTable->runs.count == 0)
+        lineTable->firstLineNo = lineTable->runLineNo = lineTable->curLineNo = lineNo;
+    else if (lineNo != lineTable->curLineNo) {
+        flushLineRun(vm, lineTable);
+        lineTable->curLineNo = lineNo;
+        lineTable->curBytes = 0;
+    }
+    lineTable->curBytes++;
+}
+
+//获得指令流中ip处的字节对应的源码行号
+uint32_t getLineNo(LineTable *lineTable, uint32_t ip) {
+    uint32_t start = 0;
+    int lineNo = (int) lineTable->firstLineNo;
+    uint32_t idx = 0;
+    while (idx < lineTable->runs.count) {
+        uint32_t bytes = lineTable->runs.datas[idx];
+        lineNo += (int8_t) lineTable->runs.datas[idx + 1];
+        if (ip < start + bytes)
+            return (uint32_t) lineNo;
+        start += bytes;
+        idx += 2;
+    }
+    //不在已写入的段中就在当前段
+    return lineTable->curLineNo;
+}
+
+//把行号表展开为每个字节一项的数组，供顺序遍历指令流时使用，count是指令流的长度
+void expandLineTable(LineTable *lineTable, uint32_t *lineNos, uint32_t count) {
+    uint32_t ip = 0;
+    int lineNo = (int) lineTable->firstLineNo;
+    uint32_t idx = 0;
+    while (idx < lineTable->runs.count && ip < count) {
+        uint32_t bytes = lineTable->runs.datas[idx];
+        lineNo += (int8_t) lineTable->runs.datas[idx + 1];
+        while (bytes-- > 0 && ip < count)
+            lineNos[ip++] = (uint32_t) lineNo;
+        idx += 2;
+    }
+    while (ip < count)
+        lineNos[ip++] = lineTable->curLineNo;
+}
+
 //以函数fun创建一个闭包
 ObjClosure *newObjClosure(VM *vm, ObjFun *objFun) {
-    ObjClosure *objClosure = ALLOCATE_EXTRA(vm, ObjClosure, sizeof(ObjUpvalue *) * objFun->upvalueNum);
+    ObjClosure *objClosure = ALLOCATE_OBJ_EXTRA(vm, ObjClosure, sizeof(CapturedVar) * objFun->upvalueNum);
     initObjHeader(vm, &objClosure->objHeader, OT_CLOSURE, vm->funClass);
     objClosure->fun = objFun;
 
     //清除upvalue数组，以避免在填充upvalue数组之前触发GC
     uint32_t idx = 0;
     while (idx < objFun->upvalueNum) {
-        objClosure->upvalues[idx] = NULL;
+        if (isUpvalueByValue(objFun, idx))
+            objClosure->upvalues[idx].value = VT_TO_VALUE(VT_NULL);
+        else
+            objClosure->upvalues[idx].upvalue = NULL;
         idx++;
     }
 
@@ -42,7 +133,7 @@ ObjClosure *newObjClosure(VM *vm, ObjFun *objFun) {
 
 //创建upvalue对象
 ObjUpvalue *newObjUpvalue(VM *vm, Value *localVarPtr) {
-    ObjUpvalue *objUpvalue = ALLOCATE(vm, ObjUpvalue);
+    ObjUpvalue *objUpvalue = ALLOCATE_OBJ(vm, ObjUpvalue);
     initObjHeader(vm, &objUpvalue->objHeader, OT_UPVALUE, NULL);
     objUpvalue->localVarPtr = localVarPtr;
     objUpvalue->closedUpvalue = VT_TO_VALUE(VT_NULL);
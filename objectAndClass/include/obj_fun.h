@@ -8,14 +8,30 @@
 #include "../../utils/utils.h"
 #include "meta_obj.h"
 
+#define MAX_UPVALUE_NUM 128
+
 typedef struct {
     char *funName; //函数名
-    IntBuffer lineNo; //行号
 } FunDebug; //函数中的调试结构
 
+//行号表，记录指令流中每个字节对应的源码行号，供出错时的调用栈和调试输出使用
+//行号相同的连续字节记为一段，每段占2字节：段内字节数和相对上一段的行号增量
+//段长超过UINT8_MAX时拆成多段，增量超出int8_t时先写入字节数为0的段补足
+typedef struct {
+    ByteBuffer runs; //已写入的段
+    uint32_t firstLineNo; //第一段行号增量的基准
+    uint32_t runLineNo; //最后写入的一段的行号
+    uint32_t curLineNo; //尚未写入runs的当前段的行号
+    uint32_t curBytes; //当前段的字节数
+} LineTable;
+
+typedef struct inlineCache InlineCache; //调用点的内联缓存，定义在class.h
+typedef struct jitCode JitCode; //JIT编译出的机器码，定义在jit.h
+
 typedef struct {
     ObjHeader objHeader;
     ByteBuffer instrStream; //函数编译后的指令流
+    bool isCodeMapped; //指令流直接指向映射的bundle，不归本函数所有，不能释放或扩容
     ValueBuffer constants; //函数中的常量表
 
     ObjModule *module; //本函数所属的模块
@@ -23,8 +39,25 @@ typedef struct {
     //本函数最多需要的栈空间，是栈使用空间的峰值
     uint32_t maxStackSlotUsedNum;
     uint32_t upvalueNum; //本函数所涵盖的upvalue数量
+    uint8_t byValueUpvalues[MAX_UPVALUE_NUM / 8]; //按位记录哪些upvalue按值捕获，其值直接存在闭包中
     uint8_t argNum; //函数形参个数
 
+    LineTable lineTable; //指令流的行号表，不受DEBUG影响始终存在
+
+    //内联缓存表，每个CALLx调用点占一项，由指令的第二个操作数索引
+    InlineCache *inlineCaches;
+    uint32_t inlineCacheNum; //调用点个数
+
+    //没有upvalue的函数创建出的闭包彼此无区别，首次创建后缓存于此共用
+    struct objClosure *sharedClosure;
+
+#if ENABLE_JIT
+    uint32_t callCount; //被调用的次数
+    uint32_t loopCount; //循环回边执行的次数
+    JitCode *jitCode; //编译出的机器码，未编译时为NULL
+    bool jitFailed; //编译失败或没有可翻译的指令，不再尝试
+#endif
+
 #if DEBUG
     FunDebug *debug;
 #endif
@@ -42,12 +75,22 @@ typedef struct upvalue {
     struct upvalue *next; //链接openUpvalue的链表
 } ObjUpvalue; //upvalue对象
 
-typedef struct {
+typedef union {
+    ObjUpvalue *upvalue; //按引用捕获时指向关联该变量的upvalue对象
+    Value value; //按值捕获时直接存储变量的值
+} CapturedVar; //闭包捕获的变量
+
+typedef struct objClosure {
     ObjHeader objHeader;
     ObjFun *fun; //闭包中所要引用的函数
-    ObjUpvalue *upvalues[0]; //用于存储此函数的closedUpvalue
+    CapturedVar upvalues[0]; //此函数捕获的变量，哪种捕获方式由fun->byValueUpvalues决定
 } ObjClosure; //闭包对象
 
+//fun的第idx个upvalue是否按值捕获
+static inline bool isUpvalueByValue(ObjFun *fun, uint32_t idx) {
+    return (fun->byValueUpvalues[idx >> 3] >> (idx & 7)) & 1;
+}
+
 typedef struct {
     uint8_t *ip; //程序计数器，指向下一个将被执行的指令
     //在本frame中执行的闭包函数
@@ -63,5 +106,9 @@ typedef struct {
 ObjUpvalue *newObjUpvalue(VM *vm, Value *localVarPtr);
 ObjClosure *newObjClosure(VM *vm, ObjFun *objFun);
 ObjFun *newObjFun(VM *vm, ObjModule *objModule, uint32_t maxStackSlotUsedNum);
+void initLineTable(LineTable *lineTable);
+void lineTableAdd(VM *vm, LineTable *lineTable, uint32_t lineNo);
+uint32_t getLineNo(LineTable *lineTable, uint32_t ip);
+void expandLineTable(LineTable *lineTable, uint32_t *lineNos, uint32_t count);
 
 #endif //STOVE_OBJ_FUN_H
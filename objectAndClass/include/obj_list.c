@@ -12,7 +12,7 @@ ObjList *newObjList(VM *vm, uint32_t elementNum) {
     //分配内存，后调用initObjHeader，避免gc无所谓的遍历
     if (elementNum > 0)
         elementArray = ALLOCATE_ARRAY(vm, Value, elementNum);
-    ObjList *objList = ALLOCATE(vm, ObjList);
+    ObjList *objList = ALLOCATE_OBJ(vm, ObjList);
 
     objList->elements.datas = elementArray;
     objList->elements.capacity = objList->elements.count = elementNum;
@@ -9,7 +9,7 @@
 
 //创建新map对象
 ObjMap *newObjMap(VM *vm) {
-    ObjMap *objMap = ALLOCATE(vm, ObjMap);
+    ObjMap *objMap = ALLOCATE_OBJ(vm, ObjMap);
     initObjHeader(vm, &objMap->objHeader, OT_MAP, vm->mapClass);
     objMap->capacity = objMap->count = 0;
     objMap->entries = NULL;
@@ -44,17 +44,17 @@ static uint32_t hashObj(ObjHeader *objHeader) {
 
 //根据value的类型调用相应的哈希函数
 static uint32_t hashValue(Value value) {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VT_FALSE:
             return 0;
         case VT_NULL:
             return 1;
         case VT_NUM:
-            return hashNum(value.num);
+            return hashNum(VALUE_TO_NUM(value));
         case VT_TRUE:
             return 2;
         case VT_OBJ:
-            return hashObj(value.objHeader);
+            return hashObj(VALUE_TO_OBJ(value));
         default:
             RUN_ERROR("Hash types are not supported");
     }
@@ -67,7 +67,7 @@ static bool addEntry(Entry *entries, uint32_t capacity, Value key, Value value)
 
     //通过开放探测法去找可用的slot
     while (true) {
-        if (entries[index].key.type == VT_UNDEFINED) {
+        if (VALUE_IS_UNDEFINED(entries[index].key)) {
             entries[index].key = key;
             entries[index].value = value;
             return true; //增加新的key返回true
@@ -95,7 +95,7 @@ static void resizeMap(VM *vm, ObjMap *objMap, uint32_t newCapacity) {
         Entry *entryArray = objMap->entries;
         idx = 0;
         while (idx < objMap->capacity) {
-            if (entryArray[idx].key.type != VT_UNDEFINED)
+            if (!VALUE_IS_UNDEFINED(entryArray[idx].key))
                 addEntry(newEntries, newCapacity, entryArray[idx].key, entryArray[idx].value);
             idx++;
         }
@@ -5,7 +5,7 @@
 #include "obj_range.h"
 
 ObjRange *newObjRange(VM *vm, int from, int to) {
-    ObjRange *objRange = ALLOCATE(vm, ObjRange);
+    ObjRange *objRange = ALLOCATE_OBJ(vm, ObjRange);
     initObjHeader(vm, &objRange->objHeader, OT_RANGE, vm->rangeClass);
     objRange->from = from;
     objRange->to = to;
@@ -81,7 +81,7 @@ ObjString *newObjString(VM *vm, const char *str, uint32_t length) {
     ASSERT(length == 0 || str != NULL, "str length don't match str.");
 
     //结尾\0
-    ObjString *objString = ALLOCATE_EXTRA(vm, ObjString, length + 1);
+    ObjString *objString = ALLOCATE_OBJ_EXTRA(vm, ObjString, length + 1);
 
     if (objString != NULL) {
         initObjHeader(vm, &objString->objHeader, OT_STRING, vm->stringClass);
@@ -6,6 +6,26 @@
 #include "../../vm/vm.h"
 #include "class.h"
 
+#if RESERVED_STACK
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+//预留的内存不经memManager分配，按os分配物理页的粒度估算其占用
+#define RESERVED_PAGE_SIZE 4096
+#define RESERVED_BYTES_USED(bytes) (((bytes) / RESERVED_PAGE_SIZE + 1) * RESERVED_PAGE_SIZE)
+
+//预留size字节的虚拟地址，不占用交换空间，物理页在首次访问时才分配
+void *reserveStackMemory(size_t size) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        MEM_ERROR("reserve %lu bytes for thread stack failed!", (unsigned long) size);
+    return mem;
+}
+#endif
+
 //为运行函数准备帧栈
 void prepareFrame(ObjThread *objThread, ObjClosure *objClosure, Value *stackStart) {
     ASSERT(objThread->frameCapacity > objThread->usedFrameNum, "frame not enough.");
@@ -40,7 +60,7 @@ ObjThread *newObjThread(VM *vm, ObjClosure *objClosure) {
     uint32_t stackCapacity = ceilToPowerOf2(objClosure->fun->maxStackSlotUsedNum + 1);
     Value *newStack = ALLOCATE_ARRAY(vm, Value, stackCapacity);
 
-    ObjThread *objThread = ALLOCATE(vm, ObjThread);
+    ObjThread *objThread = ALLOCATE_OBJ(vm, ObjThread);
     initObjHeader(vm, &objThread->objHeader, OT_THREAD, vm->threadClass);
 
     objThread->frames = frames;
@@ -51,3 +71,40 @@ ObjThread *newObjThread(VM *vm, ObjClosure *objClosure) {
     resetThread(objThread, objClosure);
     return objThread;
 }
+
+//线程的运行时栈和frame数组占用的内存
+uint32_t getThreadStackBytes(ObjThread *objThread) {
+    uint32_t bytes = 0;
+#if RESERVED_STACK
+    //预留的地址空间只有用到的部分才占内存
+    if (objThread->frameCapacity == RESERVED_FRAME_NUM)
+        bytes += RESERVED_BYTES_USED(objThread->usedFrameNum * sizeof(Frame));
+    else
+        bytes += objThread->frameCapacity * sizeof(Frame);
+    if (objThread->stackCapacity == RESERVED_STACK_SLOTS)
+        bytes += RESERVED_BYTES_USED((objThread->esp - objThread->stack) * sizeof(Value));
+    else
+        bytes += objThread->stackCapacity * sizeof(Value);
+#else
+    bytes += objThread->frameCapacity * sizeof(Frame);
+    bytes += objThread->stackCapacity * sizeof(Value);
+#endif
+    return bytes;
+}
+
+//释放线程的运行时栈和frame数组
+void freeThreadStack(VM *vm, ObjThread *objThread) {
+#if RESERVED_STACK
+    if (objThread->frameCapacity == RESERVED_FRAME_NUM)
+        munmap(objThread->frames, sizeof(Frame) * RESERVED_FRAME_NUM);
+    else
+        DEALLOCATE(vm, objThread->frames);
+    if (objThread->stackCapacity == RESERVED_STACK_SLOTS)
+        munmap(objThread->stack, sizeof(Value) * RESERVED_STACK_SLOTS);
+    else
+        DEALLOCATE(vm, objThread->stack);
+#else
+    DEALLOCATE(vm, objThread->frames);
+    DEALLOCATE(vm, objThread->stack);
+#endif
+}
@@ -25,8 +25,21 @@ typedef struct objThread {
     Value errorObj; //导致运行时错误的对象会放在此处，否则为空
 } ObjThread; //线程对象
 
+#if RESERVED_STACK
+//线程起初仍用memManager分配的小数组，扩容后超过下面的大小时才搬到预留的地址空间，多数线程用不到这么深的栈
+#define RESERVED_STACK_THRESHOLD 1024
+#define RESERVED_FRAME_THRESHOLD 64
+//每个线程预留的运行时栈slot数和frame数，用尽即栈溢出
+#define RESERVED_STACK_SLOTS (1 << 23)
+#define RESERVED_FRAME_NUM (1 << 21)
+
+void *reserveStackMemory(size_t size);
+#endif
+
 void prepareFrame(ObjThread *objThread, ObjClosure *objClosure, Value *stackStart);
 ObjThread *newObjThread(VM *vm, ObjClosure *objClosure);
 void resetThread(ObjThread *objThread, ObjClosure *objClosure);
+uint32_t getThreadStackBytes(ObjThread *objThread);
+void freeThreadStack(VM *vm, ObjThread *objThread);
 
 #endif //STOVE_OBJ_THREAD_H
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+# 字节码变异测试：模块包由用户提供，字节码缓存也可能被改动，载入时都不能信任其中的指令流
+# 把语料脚本打包或生成缓存后，逐字节改写模块数据并重算散列值，使改动能通过校验和，再交给虚拟机执行
+# 变异后的包或缓存只能被拒绝、运行出错或正常运行，虚拟机崩溃或被ASan报告内存错误都算失败
+#
+# 用法：python3 tools/fuzz_bytecode.py 虚拟机路径
+# 虚拟机最好以-fsanitize=address编译，脚本设置ASAN_OPTIONS使ASan报错时的退出码为99
+# 全部变异都没有崩溃时返回0，否则列出出错的位置并返回1
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+FNV_OFFSET_BASIS = 14695981039346656037
+FNV_PRIME = 1099511628211
+BUNDLE_ENTRY_SIZE = 24
+CACHE_CHECKSUM_POS = 28  # 缓存文件头中散列值的位置，散列的是其后的全部内容
+DELTAS = (0x01, 0x7f, 0xff)  # 每个字节依次加上这些值
+TIMEOUT = 5  # 变异可能造出死循环，超时不算失败
+
+# 语料：覆盖字段、继承、super、静态方法、按引用和按值捕获的闭包、循环和导入，涉及的指令越多，变异越容易碰到各指令的操作数
+LIB = """
+class Shape {
+  var name
+  static var count = 0
+  new(n) {
+    name = n
+    count = count + 1
+  }
+  area { return 0 }
+  describe { return name + ":" + area.toString }
+  static total { return count }
+}
+class Rect < Shape {
+  var w
+  var h
+  new(a, b) {
+    super("rect")
+    w = a
+    h = b
+  }
+  area { return w * h }
+  grow(d) {
+    w = w + d
+    h = h + d
+    return self
+  }
+}
+var makeCounter = Fun.new {
+  var c = 0
+  return Fun.new {
+    c = c + 1
+    return c
+  }
+}
+var makeAdder = Fun.new {|n|
+  return Fun.new {|x|
+    return Fun.new { return x + n }
+  }
+}
+"""
+
+MAIN = """
+import lib for Shape, Rect, makeCounter, makeAdder
+var r = Rect.new(2, 3)
+var i = 0
+var sum = 0
+while (i < 5) {
+  sum = sum + r.grow(1).area
+  i = i + 1
+}
+var counter = makeCounter.call()
+counter.call()
+var list = [1, 2, 3]
+var map = {"a": 1}
+for x (list) sum = sum + x + map["a"]
+if (sum > 100 && r is Shape) System.print(r.describe)
+System.print(sum + counter.call() + Shape.total + makeAdder.call(1).call(2).call())
+"""
+
+
+def fnv1a(data):
+    h = FNV_OFFSET_BASIS
+    for b in data:
+        h = ((h ^ b) * FNV_PRIME) & 0xffffffffffffffff
+    return h
+
+
+def read_u32(data, pos):
+    return struct.unpack_from("<I", data, pos)[0]
+
+
+def bundle_entries(data):
+    """解析模块包的文件头，返回各索引项在文件中的位置"""
+    assert data[:4] == b"STVB", "not a bundle"
+    pos = 16
+    method_num = read_u32(data, pos)
+    pos += 4
+    for _ in range(method_num):
+        pos += 4 + read_u32(data, pos)
+    module_num = read_u32(data, pos)
+    pos += 4
+    return [pos + i * BUNDLE_ENTRY_SIZE for i in range(module_num)]
+
+
+def run(stove, args, cwd):
+    env = dict(os.environ)
+    env["ASAN_OPTIONS"] = "detect_leaks=0:exitcode=99:" + env.get("ASAN_OPTIONS", "")
+    try:
+        result = subprocess.run([stove] + args, cwd=cwd, env=env, capture_output=True, timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        return "timeout", b""
+    return result.returncode, result.stderr
+
+
+def check_run(stove, args, work_dir, what):
+    code, err = run(stove, args, work_dir)
+    if code != 0:
+        sys.exit("%s failed: %s" % (what, err.decode(errors="replace")))
+
+
+def mutate(stove, work_dir, name, spans, args, stats, failures):
+    """逐字节改写文件name中spans列出的各段(起点, 长度, 散列值位置)，每次都以args执行虚拟机"""
+    path = os.path.join(work_dir, name)
+    original = bytearray(open(path, "rb").read())
+    for offset, length, checksum_pos in spans:
+        for idx in range(length):
+            for delta in DELTAS:
+                mutant = bytearray(original)
+                mutant[offset + idx] = (mutant[offset + idx] + delta) & 0xff
+                struct.pack_into("<Q", mutant, checksum_pos, fnv1a(mutant[offset:offset + length]))
+                # 原地写入，保留文件的属主和权限
+                with open(path, "wb") as f:
+                    f.write(mutant)
+                code, err = run(stove, args, work_dir)
+                stats[code] = stats.get(code, 0) + 1
+                if code not in (0, 1, "timeout"):
+                    failures.append((name, offset + idx, delta, code, err[-400:].decode(errors="replace")))
+    # 缓存被拒绝时虚拟机会重写它，恢复原样再变异下一个文件
+    with open(path, "wb") as f:
+        f.write(original)
+
+
+def fuzz_bundle(stove, work_dir, stats, failures):
+    check_run(stove, ["-o", "all.stvb", "main.stv", "lib.stv"], work_dir, "building the bundle")
+    check_run(stove, ["-b", "all.stvb", "main.stv"], work_dir, "running the unmodified bundle")
+    data = open(os.path.join(work_dir, "all.stvb"), "rb").read()
+    spans = []
+    for entry in bundle_entries(data):
+        _, _, offset, length = struct.unpack_from("<IIII", data, entry)
+        spans.append((offset, length, entry + 16))
+    mutate(stove, work_dir, "all.stvb", spans, ["-b", "all.stvb", "main.stv"], stats, failures)
+
+
+def fuzz_cache(stove, work_dir, stats, failures):
+    check_run(stove, ["-c", "main.stv"], work_dir, "writing the caches")
+    for name in ("main.stvc", "lib.stvc"):
+        size = os.path.getsize(os.path.join(work_dir, name))
+        start = CACHE_CHECKSUM_POS + 8
+        mutate(stove, work_dir, name, [(start, size - start, CACHE_CHECKSUM_POS)], ["-c", "main.stv"], stats, failures)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s path/to/stove" % sys.argv[0])
+    stove = os.path.abspath(sys.argv[1])
+    stats = {}
+    failures = []
+    with tempfile.TemporaryDirectory() as work_dir:
+        with open(os.path.join(work_dir, "lib.stv"), "w") as f:
+            f.write(LIB)
+        with open(os.path.join(work_dir, "main.stv"), "w") as f:
+            f.write(MAIN)
+        fuzz_bundle(stove, work_dir, stats, failures)
+        fuzz_cache(stove, work_dir, stats, failures)
+    print("results by exit code:", stats)
+    for name, offset, delta, code, err in failures:
+        print("%s byte %d + 0x%02x -> %s\n%s" % (name, offset, delta, code, err))
+    if failures:
+        print("%d mutants crashed" % len(failures))
+        return 1
+    print("no crashes")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
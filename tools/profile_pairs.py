@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+# 指令对统计：挑选超级指令的依据，也用来衡量融合减少了多少次分派
+# 虚拟机以-DSTOVE_PROFILE_PAIRS编译后，每执行完一个脚本就向stderr输出分派次数、融合前的指令条数和最常见的指令对
+# 本脚本逐个执行语料，汇总各脚本的输出，再列出全部语料中最常见的指令对，可融合的指令对标以*
+#
+# 用法：python3 tools/profile_pairs.py 虚拟机路径 [脚本 ...]
+# 不给脚本时使用下面内置的语料：循环、局部变量、递归、方法调用、闭包调用和按值捕获
+
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+TOP_PAIRS = 20  # 汇总表列出的指令对数
+
+CORPUS = {
+    "loop.stv": """
+var i = 0
+var s = 0
+while (i < 1000000) {
+  s = s + i % 7
+  i = i + 1
+}
+System.print(s)
+""",
+    "locals.stv": """
+define sumTo(n) {
+  var i = 0
+  var s = 0
+  while (i < n) {
+    s = s + i % 7
+    i = i + 1
+  }
+  return s
+}
+System.print(sumTo(1000000))
+""",
+    "fib.stv": """
+define fib(n) {
+  if (n < 2) return n
+  return fib.call(n - 1) + fib.call(n - 2)
+}
+System.print(fib(25))
+""",
+    "method.stv": """
+class Acc {
+  var total
+  new() {
+    total = 0
+  }
+  add(n) {
+    var d = n * 2
+    total = total + d
+    return total
+  }
+}
+var a = Acc.new()
+var i = 0
+while (i < 300000) {
+  a.add(i)
+  i = i + 1
+}
+System.print(a.add(0))
+""",
+    "call.stv": """
+var h = Fun.new {|x| return x + 1 }
+var i = 0
+var s = 0
+while (i < 1000000) {
+  s = h.call(s)
+  i = i + 1
+}
+System.print(s)
+""",
+    "closure.stv": """
+define mk(a, b) {
+  return Fun.new { return a + b }
+}
+var i = 0
+var s = 0
+while (i < 300000) {
+  s = s + mk(i, 1).call()
+  i = i + 1
+}
+System.print(s)
+""",
+}
+
+SUMMARY = re.compile(r"^dispatches: (\d+), instructions before fusion: (\d+), saved: [\d.]+%$")
+PAIR = re.compile(r"^\s*(\d+)\s+[\d.]+%\s+([* ])\s+(\w+) (\w+)$")
+
+
+def profile(stove, path):
+    """执行一个脚本，返回(分派次数, 融合前的指令条数, {(前一条, 后一条): (次数, 可否融合)})"""
+    result = subprocess.run([stove, path], capture_output=True, text=True)
+    dispatches = instructions = None
+    pairs = {}
+    for line in result.stderr.splitlines():
+        m = SUMMARY.match(line)
+        if m:
+            dispatches, instructions = int(m.group(1)), int(m.group(2))
+            continue
+        m = PAIR.match(line)
+        if m:
+            pairs[(m.group(3), m.group(4))] = (int(m.group(1)), m.group(2) == "*")
+    if dispatches is None:
+        sys.exit("%s printed no profile, was the vm built with -DSTOVE_PROFILE_PAIRS?\n%s" % (path, result.stderr))
+    return dispatches, instructions, pairs
+
+
+def saved(dispatches, instructions):
+    return 100.0 * (instructions - dispatches) / instructions if instructions else 0.0
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: %s path/to/stove [script ...]" % sys.argv[0])
+    stove = os.path.abspath(sys.argv[1])
+    with tempfile.TemporaryDirectory() as work_dir:
+        scripts = [os.path.abspath(p) for p in sys.argv[2:]]
+        if not scripts:
+            for name, code in CORPUS.items():
+                path = os.path.join(work_dir, name)
+                with open(path, "w") as f:
+                    f.write(code)
+                scripts.append(path)
+
+        total_dispatches = total_instructions = 0
+        total_pairs = {}
+        print("%-14s %12s %12s %7s" % ("script", "dispatches", "unfused", "saved"))
+        for path in scripts:
+            dispatches, instructions, pairs = profile(stove, path)
+            total_dispatches += dispatches
+            total_instructions += instructions
+            for pair, (count, fusible) in pairs.items():
+                total_pairs[pair] = (total_pairs.get(pair, (0, fusible))[0] + count, fusible)
+            print("%-14s %12d %12d %6.1f%%" % (os.path.basename(path), dispatches, instructions,
+                                               saved(dispatches, instructions)))
+        print("%-14s %12d %12d %6.1f%%" % ("total", total_dispatches, total_instructions,
+                                           saved(total_dispatches, total_instructions)))
+
+    print()
+    print("%12s %6s   %s" % ("count", "share", "pair (* fused)"))
+    ranked = sorted(total_pairs.items(), key=lambda item: -item[1][0])
+    for (first, second), (count, fusible) in ranked[:TOP_PAIRS]:
+        print("%12d %5.1f%% %s %s %s" % (count, 100.0 * count / total_instructions, "*" if fusible else " ",
+                                        first, second))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
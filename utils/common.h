@@ -20,6 +20,61 @@ typedef struct class Class;
 #define false 0
 #define UNUSED __attribute__((unused))
 
+//GCC和Clang支持标签取址(labels as values)，解释器用computed goto做threaded dispatch
+//编译时定义NO_COMPUTED_GOTO可退回到可移植的switch分派
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+
+//解释器把栈顶指针esp缓存在寄存器变量中，只在调用、可能触发gc和切换线程处写回线程对象
+//编译时定义NO_STACK_CACHING可退回到每次都经由curThread->esp读写栈
+#if !defined(NO_STACK_CACHING)
+#define USE_STACK_CACHING 1
+#else
+#define USE_STACK_CACHING 0
+#endif
+
+//64位平台上用NaN-boxing把Value压缩为8字节，要求对象指针不超过48位
+//编译时定义NO_NAN_BOXING可退回到16字节的带标签结构体
+#if UINTPTR_MAX == UINT64_MAX && !defined(NO_NAN_BOXING)
+#define NAN_BOXING 1
+#else
+#define NAN_BOXING 0
+#endif
+
+//编译时定义STOVE_JIT可开启基线JIT，把热点函数的指令流逐条按模板翻译为x86-64机器码
+//模板按8字节的Value生成，故只支持x86-64 Linux上的NaN-boxing
+#if defined(STOVE_JIT) && defined(__x86_64__) && defined(__linux__) && NAN_BOXING
+#define ENABLE_JIT 1
+#else
+#define ENABLE_JIT 0
+#endif
+
+//编译时定义STOVE_PROFILE_PAIRS可统计解释器分派的指令和融合前的相邻指令对，释放虚拟机时输出到stderr，用来挑选超级指令
+#if defined(STOVE_PROFILE_PAIRS)
+#define PROFILE_PAIRS 1
+#else
+#define PROFILE_PAIRS 0
+#endif
+
+//64位的类Unix平台上，线程的运行时栈和frame数组长大后改放到mmap预留的整段虚拟地址中，物理页在首次访问时才由os分配
+//此后再增长不必realloc后修正各frame和upvalue中的指针，编译时定义NO_RESERVED_STACK可退回到一直按2倍realloc扩容
+#if UINTPTR_MAX == UINT64_MAX && (defined(__linux__) || defined(__APPLE__)) && !defined(NO_RESERVED_STACK)
+#define RESERVED_STACK 1
+#else
+#define RESERVED_STACK 0
+#endif
+
+//编译时定义STOVE_COMPRESSED_HEAP可开启压缩堆，所有对象分配在一段预留的4GB虚拟地址中
+//对象头中的类和对象链表指针改存为相对堆起址的32位偏移，对象头由24字节缩为12字节，只支持64位的类Unix平台
+#if defined(STOVE_COMPRESSED_HEAP) && UINTPTR_MAX == UINT64_MAX && (defined(__linux__) || defined(__APPLE__))
+#define COMPRESSED_HEAP 1
+#else
+#define COMPRESSED_HEAP 0
+#endif
+
 #ifdef DEBUG
 #define ASSERT(exp, errMsg)                                                                                       \
     do {                                                                                                          \
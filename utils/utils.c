@@ -4,6 +4,9 @@
 #include "../lexicalParser/include/parser.h"
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+
+ErrorRecovery *errorRecovery = NULL;
 
 void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize) {
     //累计系统分配的总内存
@@ -22,6 +25,140 @@ void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize) {
     return realloc(ptr, newSize);
 }
 
+#if COMPRESSED_HEAP
+#include <sys/mman.h>
+
+//对象堆按64KB的页管理，小块所在的页只存放同一大小级别的块，释放时由页号查出级别，块不必带头部
+//不超过HEAP_SMALL_MAX的按16字节分级，其上按2的幂分级直到半页，更大的按整页分配
+#define HEAP_SIZE ((uint64_t) 1 << 32)
+#define HEAP_PAGE_SHIFT 16
+#define HEAP_PAGE_SIZE ((uint32_t) 1 << HEAP_PAGE_SHIFT)
+#define HEAP_PAGE_NUM ((uint32_t) (HEAP_SIZE >> HEAP_PAGE_SHIFT))
+#define HEAP_GRANULE 16
+#define HEAP_SMALL_MAX 1024
+#define HEAP_SMALL_CLASS_NUM (HEAP_SMALL_MAX / HEAP_GRANULE)
+#define HEAP_CLASS_NUM (HEAP_SMALL_CLASS_NUM + 5) //另有2KB、4KB、8KB、16KB和32KB五级
+#define HEAP_LARGE_FLAG 0x80000000u //pageInfo中大块首页的标志，其余位是大块的页数
+
+char *objHeapBase = NULL;
+
+static struct {
+    uint32_t bumpPage; //从未用过的第一页，第0页不用，使偏移0可以表示NULL
+    uint32_t freeBlocks[HEAP_CLASS_NUM]; //各级空闲块链表，块的前4字节存下一块的偏移，0表示链表结束
+    uint32_t freeRuns; //空闲的大块链表，同样以前4字节相连
+    uint32_t pageInfo[HEAP_PAGE_NUM]; //小块页的大小级别，或大块首页的HEAP_LARGE_FLAG|页数
+} objHeap;
+
+#define HEAP_NEXT_REF(offset) (*(uint32_t *) (objHeapBase + (offset)))
+
+//获得size所属的大小级别及该级别的块大小
+static uint32_t getHeapClass(uint32_t size, uint32_t *blockSize) {
+    if (size <= HEAP_SMALL_MAX) {
+        uint32_t heapClass = (size + HEAP_GRANULE - 1) / HEAP_GRANULE;
+        heapClass = heapClass == 0 ? 0 : heapClass - 1;
+        *blockSize = (heapClass + 1) * HEAP_GRANULE;
+        return heapClass;
+    }
+    uint32_t heapClass = HEAP_SMALL_CLASS_NUM;
+    *blockSize = HEAP_SMALL_MAX * 2;
+    while (*blockSize < size) {
+        *blockSize *= 2;
+        heapClass++;
+    }
+    return heapClass;
+}
+
+//从未用过的页中取出pageNum页，返回首页页号
+static uint32_t takeFreshPages(uint32_t pageNum) {
+    if (objHeapBase == NULL) {
+        objHeapBase = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (objHeapBase == MAP_FAILED)
+            MEM_ERROR("reserve %lu bytes for object heap failed!", (unsigned long) HEAP_SIZE);
+        objHeap.bumpPage = 1;
+    }
+    if (pageNum > HEAP_PAGE_NUM - objHeap.bumpPage)
+        MEM_ERROR("object heap exhausted, it can hold at most %lu bytes.", (unsigned long) HEAP_SIZE);
+    uint32_t page = objHeap.bumpPage;
+    objHeap.bumpPage += pageNum;
+    return page;
+}
+
+//分配pageNum页的大块，先在空闲的大块中首次适配，大块余下的部分仍留在空闲链表中
+static uint32_t allocateLargeBlock(uint32_t pageNum) {
+    uint32_t *prev = &objHeap.freeRuns;
+    while (*prev != 0) {
+        uint32_t page = *prev >> HEAP_PAGE_SHIFT;
+        uint32_t runPages = objHeap.pageInfo[page] & ~HEAP_LARGE_FLAG;
+        if (runPages >= pageNum) {
+            if (runPages == pageNum)
+                *prev = HEAP_NEXT_REF(*prev);
+            else {
+                //把前面的页分出去，剩余部分的首页接替原大块在链表中的位置
+                uint32_t restOffset = (page + pageNum) << HEAP_PAGE_SHIFT;
+                HEAP_NEXT_REF(restOffset) = HEAP_NEXT_REF(*prev);
+                objHeap.pageInfo[page + pageNum] = HEAP_LARGE_FLAG | (runPages - pageNum);
+                *prev = restOffset;
+            }
+            return page;
+        }
+        prev = &HEAP_NEXT_REF(*prev);
+    }
+    return takeFreshPages(pageNum);
+}
+
+//在对象堆中分配size字节，同memManager一样累计分配量并在达到阈值时启动gc
+void *objHeapAllocate(VM *vm, uint32_t size) {
+    vm->allocatedBytes += size;
+    if (vm->allocatedBytes > vm->config.nextGC)
+        startGC(vm);
+
+    uint32_t blockSize;
+    if (size > HEAP_PAGE_SIZE / 2) {
+        uint32_t pageNum = (size + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+        uint32_t page = allocateLargeBlock(pageNum);
+        objHeap.pageInfo[page] = HEAP_LARGE_FLAG | pageNum;
+        return objHeapBase + ((uint64_t) page << HEAP_PAGE_SHIFT);
+    }
+
+    uint32_t heapClass = getHeapClass(size, &blockSize);
+    if (objHeap.freeBlocks[heapClass] == 0) {
+        //该级别没有空闲块，取一页切成该级别的块，倒序入链使先分配低地址的块
+        uint32_t page = takeFreshPages(1);
+        objHeap.pageInfo[page] = heapClass;
+        uint32_t pageStart = page << HEAP_PAGE_SHIFT;
+        uint32_t offset = pageStart + (HEAP_PAGE_SIZE / blockSize - 1) * blockSize;
+        while (offset >= pageStart) {
+            HEAP_NEXT_REF(offset) = objHeap.freeBlocks[heapClass];
+            objHeap.freeBlocks[heapClass] = offset;
+            if (offset == pageStart)
+                break;
+            offset -= blockSize;
+        }
+    }
+    uint32_t offset = objHeap.freeBlocks[heapClass];
+    objHeap.freeBlocks[heapClass] = HEAP_NEXT_REF(offset);
+    return objHeapBase + offset;
+}
+
+//释放对象堆中的块，大块的物理页交还os
+void objHeapFree(VM *vm UNUSED, void *ptr) {
+    if (ptr == NULL)
+        return;
+    uint32_t offset = (uint32_t) ((char *) ptr - objHeapBase);
+    uint32_t info = objHeap.pageInfo[offset >> HEAP_PAGE_SHIFT];
+    if (info & HEAP_LARGE_FLAG) {
+        madvise(ptr, (size_t) (info & ~HEAP_LARGE_FLAG) << HEAP_PAGE_SHIFT, MADV_DONTNEED);
+        HEAP_NEXT_REF(offset) = objHeap.freeRuns;
+        objHeap.freeRuns = offset;
+        return;
+    }
+    HEAP_NEXT_REF(offset) = objHeap.freeBlocks[info];
+    objHeap.freeBlocks[info] = offset;
+}
+
+#undef HEAP_NEXT_REF
+#endif
+
 uint32_t ceilToPowerOf2(uint32_t v) {
     v = (v == 0) ? 1 : v; //修复当v等于0时结果为0的边界情况
     v--;
@@ -73,5 +210,11 @@ void errorReport(void *parser, ErrorType errorType, const char *fmt, ...) {
         default:
             NOT_REACHED()
     }
+
+    //有恢复点时跳回executeModule，内存分配失败后虚拟机的状态不可信，仍然退出
+    if (errorRecovery != NULL && errorType != ERROR_MEM) {
+        memcpy(errorRecovery->msg, buffer, DEFAULT_BUFFER_SIZE);
+        longjmp(errorRecovery->env, 1);
+    }
     exit(EXIT_FAILURE);
 }
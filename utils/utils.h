@@ -6,6 +6,7 @@
 #define STOVE_UTILS_H
 
 #include "common.h"
+#include <setjmp.h>
 
 void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize);
 
@@ -23,6 +24,26 @@ void *memManager(VM *vm, void *ptr, uint32_t oldSize, uint32_t newSize);
 
 #define DEALLOCATE(vmPtr, memPtr) memManager(vmPtr, memPtr, 0, 0)
 
+//对象本身（以对象头开头的内存）用下面的宏分配和释放，开启压缩堆时分配在对象堆中
+#if COMPRESSED_HEAP
+extern char *objHeapBase; //对象堆的起址，对象头中的引用都是相对它的偏移
+
+void *objHeapAllocate(VM *vm, uint32_t size);
+void objHeapFree(VM *vm, void *ptr);
+
+#define ALLOCATE_OBJ(vmPtr, type) \
+    (type *)objHeapAllocate(vmPtr, sizeof(type))
+
+#define ALLOCATE_OBJ_EXTRA(vmPtr, mainType, extraSize) \
+    (mainType *)objHeapAllocate(vmPtr, sizeof(mainType) + extraSize)
+
+#define DEALLOCATE_OBJ(vmPtr, memPtr) objHeapFree(vmPtr, memPtr)
+#else
+#define ALLOCATE_OBJ(vmPtr, type) ALLOCATE(vmPtr, type)
+#define ALLOCATE_OBJ_EXTRA(vmPtr, mainType, extraSize) ALLOCATE_EXTRA(vmPtr, mainType, extraSize)
+#define DEALLOCATE_OBJ(vmPtr, memPtr) DEALLOCATE(vmPtr, memPtr)
+#endif
+
 uint32_t ceilToPowerOf2(uint32_t v);
 
 typedef struct {
@@ -132,4 +153,13 @@ void symbolTableClear(VM *vm, SymbolTable *buffer);
 
 #define DEFAULT_BUFFER_SIZE 512
 
+//出错恢复点，由executeModule在执行模块期间设置
+//errorReport报告错误后把错误信息存入msg并跳回恢复点，不再退出进程
+typedef struct {
+    jmp_buf env;
+    char msg[DEFAULT_BUFFER_SIZE];
+} ErrorRecovery;
+
+extern ErrorRecovery *errorRecovery;
+
 #endif // STOVE_UTILS_H
@@ -8,6 +8,7 @@
 #include <math.h>
 #include "vm.h"
 #include "../compiler/compiler.h"
+#include "../compiler/cache.h"
 #include "coreScript.inc"
 #include <ctype.h>
 #include <time.h>
@@ -54,10 +55,14 @@ char *rootDir = NULL; // 根目录
         bindMethod(vm, classPtr, (uint32_t) globalIdx, method);                           \
 }
 
-static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode);
+static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode, const char *sourcePath);
 
 static ObjModule *getModule(VM *vm, Value moduleName);
 
+static ObjModule *newModule(VM *vm, Value moduleName);
+
+static ObjModule *getOrNewModule(VM *vm, Value moduleName);
+
 // 读取源代码文件
 char *readFile(const char *path) {
     FILE *file = fopen(path, "rb");
@@ -84,7 +89,7 @@ char *readFile(const char *path) {
 
 //校验是否是函数
 static bool validateFun(VM *vm, Value args) {
-    if (VALUE_TO_OBJCLOSURE(args))
+    if (VALUE_IS_OBJCLOSURE(args))
         return true;
     vm->curThread->errorObj = OBJ_TO_VALUE(newObjString(vm, "argument must be a function.", 28));
     return false;
@@ -178,7 +183,7 @@ static Value makeStringFromCodePoint(VM *vm, int value) {
     ASSERT(byteNum != 0, "utf-8 encode bytes should be between 1 and 4.");
 
     //+1是为了结尾的\0
-    ObjString *objString = ALLOCATE_EXTRA(vm, ObjString, byteNum + 1);
+    ObjString *objString = ALLOCATE_OBJ_EXTRA(vm, ObjString, byteNum + 1);
     if (objString == NULL)
         MEM_ERROR("allocate memory for objString failed in runtime.");
 
@@ -191,7 +196,7 @@ static Value makeStringFromCodePoint(VM *vm, int value) {
 }
 
 //用索引index处的字节创建字符串对象
-static Value stringCodePointAt(VM *vm, ObjString *objString, uint32_t index) {
+Value stringCodePointAt(VM *vm, ObjString *objString, uint32_t index) {
     ASSERT(index < objString->value.length, "index out of bound.");
     int codePoint = decodeUtf8((uint8_t *) objString->value.start + index, objString->value.length - index);
 
@@ -227,7 +232,7 @@ static ObjString *newObjStringFromSub(VM *vm, ObjString *sourceStr, int startInd
     }
 
     //+1为了结尾的\0
-    ObjString *result = ALLOCATE_EXTRA(vm, ObjString, totalLength + 1);
+    ObjString *result = ALLOCATE_OBJ_EXTRA(vm, ObjString, totalLength + 1);
     if (result == NULL)
         MEM_ERROR("allocate memory failed in runtime.");
     initObjHeader(vm, &result->objHeader, OT_STRING, vm->stringClass);
@@ -340,16 +345,13 @@ static char *getFilePath(const char *moduleName) {
     return path;
 }
 
-//读取模块
-static char *readModule(const char *moduleName) {
+//读取模块，模块文件的路径存入modulePath
+static char *readModule(const char *moduleName, char **modulePath) {
     //1. 读取内建模块。。。
 
     //2. 读取自定义模块
-    char *modulePath = getFilePath(moduleName);
-    char *moduleCode = readFile(modulePath);
-    free(modulePath);
-
-    return moduleCode; //由主调函数将来释放此空间
+    *modulePath = getFilePath(moduleName);
+    return readFile(*modulePath); //由主调函数将来释放此空间
 }
 
 //输出字符串
@@ -359,20 +361,37 @@ static void printString(const char *str) {
     fflush(stdout);
 }
 
+//源码路径path对应的模块名，即去掉根目录和.stv扩展名的部分，同import语句中的模块名
+static const char *getModuleNameOfPath(const char *path, uint32_t *length) {
+    uint32_t rootDirLength = rootDir == NULL ? 0 : strlen(rootDir);
+    if (rootDirLength > 0 && strncmp(path, rootDir, rootDirLength) == 0)
+        path += rootDirLength;
+    *length = strlen(path);
+    if (*length > 4 && memcmp(path + *length - 4, ".stv", 4) == 0)
+        *length -= 4;
+    return path;
+}
+
 //导入模块moduleName，主要是编译模块加载到vm->allModules
 static Value importModule(VM *vm, Value moduleName) {
     //若已经导入则返回NULL_VAL
     if (!VALUE_IS_UNDEFINED(mapGet(vm->allModules, moduleName)))
         return VT_TO_VALUE(VT_NULL);
     ObjString *objString = VALUE_TO_OBJSTR(moduleName);
-    const char *sourceCode = readModule(objString->value.start);
+    //先从模块包中查找，包中没有时才读取源码文件
+    if (vm->bundle != NULL && hasBundleModule(vm->bundle, objString->value.start, objString->value.length))
+        return OBJ_TO_VALUE(loadModule(vm, moduleName, NULL, NULL));
 
-    ObjThread *moduleThread = loadModule(vm, moduleName, sourceCode);
+    char *modulePath;
+    const char *sourceCode = readModule(objString->value.start, &modulePath);
+
+    ObjThread *moduleThread = loadModule(vm, moduleName, sourceCode, modulePath);
+    free(modulePath);
     return OBJ_TO_VALUE(moduleThread);
 }
 
-//在模块moduleName中获取模块变量variableName
-static Value getModuleVariable(VM *vm, Value moduleName, Value variableName) {
+//在模块moduleName中获取模块变量variableName存入result，模块未加载或没有该变量时设置errorObj并返回false
+static bool getModuleVariable(VM *vm, Value moduleName, Value variableName, Value *result) {
     //调用本函数前模块已经被加载了
     ObjModule *objModule = getModule(vm, moduleName);
     if (objModule == NULL) {
@@ -383,7 +402,7 @@ static Value getModuleVariable(VM *vm, Value moduleName, Value variableName) {
         char id[512] = {EOS};
         int len = sprintf(id, "module \'%s\' is not loaded.", modName->value.start);
         vm->curThread->errorObj = OBJ_TO_VALUE(newObjString(vm, id, len));
-        return VT_TO_VALUE(VT_NULL);
+        return false;
     }
 
     ObjString *varName = VALUE_TO_OBJSTR(variableName);
@@ -397,11 +416,12 @@ static Value getModuleVariable(VM *vm, Value moduleName, Value variableName) {
         char id[512] = {EOS};
         int len = sprintf(id, "variable \'%s\' is not in module \'%s\'.", varName->value.start, modName->value.start);
         vm->curThread->errorObj = OBJ_TO_VALUE(newObjString(vm, id, len));
-        return VT_TO_VALUE(VT_NULL);
+        return false;
     }
 
-    //直接返回对应的模块变量
-    return objModule->moduleVarValue.datas[index];
+    //模块变量的值可以是null，如只声明未赋值的变量
+    *result = objModule->moduleVarValue.datas[index];
+    return true;
 }
 
 // !object: object取反，结果为false
@@ -428,23 +448,15 @@ static bool primObjectIsSonClass(VM *vm, Value *args) {
         RUN_ERROR("argument must be class.");
 
     Class *thisClass = getClassOfObj(vm, args[0]);
-    Class *baseClass = (Class *) (args[1].objHeader);
-
-    //有可能是多级继承，因此自下而上遍历基类链
-    while (baseClass != NULL) {
-        //在某一级基类找到匹配，就设置返回值为VT_TRUE并返回
-        if (thisClass == baseClass)
-            RET_VALUE(VT_TO_VALUE(VT_TRUE))
-        baseClass = baseClass->superClass;
-    }
+    Class *baseClass = VALUE_TO_CLASS(args[1]);
 
-    //若未找到基类，说明不具备is_a关系
-    RET_VALUE(VT_TO_VALUE(VT_FALSE))
+    //有可能是多级继承，由display直接判断baseClass是否为thisClass的某一级基类
+    RET_VALUE(BOOL_TO_VALUE(isSubClass(thisClass, baseClass)))
 }
 
 //args[0].toString:返回args[0]所属class的名字
 static bool primObjectToString(VM *vm UNUSED, Value *args) {
-    Class *class = args[0].objHeader->class;
+    Class *class = OBJ_CLASS(VALUE_TO_OBJ(args[0]));
     Value nameValue = OBJ_TO_VALUE(class->name);
     RET_VALUE(nameValue)
 }
@@ -499,11 +511,17 @@ static bool primThreadNew(VM *vm, Value *args) {
     //代码块为参数必为闭包
     if (!validateFun(vm, args[1]))
         return false;
-    ObjThread *objThread = newObjThread(vm, VALUE_TO_OBJCLOSURE(args[1]));
+    ObjClosure *objClosure = VALUE_TO_OBJCLOSURE(args[1]);
+    //首次call的参数写入栈顶，线程函数只有一个slot可以接收它
+    if (objClosure->fun->argNum > 1)
+        SET_ERROR_FALSE(vm, "thread function takes at most one argument.");
+    ObjThread *objThread = newObjThread(vm, objClosure);
 
-    //使stack[0]为接收者，保持栈平衡
-    objThread->stack[0] = VT_TO_VALUE(VT_NULL);
-    objThread->esp++;
+    //使stack[0]为接收者，有参数时再为它留出slot，栈底与函数的参数个数相符
+    uint32_t idx = 0;
+    while (idx <= objClosure->fun->argNum)
+        objThread->stack[idx++] = VT_TO_VALUE(VT_NULL);
+    objThread->esp += idx;
     RET_OBJ(objThread)
 }
 
@@ -562,6 +580,9 @@ static bool switchThread(VM *vm, ObjThread *nextThread, Value *args, bool withAr
     //在下一个线程nextThread执行之前，其主调线程应该为空
     if (nextThread->caller != NULL)
         RUN_ERROR("thread has been called.");
+    //切换到自身时vm->curThread不变，虚拟机会把它当作出错
+    if (nextThread == vm->curThread)
+        SET_ERROR_FALSE(vm, "a thread can't switch to itself.")
     nextThread->caller = vm->curThread;
 
     if (nextThread->usedFrameNum == 0)
@@ -604,6 +625,11 @@ static bool primThreadIsDone(VM *vm UNUSED, Value *args) {
     RET_BOOL(objThread->usedFrameNum == 0 || !VALUE_IS_NULL(objThread->errorObj))
 }
 
+//objThread.error返回中止线程的错误，如配额用尽的信息，线程未出错时为null
+static bool primThreadError(VM *vm UNUSED, Value *args) {
+    RET_VALUE(VALUE_TO_OBJTHREAD(args[0])->errorObj)
+}
+
 //Fun.new(_)：新建一个函数对象
 static bool primFunNew(VM *vm, Value *args) {
     //代码块为参数必为闭包
@@ -830,14 +856,15 @@ static bool primStringPlus(VM *vm, Value *args) {
         return false;
     ObjString *left = VALUE_TO_OBJSTR(args[0]);
     ObjString *right = VALUE_TO_OBJSTR(args[1]);
-    uint32_t totalLength = strlen(left->value.start) + strlen(right->value.start);
+    uint32_t totalLength = left->value.length + right->value.length;
     //+1是因为\0
-    ObjString *result = ALLOCATE_EXTRA(vm, ObjString, totalLength + 1);
+    ObjString *result = ALLOCATE_OBJ_EXTRA(vm, ObjString, totalLength + 1);
     if (result == NULL)
         MEM_ERROR("allocate memory failed in runtime.");
     initObjHeader(vm, &result->objHeader, OT_STRING, vm->stringClass);
-    memcpy(result->value.start, left->value.start, strlen(left->value.start));
-    memcpy(result->value.start + strlen(left->value.start), right->value.start, strlen(right->value.start));
+    memcpy(result->value.start, left->value.start, left->value.length);
+    memcpy(result->value.start + left->value.length, right->value.start, right->value.length);
+    result->value.start[totalLength] = EOS;
     result->value.length = totalLength;
     hashObjString(result);
 
@@ -1410,15 +1437,17 @@ static bool primSystemGetModuleVariable(VM *vm, Value *args) {
     if (!validateString(vm, args[2]))
         return false;
 
-    Value result = getModuleVariable(vm, args[1], args[2]);
-    if (VALUE_IS_NULL(result))
+    Value result;
+    if (!getModuleVariable(vm, args[1], args[2], &result))
         return false;
 
     RET_VALUE(result)
 }
 
 //System.writeString_(_)：输出字符串args[1]
-static bool primSystemWriteString(VM *vm UNUSED, Value *args) {
+static bool primSystemWriteString(VM *vm, Value *args) {
+    if (!validateString(vm, args[1]))
+        return false;
     ObjString *objString = VALUE_TO_OBJSTR(args[1]);
     ASSERT(objString->value.start[objString->value.length] == EOS, "string isn't terminated.");
     printString(objString->value.start);
@@ -1436,51 +1465,91 @@ static bool primSystemWriteString(VM *vm UNUSED, Value *args) {
 //从modules中获取名为moduleName的模块
 static ObjModule *getModule(VM *vm, Value moduleName) {
     Value value = mapGet(vm->allModules, moduleName);
-    if (value.type == VT_UNDEFINED)
+    if (VALUE_IS_UNDEFINED(value))
         return NULL;
     return VALUE_TO_OBJMODULE(value);
 }
 
-//载入模块moduleName并编译
-static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode) {
-    //确保模块已经载入到vm->allModules
-    //先查看是否已经导入了该模块，避免重新导入
+//载入模块moduleName并编译，sourcePath是模块的源码文件，不为NULL且开启了字节码缓存时优先使用其缓存
+//moduleCode为NULL时从vm->bundle中载入，主调方要确认包中有此模块
+static ObjThread *loadModule(VM *vm, Value moduleName, const char *moduleCode, const char *sourcePath) {
+    //新模块编译成功后才登记到vm->allModules，编译出错的模块不会残留，再次导入时重新编译并报错
     ObjModule *module = getModule(vm, moduleName);
-
-    //若该模块未加载先将其载入，并继承核心模块中的变量
-    if (module == NULL) {
-        //创建模块并添加到vm->allModules中
-        ObjString *newModuleName = VALUE_TO_OBJSTR(moduleName);
-        ASSERT(newModuleName->value.start[newModuleName->value.length] == EOS,
-               "string.value.start is not terminated.");
-        module = newObjModule(vm, newModuleName->value.start);
-
+    bool isNewModule = module == NULL;
+    if (isNewModule) {
+        module = newModule(vm, moduleName);
         pushTmpRoot(vm, (ObjHeader *) module);
-        mapSet(vm, vm->allModules, moduleName, OBJ_TO_VALUE(module));
-        popTmpRoot(vm);
+    }
 
-        //继承核心模块中的变量
-        ObjModule *coreModule = getModule(vm, CORE_MODULE);
-        uint32_t idx = 0;
-        while (idx < coreModule->moduleVarName.count) {
-            defineModuleVar(vm, module, coreModule->moduleVarName.datas[idx].str,
-                            strlen(coreModule->moduleVarName.datas[idx].str),
-                            coreModule->moduleVarValue.datas[idx]);
-            idx++;
+    //源码为NULL时模块来自vm->bundle，缓存不可用时重新编译，并趁指令流未被执行改写之前写入缓存
+    ObjFun *fun = NULL;
+    char *cachePath = NULL;
+    if (moduleCode == NULL) {
+        ObjString *name = VALUE_TO_OBJSTR(moduleName);
+        fun = loadBundleModule(vm, module, vm->bundle, name->value.start, name->value.length);
+        if (fun == NULL)
+            RUN_ERROR("module \"%s\" in the bundle is corrupted.", name->value.start);
+    } else if (vm->config.useBytecodeCache && sourcePath != NULL) {
+        cachePath = getCachePath(sourcePath);
+        fun = loadModuleCache(vm, module, moduleCode, sourcePath, cachePath);
+    }
+    if (fun == NULL) {
+        fun = compileModule(vm, module, moduleCode);
+        if (cachePath != NULL) {
+            pushTmpRoot(vm, (ObjHeader *) fun);
+            saveModuleCache(vm, module, fun, moduleCode, cachePath);
+            popTmpRoot(vm);
         }
     }
-
-    ObjFun *fun = compileModule(vm, module, moduleCode);
+    free(cachePath);
     pushTmpRoot(vm, (ObjHeader *) fun);
+    if (isNewModule)
+        mapSet(vm, vm->allModules, moduleName, OBJ_TO_VALUE(module));
+    prepareFunToRun(vm, fun, true);
     ObjClosure *objClosure = newObjClosure(vm, fun);
     pushTmpRoot(vm, (ObjHeader *) objClosure);
     ObjThread *moduleThread = newObjThread(vm, objClosure);
     popTmpRoot(vm); // objClosure
     popTmpRoot(vm); // fn
+    if (isNewModule)
+        popTmpRoot(vm); // module
 
     return moduleThread;
 }
 
+//创建模块moduleName，继承核心模块中的变量，尚未添加到vm->allModules中
+static ObjModule *newModule(VM *vm, Value moduleName) {
+    ObjString *newModuleName = VALUE_TO_OBJSTR(moduleName);
+    ASSERT(newModuleName->value.start[newModuleName->value.length] == EOS,
+           "string.value.start is not terminated.");
+    ObjModule *module = newObjModule(vm, newModuleName->value.start);
+
+    pushTmpRoot(vm, (ObjHeader *) module);
+    ObjModule *coreModule = getModule(vm, CORE_MODULE);
+    uint32_t idx = 0;
+    while (idx < coreModule->moduleVarName.count) {
+        defineModuleVar(vm, module, coreModule->moduleVarName.datas[idx].str,
+                        strlen(coreModule->moduleVarName.datas[idx].str),
+                        coreModule->moduleVarValue.datas[idx]);
+        idx++;
+    }
+    popTmpRoot(vm);
+    return module;
+}
+
+//取得模块moduleName，尚未载入时创建并添加到vm->allModules中
+static ObjModule *getOrNewModule(VM *vm, Value moduleName) {
+    //先查看是否已经导入了该模块，避免重新导入
+    ObjModule *module = getModule(vm, moduleName);
+    if (module == NULL) {
+        module = newModule(vm, moduleName);
+        pushTmpRoot(vm, (ObjHeader *) module);
+        mapSet(vm, vm->allModules, moduleName, OBJ_TO_VALUE(module));
+        popTmpRoot(vm);
+    }
+    return module;
+}
+
 //table中查找符号symbol，找到后返回索引，否则返回-1
 int getIndexFromSymbolTable(SymbolTable *table, const char *symbol, uint32_t length) {
     ASSERT(length != 0, "length of symbol is 0.");
@@ -1521,27 +1590,34 @@ static Class *defineClass(VM *vm, ObjModule *objModule, const char *name) {
     return class;
 }
 
-//使class->methods[index] = method
+//把method绑定到class自身的方法表，方法名索引为index
 void bindMethod(VM *vm, Class *class, uint32_t index, Method method) {
-    if (index >= class->methods.count) {
-        Method emptyPad = {MT_NONE, {0}};
-        MethodBufferFillWrite(vm, &class->methods, emptyPad, index - class->methods.count + 1);
-    }
-    class->methods.datas[index] = method;
+    methodTableSet(vm, &class->methods, index, method);
+    //有类重新定义了is(_)时OPCODE_IS不能再直接比较display
+    if (class != vm->objectClass && strcmp(vm->allMethodNames.datas[index].str, "is(_)") == 0)
+        vm->isMethodRebound = true;
+    //只有查找过class的缓存才可能因此过期，刚定义还未被调用过的类绑定方法不必使全部缓存失效
+    if (class->isLookedUp)
+        vm->methodEpoch++;
 }
 
 //绑定基类
 void bindSuperClass(VM *vm, Class *subClass, Class *superClass) {
     subClass->superClass = superClass;
 
+    //display是基类的display再加上自身
+    uint32_t depth = superClass->depth + 1;
+    uint32_t displayLen = depth + 1;
+    Class **display = ALLOCATE_ARRAY(vm, Class *, displayLen);
+    memcpy(display, superClass->display, sizeof(Class *) * depth);
+    display[depth] = subClass;
+    DEALLOCATE_ARRAY(vm, subClass->display, (subClass->depth + 1));
+    subClass->display = display;
+    subClass->depth = depth;
+
     //继承基类属性数
     subClass->fieldNum += superClass->fieldNum;
-    //继承基类方法
-    uint32_t idx = 0;
-    while (idx < superClass->methods.count) {
-        bindMethod(vm, subClass, idx, superClass->methods.datas[idx]);
-        idx++;
-    }
+    //基类方法不再复制到子类，调用时由findMethod沿基类链查找
 }
 
 //绑定fun.call的重载
@@ -1552,10 +1628,124 @@ static void bindFunOverloadCall(VM *vm, const char *sign) {
     bindMethod(vm, vm->funClass, index, method);
 }
 
+//模块出错后中止从出错线程起的整条调用链，直到执行模块前的线程outerThread，错误信息存入各线程的errorObj
+static void abortThreadsOnError(VM *vm, ObjThread *outerThread, const char *errorMsg) {
+    if (vm->curThread == NULL || vm->curThread == outerThread)
+        return;
+
+    //此时调用链仍经vm->curThread可达，分配不会回收它们
+    Value error = OBJ_TO_VALUE(newObjString(vm, errorMsg, strlen(errorMsg)));
+    ObjThread *objThread = vm->curThread;
+    while (objThread != NULL && objThread != outerThread) {
+        ObjThread *callerThread = objThread->caller;
+        abortThread(objThread);
+        objThread->errorObj = error;
+        objThread = callerThread;
+    }
+}
+
+// 执行模块，sourcePath为模块的源码文件，没有时为NULL
+static VMResult runModule(VM *vm, Value moduleName, const char *moduleCode, const char *sourcePath) {
+    //堆上限可能在initVM之后才设置，首次gc的阈值不能超过它
+    if (vm->config.maxHeapSize != 0 && vm->config.nextGC > vm->config.maxHeapSize)
+        vm->config.nextGC = vm->config.maxHeapSize;
+
+    //编译和执行中的错误都由errorReport跳回这里，出错的模块返回VM_RESULT_ERROR，虚拟机和已编译的模块可以继续使用
+    ErrorRecovery recovery;
+    ErrorRecovery *outerRecovery = errorRecovery;
+    Parser *outerParser = vm->curParser;
+    ObjThread *outerThread = vm->curThread;
+    uint32_t outerTmpRootNum = vm->tmpRootNum;
+    VMResult result;
+
+    //每次执行模块重新计算配额，执行中创建的线程和导入的模块都扣减同一份配额
+    vm->instructionBudget = vm->config.instructionQuota == 0 ? UINT64_MAX : vm->config.instructionQuota;
+
+    errorRecovery = &recovery;
+    if (setjmp(recovery.env) == 0) {
+        ObjThread *objThread = loadModule(vm, moduleName, moduleCode, sourcePath);
+        result = executeInstruction(vm, objThread);
+    } else {
+        //未完成的编译单元和临时根都在已退出的栈帧中，直接丢弃
+        vm->curParser = outerParser;
+        vm->tmpRootNum = outerTmpRootNum;
+        if (vm->isHeapExhausted) {
+            vm->isHeapExhausted = false;
+            vm->instructionBudget = vm->suspendedBudget;
+        }
+        abortThreadsOnError(vm, outerThread, recovery.msg);
+        vm->curThread = outerThread;
+        result = VM_RESULT_ERROR;
+    }
+    errorRecovery = outerRecovery;
+    return result;
+}
+
 // 执行模块
 VMResult executeModule(VM *vm, Value moduleName, const char *moduleCode) {
-    register ObjThread *objThread = loadModule(vm, moduleName, moduleCode);
-    return executeInstruction(vm, objThread);
+    return runModule(vm, moduleName, moduleCode, NULL);
+}
+
+// 执行脚本文件path，模块名即文件路径
+VMResult executeFile(VM *vm, const char *path) {
+    //模块包中有此脚本时不再读取文件，以包中的模块名为模块名
+    if (vm->bundle != NULL) {
+        uint32_t length;
+        const char *name = getModuleNameOfPath(path, &length);
+        if (hasBundleModule(vm->bundle, name, length))
+            return runModule(vm, OBJ_TO_VALUE(newObjString(vm, name, length)), NULL, NULL);
+    }
+    const char *sourceCode = readFile(path);
+    return runModule(vm, OBJ_TO_VALUE(newObjString(vm, path, strlen(path))), sourceCode, path);
+}
+
+// 把源码文件sourcePaths编译后打包为模块包bundlePath，模块名同import的一样，是相对根目录且不带扩展名的路径
+VMResult buildBundle(VM *vm, const char *bundlePath, const char **sourcePaths, uint32_t sourceNum) {
+    BundleWriter writer;
+    initBundleWriter(&writer);
+    //包中保存融合后的栈式指令
+    bool useRegisterTier = vm->config.useRegisterTier;
+    vm->config.useRegisterTier = false;
+
+    ErrorRecovery recovery;
+    ErrorRecovery *outerRecovery = errorRecovery;
+    Parser *outerParser = vm->curParser;
+    uint32_t outerTmpRootNum = vm->tmpRootNum;
+    VMResult result = VM_RESULT_SUCCESS;
+
+    errorRecovery = &recovery;
+    if (setjmp(recovery.env) == 0) {
+        uint32_t idx = 0;
+        while (idx < sourceNum) {
+            const char *path = sourcePaths[idx++];
+            char *sourceCode = readFile(path);
+            uint32_t length;
+            const char *name = getModuleNameOfPath(path, &length);
+            ObjString *moduleName = newObjString(vm, name, length);
+            pushTmpRoot(vm, (ObjHeader *) moduleName);
+            if (getModule(vm, OBJ_TO_VALUE(moduleName)) != NULL)
+                RUN_ERROR("module \"%s\" is given more than once.", moduleName->value.start);
+            ObjModule *module = getOrNewModule(vm, OBJ_TO_VALUE(moduleName));
+            ObjFun *fun = compileModule(vm, module, sourceCode);
+            pushTmpRoot(vm, (ObjHeader *) fun);
+            prepareFunToRun(vm, fun, true);
+            if (!addBundleModule(vm, &writer, name, length, module, fun))
+                RUN_ERROR("can't add module \"%s\" to the bundle.", moduleName->value.start);
+            popTmpRoot(vm); // fun
+            popTmpRoot(vm); // moduleName
+            free(sourceCode);
+        }
+        if (!saveBundle(vm, &writer, bundlePath))
+            IO_ERROR("Couldn't write the bundle : \"%s\"", bundlePath);
+    } else {
+        vm->curParser = outerParser;
+        vm->tmpRootNum = outerTmpRootNum;
+        result = VM_RESULT_ERROR;
+    }
+    errorRecovery = outerRecovery;
+    vm->config.useRegisterTier = useRegisterTier;
+    freeBundleWriter(vm, &writer);
+    return result;
 }
 
 // 编译核心模块
@@ -1593,9 +1783,9 @@ void buildCore(VM *vm) {
     //类型比较
     PRIM_METHOD_BIND(objectMetaClass, "same(_,_)", primObjectMetaSame)
     //绑定各自的meta类
-    vm->objectClass->objHeader.class = objectMetaClass;
-    objectMetaClass->objHeader.class = vm->classOfClass;
-    vm->classOfClass->objHeader.class = vm->classOfClass; //自己指向自己
+    OBJ_SET_CLASS(vm->objectClass, objectMetaClass);
+    OBJ_SET_CLASS(objectMetaClass, vm->classOfClass);
+    OBJ_SET_CLASS(vm->classOfClass, vm->classOfClass); //自己指向自己
 
     //执行核心模块
     executeModule(vm, CORE_MODULE, coreModuleCode);
@@ -1607,27 +1797,28 @@ void buildCore(VM *vm) {
 
     //Thread类也是coreScript.inc中定义的，将其挂载到vm->threadClass并补充原生方法
     vm->threadClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Thread"));
-    if (vm->threadClass->objHeader.class == NULL)
-        vm->threadClass->objHeader.class = vm->threadClass;
+    if (OBJ_CLASS(vm->threadClass) == NULL)
+        OBJ_SET_CLASS(vm->threadClass, vm->threadClass);
 
     //以下是类方法
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "new(_)", primThreadNew)
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "abort(_)", primThreadAbort)
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "current", primThreadCurrent)
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "suspend()", primThreadSuspend)
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "yield(_)", primThreadYieldWithArg)
-    PRIM_METHOD_BIND(vm->threadClass->objHeader.class, "yield()", primThreadYieldWithoutArg)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->threadClass), "new(_)", primThreadNew)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->threadClass), "abort(_)", primThreadAbort)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->threadClass), "current", primThreadCurrent)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->threadClass), "suspend()", primThreadSuspend)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->threadClass), "yield(_)", primThreadYieldWithArg)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->threadClass), "yield()", primThreadYieldWithoutArg)
     //以下是实例方法
     PRIM_METHOD_BIND(vm->threadClass, "call()", primThreadCallWithoutArg)
     PRIM_METHOD_BIND(vm->threadClass, "call(_)", primThreadCallWithArg)
     PRIM_METHOD_BIND(vm->threadClass, "isDone", primThreadIsDone)
+    PRIM_METHOD_BIND(vm->threadClass, "error", primThreadError)
 
     //绑定函数类
     vm->funClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Fun"));
-    if (vm->funClass->objHeader.class == NULL)
-        vm->funClass->objHeader.class = vm->funClass;
+    if (OBJ_CLASS(vm->funClass) == NULL)
+        OBJ_SET_CLASS(vm->funClass, vm->funClass);
 
-    PRIM_METHOD_BIND(vm->funClass->objHeader.class, "new(_)", primFunNew)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->funClass), "new(_)", primFunNew)
     //绑定call的重载方法
     bindFunOverloadCall(vm, "call()");
     bindFunOverloadCall(vm, "call(_)");
@@ -1654,12 +1845,12 @@ void buildCore(VM *vm) {
 
     //绑定Num类的方法
     vm->numClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Num"));
-    if (vm->numClass->objHeader.class == NULL)
-        vm->numClass->objHeader.class = vm->numClass;
+    if (OBJ_CLASS(vm->numClass) == NULL)
+        OBJ_SET_CLASS(vm->numClass, vm->numClass);
 
     //类方法
-    PRIM_METHOD_BIND(vm->numClass->objHeader.class, "fromString(_)", primStringToNum)
-    PRIM_METHOD_BIND(vm->numClass->objHeader.class, "pi", primNumPi)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->numClass), "fromString(_)", primStringToNum)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->numClass), "pi", primNumPi)
     //实例方法
     PRIM_METHOD_BIND(vm->numClass, "+(_)", primNumPlus)
     PRIM_METHOD_BIND(vm->numClass, "-(_)", primNumMinus)
@@ -1704,10 +1895,10 @@ void buildCore(VM *vm) {
 
     //绑定字符串类
     vm->stringClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "String"));
-    if (vm->stringClass->objHeader.class == NULL)
-        vm->stringClass->objHeader.class = vm->stringClass;
+    if (OBJ_CLASS(vm->stringClass) == NULL)
+        OBJ_SET_CLASS(vm->stringClass, vm->stringClass);
 
-    PRIM_METHOD_BIND(vm->stringClass->objHeader.class, "fromCodePoint(_)", primStringFromCodePoint)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->stringClass), "fromCodePoint(_)", primStringFromCodePoint)
 
     PRIM_METHOD_BIND(vm->stringClass, "+(_)", primStringPlus)
     PRIM_METHOD_BIND(vm->stringClass, "[_]", primStringSubScript)
@@ -1726,10 +1917,10 @@ void buildCore(VM *vm) {
 
     //绑定List类
     vm->listClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "List"));
-    if (vm->listClass->objHeader.class == NULL)
-        vm->listClass->objHeader.class = vm->listClass;
+    if (OBJ_CLASS(vm->listClass) == NULL)
+        OBJ_SET_CLASS(vm->listClass, vm->listClass);
 
-    PRIM_METHOD_BIND(vm->listClass->objHeader.class, "new()", primListNew)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->listClass), "new()", primListNew)
     PRIM_METHOD_BIND(vm->listClass, "[_]", primListSubScript)
     PRIM_METHOD_BIND(vm->listClass, "[_]=(_)", primListSubScriptSetter)
     PRIM_METHOD_BIND(vm->listClass, "append(_)", primListAppend)
@@ -1743,10 +1934,10 @@ void buildCore(VM *vm) {
 
     //绑定Map类
     vm->mapClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "Map"));
-    if (vm->mapClass->objHeader.class == NULL)
-        vm->mapClass->objHeader.class = vm->mapClass;
+    if (OBJ_CLASS(vm->mapClass) == NULL)
+        OBJ_SET_CLASS(vm->mapClass, vm->mapClass);
 
-    PRIM_METHOD_BIND(vm->mapClass->objHeader.class, "new()", primMapNew)
+    PRIM_METHOD_BIND(OBJ_CLASS(vm->mapClass), "new()", primMapNew)
     PRIM_METHOD_BIND(vm->mapClass, "[_]", primMapSubScript)
     PRIM_METHOD_BIND(vm->mapClass, "[_]=(_)", primMapSubScriptSetter)
     PRIM_METHOD_BIND(vm->mapClass, "addCore_(_,_)", primMapAddCore)
@@ -1755,6 +1946,9 @@ void buildCore(VM *vm) {
     PRIM_METHOD_BIND(vm->mapClass, "count", primMapCount)
     PRIM_METHOD_BIND(vm->mapClass, "remove(_)", primMapRemove)
     PRIM_METHOD_BIND(vm->mapClass, "iterate_(_)", primMapIterate)
+    //for k (map)直接迭代map时得到的是key
+    PRIM_METHOD_BIND(vm->mapClass, "iterate(_)", primMapIterate)
+    PRIM_METHOD_BIND(vm->mapClass, "iteratorValue(_)", primMapKeyIteratorValue)
     PRIM_METHOD_BIND(vm->mapClass, "keyIteratorValue_(_)", primMapKeyIteratorValue)
     PRIM_METHOD_BIND(vm->mapClass, "valueIteratorValue_(_)", primMapValueIteratorValue)
 
@@ -1769,20 +1963,20 @@ void buildCore(VM *vm) {
 
     //绑定System类
     Class *systemClass = VALUE_TO_CLASS(getCoreClassValue(coreModule, "System"));
-    if (systemClass->objHeader.class == NULL)
-        systemClass->objHeader.class = systemClass;
+    if (OBJ_CLASS(systemClass) == NULL)
+        OBJ_SET_CLASS(systemClass, systemClass);
 
-    PRIM_METHOD_BIND(systemClass->objHeader.class, "clock", primSystemClock)
-    PRIM_METHOD_BIND(systemClass->objHeader.class, "gc()", primSystemGC)
-    PRIM_METHOD_BIND(systemClass->objHeader.class, "importModule(_)", primSystemImportModule)
-    PRIM_METHOD_BIND(systemClass->objHeader.class, "getModuleVariable(_,_)", primSystemGetModuleVariable)
-    PRIM_METHOD_BIND(systemClass->objHeader.class, "writeString_(_)", primSystemWriteString)
+    PRIM_METHOD_BIND(OBJ_CLASS(systemClass), "clock", primSystemClock)
+    PRIM_METHOD_BIND(OBJ_CLASS(systemClass), "gc()", primSystemGC)
+    PRIM_METHOD_BIND(OBJ_CLASS(systemClass), "importModule(_)", primSystemImportModule)
+    PRIM_METHOD_BIND(OBJ_CLASS(systemClass), "getModuleVariable(_,_)", primSystemGetModuleVariable)
+    PRIM_METHOD_BIND(OBJ_CLASS(systemClass), "writeString_(_)", primSystemWriteString)
 
     //在核心自举过程中创建了很多ObjString对象，创建过程中需要调用initObjHeader初始化对象头，使其class指向vm->stringClass，但那时的vm->stringClass尚未初始化，因此现在更正
     ObjHeader *objHeader = vm->allObjects;
     while (objHeader != NULL) {
         if (objHeader->objType == OT_STRING)
-            objHeader->class = vm->stringClass;
-        objHeader = objHeader->next;
+            OBJ_SET_CLASS(objHeader, vm->stringClass);
+        objHeader = OBJ_NEXT(objHeader);
     }
 }
@@ -11,11 +11,14 @@
 extern char *rootDir;
 char *readFile(const char *sourceFile);
 VMResult executeModule(VM *vm, Value moduleName, const char *moduleCode);
+VMResult executeFile(VM *vm, const char *path);
+VMResult buildBundle(VM *vm, const char *bundlePath, const char **sourcePaths, uint32_t sourceNum);
 void buildCore(VM *vm);
 int getIndexFromSymbolTable(SymbolTable *table, const char *symbol, uint32_t length);
 int addSymbol(VM *vm, SymbolTable *table, const char *symbol, uint32_t length);
 int ensureSymbolExist(VM *vm, SymbolTable *table, const char *symbol, uint32_t length);
 void bindMethod(VM *vm, Class *class, uint32_t index, Method method);
 void bindSuperClass(VM *vm, Class *subClass, Class *superClass);
+Value stringCodePointAt(VM *vm, ObjString *objString, uint32_t index);
 
 #endif //STOVE_CORE_H
@@ -0,0 +1,645 @@
+#include "jit.h"
+
+#if ENABLE_JIT
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../objectAndClass/include/class.h"
+#include "../compiler/compiler.h"
+
+//基线JIT不做寄存器分配和优化，每条指令按固定的机器码模板翻译
+//运行时栈仍是线程的栈，机器码与解释器共用同一个Frame，因此两者可以在任意指令边界互相切换
+//机器码中寄存器的用途：
+//rbx：本帧的stackStart  r12：栈顶esp  r13：当前线程  r14：常量QNAN，用于判断是否为数字  r15：当前frame
+//遇到模板未覆盖的指令或者守卫失败时，把esp写回线程后退出机器码，由解释器从该指令继续执行
+
+//jcc rel32的第二个字节，加0x10即为对应的setcc
+#define CC_JB 0x82
+#define CC_JAE 0x83
+#define CC_JE 0x84
+#define CC_JNE 0x85
+#define CC_JBE 0x86
+#define CC_JA 0x87
+#define CC_JP 0x8A
+
+typedef struct {
+    VM *vm;
+    ObjFun *fun;
+    ByteBuffer code; //正在生成的机器码
+    uint32_t *instrToCode; //指令起始偏移到机器码偏移的映射，用于回填跳转
+    IntBuffer jumpPatches; //待回填的跳转，成对存放rel32在机器码中的位置和目标指令的偏移
+    IntBuffer exitPatches; //待回填的退出，成对存放rel32在机器码中的位置和退出处指令的偏移
+    uint32_t exitPos; //公共退出代码在机器码中的位置
+} JitCompiler;
+
+static void emitBytes(JitCompiler *jc, const uint8_t *bytes, uint32_t num) {
+    uint32_t idx = 0;
+    while (idx < num)
+        ByteBufferAdd(jc->vm, &jc->code, bytes[idx++]);
+}
+
+//写入一段机器码模板
+#define EMIT(jc, ...) emitBytes(jc, (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}))
+
+//以小端写入4字节立即数
+static void emitImm32(JitCompiler *jc, uint32_t imm) {
+    EMIT(jc, imm & 0xff, (imm >> 8) & 0xff, (imm >> 16) & 0xff, (imm >> 24) & 0xff);
+}
+
+static void emitImm64(JitCompiler *jc, uint64_t imm) {
+    emitImm32(jc, (uint32_t) imm);
+    emitImm32(jc, (uint32_t) (imm >> 32));
+}
+
+//把机器码pos处的rel32改为跳转到target
+static void patchRel32(JitCompiler *jc, uint32_t pos, uint32_t target) {
+    uint32_t rel = target - (pos + 4);
+    memcpy(jc->code.datas + pos, &rel, 4);
+}
+
+//mov rax, imm64
+static void emitMovRax(JitCompiler *jc, uint64_t imm) {
+    EMIT(jc, 0x48, 0xB8);
+    emitImm64(jc, imm);
+}
+
+//mov rcx, imm64
+static void emitMovRcx(JitCompiler *jc, uint64_t imm) {
+    EMIT(jc, 0x48, 0xB9);
+    emitImm64(jc, imm);
+}
+
+//写入rel32跳转到目标指令，目标指令的机器码可能还未生成，先记下待回填
+static void emitJumpOperand(JitCompiler *jc, uint32_t targetOffset) {
+    IntBufferAdd(jc->vm, &jc->jumpPatches, (int) jc->code.count);
+    IntBufferAdd(jc->vm, &jc->jumpPatches, (int) targetOffset);
+    emitImm32(jc, 0);
+}
+
+//jmp到指令流targetOffset处的机器码
+static void emitJmp(JitCompiler *jc, uint32_t targetOffset) {
+    EMIT(jc, 0xE9);
+    emitJumpOperand(jc, targetOffset);
+}
+
+//条件成立时jmp到指令流targetOffset处的机器码
+static void emitJcc(JitCompiler *jc, uint8_t cc, uint32_t targetOffset) {
+    EMIT(jc, 0x0F, cc);
+    emitJumpOperand(jc, targetOffset);
+}
+
+//退出机器码，解释器从指令流offset处继续执行
+static void emitExit(JitCompiler *jc, uint32_t offset) {
+    emitMovRax(jc, (uint64_t) (uintptr_t) (jc->fun->instrStream.datas + offset));
+    EMIT(jc, 0xE9);
+    emitImm32(jc, 0);
+    patchRel32(jc, jc->code.count - 4, jc->exitPos);
+}
+
+//条件成立时退出机器码，由解释器重新执行offset处的指令，退出代码统一放在机器码末尾
+static void emitJccExit(JitCompiler *jc, uint8_t cc, uint32_t offset) {
+    EMIT(jc, 0x0F, cc);
+    IntBufferAdd(jc->vm, &jc->exitPatches, (int) jc->code.count);
+    IntBufferAdd(jc->vm, &jc->exitPatches, (int) offset);
+    emitImm32(jc, 0);
+}
+
+//入口和公共退出代码
+static void emitPrologue(JitCompiler *jc) {
+    //保存被调用者保存的寄存器，5次压栈后rsp恰好16字节对齐，可直接调用C函数
+    EMIT(jc, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    EMIT(jc, 0x49, 0x89, 0xFD); //mov r13, rdi
+    EMIT(jc, 0x49, 0x89, 0xF7); //mov r15, rsi
+    EMIT(jc, 0x49, 0x8B, 0x9F); //mov rbx, [r15 + stackStart]
+    emitImm32(jc, offsetof(Frame, stackStart));
+    EMIT(jc, 0x4D, 0x8B, 0xA5); //mov r12, [r13 + esp]
+    emitImm32(jc, offsetof(ObjThread, esp));
+    EMIT(jc, 0x49, 0xBE); //mov r14, QNAN
+    emitImm64(jc, QNAN);
+    EMIT(jc, 0xFF, 0xE2); //jmp rdx
+
+    //退出时rax是解释器要继续执行的ip
+    jc->exitPos = jc->code.count;
+    EMIT(jc, 0x4D, 0x89, 0xA5); //mov [r13 + esp], r12
+    emitImm32(jc, offsetof(ObjThread, esp));
+    EMIT(jc, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+}
+
+//把rax压栈
+static void emitPushRax(JitCompiler *jc) {
+    EMIT(jc, 0x49, 0x89, 0x04, 0x24); //mov [r12], rax
+    EMIT(jc, 0x49, 0x83, 0xC4, 0x08); //add r12, 8
+}
+
+//弹栈到rax
+static void emitPopRax(JitCompiler *jc) {
+    EMIT(jc, 0x49, 0x83, 0xEC, 0x08); //sub r12, 8
+    EMIT(jc, 0x49, 0x8B, 0x04, 0x24); //mov rax, [r12]
+}
+
+//栈顶读到rax
+static void emitPeekRax(JitCompiler *jc) {
+    EMIT(jc, 0x49, 0x8B, 0x44, 0x24, 0xF8);
+}
+
+//栈顶读到rcx
+static void emitPeekRcx(JitCompiler *jc) {
+    EMIT(jc, 0x49, 0x8B, 0x4C, 0x24, 0xF8);
+}
+
+//rax写回栈顶
+static void emitStoreTop(JitCompiler *jc) {
+    EMIT(jc, 0x49, 0x89, 0x44, 0x24, 0xF8);
+}
+
+//二元运算弹出两个操作数，结果rax入栈
+static void emitReplaceTopTwo(JitCompiler *jc) {
+    EMIT(jc, 0x49, 0x83, 0xEC, 0x08); //sub r12, 8
+    emitStoreTop(jc);
+}
+
+//rax或rcx不是数字时退出
+static void emitGuardNum(JitCompiler *jc, bool isRcx, uint32_t offset) {
+    if (isRcx)
+        EMIT(jc, 0x48, 0x89, 0xCA); //mov rdx, rcx
+    else
+        EMIT(jc, 0x48, 0x89, 0xC2); //mov rdx, rax
+    EMIT(jc, 0x4C, 0x21, 0xF2); //and rdx, r14
+    EMIT(jc, 0x4C, 0x39, 0xF2); //cmp rdx, r14
+    emitJccExit(jc, CC_JE, offset);
+}
+
+//rax中的self不是实例或没有第fieldIdx个字段时退出，由解释器报错，否则把rax转为实例的地址
+static void emitGuardField(JitCompiler *jc, uint32_t fieldIdx, uint32_t offset) {
+    emitMovRcx(jc, SIGN_BIT | QNAN);
+    EMIT(jc, 0x48, 0x89, 0xC2); //mov rdx, rax
+    EMIT(jc, 0x48, 0x21, 0xCA); //and rdx, rcx
+    EMIT(jc, 0x48, 0x39, 0xCA); //cmp rdx, rcx
+    emitJccExit(jc, CC_JNE, offset);
+    EMIT(jc, 0x48, 0x31, 0xC8); //xor rax, rcx
+#if COMPRESSED_HEAP
+    EMIT(jc, 0x80, 0xB8); //cmp byte [rax + objType], OT_INSTANCE
+    emitImm32(jc, offsetof(ObjHeader, objType));
+    EMIT(jc, OT_INSTANCE);
+    emitJccExit(jc, CC_JNE, offset);
+    EMIT(jc, 0x8B, 0x90); //mov edx, [rax + classRef]
+    emitImm32(jc, offsetof(ObjHeader, classRef));
+    emitMovRcx(jc, (uint64_t) (uintptr_t) &objHeapBase);
+    EMIT(jc, 0x48, 0x03, 0x11); //add rdx, [rcx]
+#else
+    EMIT(jc, 0x81, 0xB8); //cmp dword [rax + objType], OT_INSTANCE
+    emitImm32(jc, offsetof(ObjHeader, objType));
+    emitImm32(jc, OT_INSTANCE);
+    emitJccExit(jc, CC_JNE, offset);
+    EMIT(jc, 0x48, 0x8B, 0x90); //mov rdx, [rax + class]
+    emitImm32(jc, offsetof(ObjHeader, class));
+#endif
+    EMIT(jc, 0x81, 0xBA); //cmp dword [rdx + fieldNum], fieldIdx
+    emitImm32(jc, offsetof(Class, fieldNum));
+    emitImm32(jc, fieldIdx);
+    emitJccExit(jc, CC_JBE, offset);
+}
+
+//数字二元运算的公共部分：次栈顶是左操作数放入xmm0，栈顶是右操作数放入xmm1，二者都须是数字
+static void emitNumOperands(JitCompiler *jc, uint32_t offset) {
+    EMIT(jc, 0x49, 0x8B, 0x44, 0x24, 0xF0); //mov rax, [r12 - 16]
+    emitPeekRcx(jc);
+    emitGuardNum(jc, false, offset);
+    emitGuardNum(jc, true, offset);
+    EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xC0); //movq xmm0, rax
+    EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xC9); //movq xmm1, rcx
+}
+
+//比较xmm0和xmm1中的数字，返回比较结果为真时的条件码
+//小于和小于等于交换操作数比较，使无序（NaN参与比较）时的结果与C一致为假
+static uint8_t emitCompare(JitCompiler *jc, OpCode opCode) {
+    if (opCode == OPCODE_LT || opCode == OPCODE_LE)
+        EMIT(jc, 0x66, 0x0F, 0x2E, 0xC8); //ucomisd xmm1, xmm0
+    else
+        EMIT(jc, 0x66, 0x0F, 0x2E, 0xC1); //ucomisd xmm0, xmm1
+
+    switch (opCode) {
+        case OPCODE_LT:
+        case OPCODE_GT:
+            return CC_JA;
+        case OPCODE_LE:
+        case OPCODE_GE:
+            return CC_JAE;
+        case OPCODE_EQ:
+            return CC_JE;
+        default:
+            return CC_JNE;
+    }
+}
+
+//把xmm0中的数字转为Value放入rax
+static void emitNumResult(JitCompiler *jc) {
+    EMIT(jc, 0x66, 0x48, 0x0F, 0x7E, 0xC0); //movq rax, xmm0
+}
+
+//把rax中的32位无符号整数转为数字Value
+static void emitUint32Result(JitCompiler *jc) {
+    EMIT(jc, 0xF2, 0x48, 0x0F, 0x2A, 0xC0); //cvtsi2sd xmm0, rax
+    emitNumResult(jc);
+}
+
+//把局部变量、模块变量、常量等的读写翻译为机器码，未覆盖的指令返回false
+static bool emitLoadStore(JitCompiler *jc, OpCode opCode, uint8_t *operands, uint32_t offset) {
+    ObjFun *fun = jc->fun;
+    uint32_t byteOperand = operands[0];
+    uint32_t shortOperand = (operands[0] << 8) | operands[1];
+
+    switch (opCode) {
+        case OPCODE_LOAD_LOCAL_VAR:
+        case OPCODE_LOAD_LOCAL_VAR_CONSTANT:
+        case OPCODE_LOAD_LOCAL_VAR_LOCAL_VAR:
+            //超级指令只翻译前一条指令，后一条指令在指令流中原样保留，会单独翻译
+            EMIT(jc, 0x48, 0x8B, 0x83); //mov rax, [rbx + idx * 8]
+            emitImm32(jc, byteOperand * sizeof(Value));
+            emitPushRax(jc);
+            return true;
+
+        case OPCODE_STORE_LOCAL_VAR:
+        case OPCODE_STORE_LOCAL_VAR_POP:
+            emitPeekRax(jc);
+            EMIT(jc, 0x48, 0x89, 0x83); //mov [rbx + idx * 8], rax
+            emitImm32(jc, byteOperand * sizeof(Value));
+            return true;
+
+        case OPCODE_LOAD_CONSTANT:
+            emitMovRax(jc, fun->constants.datas[shortOperand]);
+            emitPushRax(jc);
+            return true;
+
+        case OPCODE_PUSH_NULL:
+            emitMovRax(jc, VT_TO_VALUE(VT_NULL));
+            emitPushRax(jc);
+            return true;
+
+        case OPCODE_PUSH_FALSE:
+            emitMovRax(jc, VT_TO_VALUE(VT_FALSE));
+            emitPushRax(jc);
+            return true;
+
+        case OPCODE_PUSH_TRUE:
+            emitMovRax(jc, VT_TO_VALUE(VT_TRUE));
+            emitPushRax(jc);
+            return true;
+
+        case OPCODE_POP:
+            EMIT(jc, 0x49, 0x83, 0xEC, 0x08); //sub r12, 8
+            return true;
+
+        case OPCODE_LOAD_MODULE_VAR:
+        case OPCODE_LOAD_MODULE_VAR_CONSTANT:
+        case OPCODE_STORE_MODULE_VAR:
+        case OPCODE_STORE_MODULE_VAR_POP:
+            //模块变量表可能扩容，每次都经由模块重新读取表的地址
+            emitMovRax(jc, (uint64_t) (uintptr_t) &fun->module->moduleVarValue.datas);
+            EMIT(jc, 0x48, 0x8B, 0x00); //mov rax, [rax]
+            if (opCode == OPCODE_LOAD_MODULE_VAR || opCode == OPCODE_LOAD_MODULE_VAR_CONSTANT) {
+                EMIT(jc, 0x48, 0x8B, 0x80); //mov rax, [rax + idx * 8]
+                emitImm32(jc, shortOperand * sizeof(Value));
+                emitPushRax(jc);
+            } else {
+                emitPeekRcx(jc);
+                EMIT(jc, 0x48, 0x89, 0x88); //mov [rax + idx * 8], rcx
+                emitImm32(jc, shortOperand * sizeof(Value));
+            }
+            return true;
+
+        case OPCODE_LOAD_SELF_FIELD:
+        case OPCODE_STORE_SELF_FIELD:
+            //stackStart[0]是实例对象self
+            EMIT(jc, 0x48, 0x8B, 0x03); //mov rax, [rbx]
+            emitGuardField(jc, byteOperand, offset);
+            if (opCode == OPCODE_LOAD_SELF_FIELD) {
+                EMIT(jc, 0x48, 0x8B, 0x80); //mov rax, [rax + fields[idx]]
+                emitImm32(jc, offsetof(ObjInstance, fields) + byteOperand * sizeof(Value));
+                emitPushRax(jc);
+            } else {
+                emitPeekRcx(jc);
+                EMIT(jc, 0x48, 0x89, 0x88); //mov [rax + fields[idx]], rcx
+                emitImm32(jc, offsetof(ObjInstance, fields) + byteOperand * sizeof(Value));
+            }
+            return true;
+
+        case OPCODE_LOAD_UPVALUE:
+        case OPCODE_STORE_UPVALUE:
+            EMIT(jc, 0x49, 0x8B, 0x87); //mov rax, [r15 + closure]
+            emitImm32(jc, offsetof(Frame, closure));
+            EMIT(jc, 0x48, 0x8B, 0x80); //mov rax, [rax + upvalues[idx]]
+            emitImm32(jc, offsetof(ObjClosure, upvalues) + byteOperand * sizeof(CapturedVar));
+            EMIT(jc, 0x48, 0x8B, 0x80); //mov rax, [rax + localVarPtr]
+            emitImm32(jc, offsetof(ObjUpvalue, localVarPtr));
+            if (opCode == OPCODE_LOAD_UPVALUE) {
+                EMIT(jc, 0x48, 0x8B, 0x00); //mov rax, [rax]
+                emitPushRax(jc);
+            } else {
+                emitPeekRcx(jc);
+                EMIT(jc, 0x48, 0x89, 0x08); //mov [rax], rcx
+            }
+            return true;
+
+        case OPCODE_LOAD_CAPTURED:
+            //按值捕获的变量直接存在闭包中
+            EMIT(jc, 0x49, 0x8B, 0x87); //mov rax, [r15 + closure]
+            emitImm32(jc, offsetof(Frame, closure));
+            EMIT(jc, 0x48, 0x8B, 0x80); //mov rax, [rax + upvalues[idx]]
+            emitImm32(jc, offsetof(ObjClosure, upvalues) + byteOperand * sizeof(CapturedVar));
+            emitPushRax(jc);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+//把数字运算翻译为机器码，操作数不是数字时退出，由解释器回退到运算符方法调用
+static bool emitNumOp(JitCompiler *jc, OpCode opCode, uint32_t offset) {
+    switch (opCode) {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV: {
+            static const uint8_t sseOps[] = {0x58, 0x5C, 0x59, 0x5E}; //addsd, subsd, mulsd, divsd
+            emitNumOperands(jc, offset);
+            EMIT(jc, 0xF2, 0x0F, sseOps[opCode - OPCODE_ADD], 0xC1); //op xmm0, xmm1
+            emitNumResult(jc);
+            emitReplaceTopTwo(jc);
+            return true;
+        }
+
+        case OPCODE_MOD:
+            //与primNumMod一致调用fmod，参数和返回值都在xmm寄存器中
+            emitNumOperands(jc, offset);
+            emitMovRax(jc, (uint64_t) (uintptr_t) fmod);
+            EMIT(jc, 0xFF, 0xD0); //call rax
+            emitNumResult(jc);
+            emitReplaceTopTwo(jc);
+            return true;
+
+        case OPCODE_LT:
+        case OPCODE_LE:
+        case OPCODE_GT:
+        case OPCODE_GE:
+        case OPCODE_EQ:
+        case OPCODE_NEQ: {
+            emitNumOperands(jc, offset);
+            uint8_t cc = emitCompare(jc, opCode);
+            EMIT(jc, 0x0F, cc + 0x10, 0xC0); //setcc al
+            //有NaN参与时相等为假，不等为真
+            if (opCode == OPCODE_EQ)
+                EMIT(jc, 0x0F, CC_JP + 0x11, 0xC1, 0x20, 0xC8); //setnp cl; and al, cl
+            else if (opCode == OPCODE_NEQ)
+                EMIT(jc, 0x0F, CC_JP + 0x10, 0xC1, 0x08, 0xC8); //setp cl; or al, cl
+            EMIT(jc, 0x0F, 0xB6, 0xC0); //movzx eax, al
+            //VT_TRUE紧随VT_FALSE，故false的Value加上比较结果就是bool值
+            emitMovRcx(jc, VT_TO_VALUE(VT_FALSE));
+            EMIT(jc, 0x48, 0x01, 0xC8); //add rax, rcx
+            emitReplaceTopTwo(jc);
+            return true;
+        }
+
+        case OPCODE_BIT_AND:
+        case OPCODE_BIT_OR:
+        case OPCODE_BIT_SHIFT_LEFT:
+        case OPCODE_BIT_SHIFT_RIGHT:
+            //与BIT_OP一致，先截断为整数再取低32位，32位运算会清零rax的高32位
+            emitNumOperands(jc, offset);
+            EMIT(jc, 0xF2, 0x48, 0x0F, 0x2C, 0xC0); //cvttsd2si rax, xmm0
+            EMIT(jc, 0xF2, 0x48, 0x0F, 0x2C, 0xC9); //cvttsd2si rcx, xmm1
+            if (opCode == OPCODE_BIT_AND)
+                EMIT(jc, 0x21, 0xC8); //and eax, ecx
+            else if (opCode == OPCODE_BIT_OR)
+                EMIT(jc, 0x09, 0xC8); //or eax, ecx
+            else if (opCode == OPCODE_BIT_SHIFT_LEFT)
+                EMIT(jc, 0xD3, 0xE0); //shl eax, cl
+            else
+                EMIT(jc, 0xD3, 0xE8); //shr eax, cl
+            emitUint32Result(jc);
+            emitReplaceTopTwo(jc);
+            return true;
+
+        case OPCODE_NEG:
+            emitPeekRax(jc);
+            emitGuardNum(jc, false, offset);
+            EMIT(jc, 0x48, 0x0F, 0xBA, 0xF8, 0x3F); //btc rax, 63
+            emitStoreTop(jc);
+            return true;
+
+        case OPCODE_BIT_NOT:
+            emitPeekRax(jc);
+            emitGuardNum(jc, false, offset);
+            EMIT(jc, 0x66, 0x48, 0x0F, 0x6E, 0xC0); //movq xmm0, rax
+            EMIT(jc, 0xF2, 0x48, 0x0F, 0x2C, 0xC0); //cvttsd2si rax, xmm0
+            EMIT(jc, 0xF7, 0xD0); //not eax
+            emitUint32Result(jc);
+            emitStoreTop(jc);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+//rax为false或null时跳转到targetOffset
+static void emitJumpIfFalsy(JitCompiler *jc, uint32_t targetOffset) {
+    emitMovRcx(jc, VT_TO_VALUE(VT_FALSE));
+    EMIT(jc, 0x48, 0x39, 0xC8); //cmp rax, rcx
+    emitJcc(jc, CC_JE, targetOffset);
+    emitMovRcx(jc, VT_TO_VALUE(VT_NULL));
+    EMIT(jc, 0x48, 0x39, 0xC8);
+    emitJcc(jc, CC_JE, targetOffset);
+}
+
+//把跳转翻译为机器码，跳转目标在回填时由指令偏移换算为机器码偏移
+static bool emitBranch(JitCompiler *jc, OpCode opCode, uint32_t offset) {
+    uint8_t *instr = jc->fun->instrStream.datas;
+    uint32_t shortOperand = (instr[offset + 1] << 8) | instr[offset + 2];
+
+    switch (opCode) {
+        case OPCODE_JUMP:
+            emitJmp(jc, offset + 3 + shortOperand);
+            return true;
+
+        case OPCODE_LOOP:
+            emitJmp(jc, offset + 3 - shortOperand);
+            return true;
+
+        case OPCODE_JUMP_IF_FALSE:
+            emitPopRax(jc);
+            emitJumpIfFalsy(jc, offset + 3 + shortOperand);
+            return true;
+
+        case OPCODE_AND:
+            //条件为假时保留在栈顶并跳过右操作数，否则丢掉条件
+            emitPeekRax(jc);
+            emitJumpIfFalsy(jc, offset + 3 + shortOperand);
+            EMIT(jc, 0x49, 0x83, 0xEC, 0x08); //sub r12, 8
+            return true;
+
+        case OPCODE_OR:
+            //条件为假或空时丢掉条件继续计算右操作数，否则跳过右操作数
+            emitPeekRax(jc);
+            emitMovRcx(jc, VT_TO_VALUE(VT_FALSE));
+            EMIT(jc, 0x48, 0x39, 0xC8, 0x74, 0x14); //cmp rax, rcx; je drop
+            emitMovRcx(jc, VT_TO_VALUE(VT_NULL));
+            EMIT(jc, 0x48, 0x39, 0xC8, 0x74, 0x05); //cmp rax, rcx; je drop
+            emitJmp(jc, offset + 3 + shortOperand);
+            EMIT(jc, 0x49, 0x83, 0xEC, 0x08); //drop: sub r12, 8
+            return true;
+
+        case OPCODE_LT_JUMP_IF_FALSE:
+        case OPCODE_LE_JUMP_IF_FALSE:
+        case OPCODE_GT_JUMP_IF_FALSE:
+        case OPCODE_GE_JUMP_IF_FALSE:
+        case OPCODE_EQ_JUMP_IF_FALSE:
+        case OPCODE_NEQ_JUMP_IF_FALSE: {
+            //比较并跳转，后一条JUMP_IF_FALSE在offset + 5处，其后的指令在offset + 8处
+            //操作数不是数字时退出，解释器按比较指令回退到方法调用，返回后再由JUMP_IF_FALSE的机器码继续
+            ASSERT(instr[offset + 5] == OPCODE_JUMP_IF_FALSE, "compare should be followed by OPCODE_JUMP_IF_FALSE.");
+            uint32_t jumpOffset = (instr[offset + 6] << 8) | instr[offset + 7];
+            uint32_t target = offset + 8 + jumpOffset;
+
+            emitNumOperands(jc, offset);
+            EMIT(jc, 0x4D, 0x8D, 0x64, 0x24, 0xF0); //lea r12, [r12 - 16]，不影响标志位
+            uint8_t cc = emitCompare(jc, opCode - OPCODE_LT_JUMP_IF_FALSE + OPCODE_LT);
+            if (cc == CC_JE) {
+                //相等为假：不等或无序
+                emitJcc(jc, CC_JNE, target);
+                emitJcc(jc, CC_JP, target);
+            } else if (cc == CC_JNE) {
+                //不等为假：相等且有序
+                EMIT(jc, 0x7A, 0x06); //jp 跳过下面的je
+                emitJcc(jc, CC_JE, target);
+            } else
+                emitJcc(jc, cc == CC_JA ? CC_JBE : CC_JB, target);
+            emitJmp(jc, offset + 8);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+//把指令流中offset处的指令按模板翻译为机器码，没有模板的指令返回false
+static bool emitTemplate(JitCompiler *jc, uint32_t offset) {
+    uint8_t *instr = jc->fun->instrStream.datas;
+    OpCode opCode = (OpCode) instr[offset];
+    return emitLoadStore(jc, opCode, instr + offset + 1, offset) || emitNumOp(jc, opCode, offset) ||
+           emitBranch(jc, opCode, offset);
+}
+
+//把机器码装入可执行内存
+static JitCode *installCode(VM *vm, ByteBuffer *code, uint32_t *entries, uint32_t entryNum) {
+    uint32_t pageSize = (uint32_t) sysconf(_SC_PAGESIZE);
+    uint32_t codeSize = (code->count + pageSize - 1) / pageSize * pageSize;
+
+    //先以可写映射写入机器码，再改为只读可执行，不同时可写可执行
+    uint8_t *mem = mmap(NULL, codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    memcpy(mem, code->datas, code->count);
+    if (mprotect(mem, codeSize, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, codeSize);
+        return NULL;
+    }
+
+    JitCode *jitCode = ALLOCATE(vm, JitCode);
+    if (jitCode == NULL)
+        MEM_ERROR("allocate JitCode failed.");
+    jitCode->code = mem;
+    jitCode->codeSize = codeSize;
+    jitCode->entries = entries;
+    jitCode->entryNum = entryNum;
+    return jitCode;
+}
+
+//把热点函数编译为机器码，失败时函数继续由解释器执行
+void compileJit(VM *vm, ObjFun *fun) {
+    if (fun->jitCode != NULL || fun->jitFailed)
+        return;
+
+    JitCompiler jc;
+    jc.vm = vm;
+    jc.fun = fun;
+    ByteBufferInit(&jc.code);
+    IntBufferInit(&jc.jumpPatches);
+    IntBufferInit(&jc.exitPatches);
+
+    uint32_t instrNum = fun->instrStream.count;
+    jc.instrToCode = ALLOCATE_ARRAY(vm, uint32_t, instrNum);
+    uint32_t *entries = ALLOCATE_ARRAY(vm, uint32_t, instrNum);
+    if (jc.instrToCode == NULL || entries == NULL)
+        MEM_ERROR("allocate jit entries failed.");
+    uint32_t idx = 0;
+    while (idx < instrNum) {
+        jc.instrToCode[idx] = entries[idx] = JIT_NO_ENTRY;
+        idx++;
+    }
+
+    emitPrologue(&jc);
+
+    //逐条翻译，没有模板的指令翻译为退出，使跳转到它的机器码也能交回解释器
+    uint32_t templateNum = 0;
+    uint32_t offset = 0;
+    while (offset < instrNum) {
+        jc.instrToCode[offset] = jc.code.count;
+        if (emitTemplate(&jc, offset)) {
+            entries[offset] = jc.instrToCode[offset];
+            templateNum++;
+        } else
+            emitExit(&jc, offset);
+        offset += 1 + getBytesOfOperands(fun->instrStream.datas, fun->constants.datas, (int) offset);
+    }
+
+    //守卫失败的退出代码放在末尾，同一条指令的多个守卫共用一段
+    int lastExitOffset = -1;
+    uint32_t lastExitPos = 0;
+    idx = 0;
+    while (idx < jc.exitPatches.count) {
+        if (jc.exitPatches.datas[idx + 1] != lastExitOffset) {
+            lastExitOffset = jc.exitPatches.datas[idx + 1];
+            lastExitPos = jc.code.count;
+            emitExit(&jc, lastExitOffset);
+        }
+        patchRel32(&jc, jc.exitPatches.datas[idx], lastExitPos);
+        idx += 2;
+    }
+
+    idx = 0;
+    while (idx < jc.jumpPatches.count) {
+        uint32_t target = jc.instrToCode[jc.jumpPatches.datas[idx + 1]];
+        ASSERT(target != JIT_NO_ENTRY, "jump target should be an instruction.");
+        patchRel32(&jc, jc.jumpPatches.datas[idx], target);
+        idx += 2;
+    }
+
+    JitCode *jitCode = NULL;
+    if (templateNum > 0)
+        jitCode = installCode(vm, &jc.code, entries, instrNum);
+
+    if (jitCode == NULL) {
+        DEALLOCATE_ARRAY(vm, entries, instrNum);
+        fun->jitFailed = true;
+    } else
+        fun->jitCode = jitCode;
+
+    DEALLOCATE_ARRAY(vm, jc.instrToCode, instrNum);
+    ByteBufferClear(vm, &jc.code);
+    IntBufferClear(vm, &jc.jumpPatches);
+    IntBufferClear(vm, &jc.exitPatches);
+}
+
+void freeJitCode(VM *vm, JitCode *jitCode) {
+    munmap(jitCode->code, jitCode->codeSize);
+    DEALLOCATE_ARRAY(vm, jitCode->entries, jitCode->entryNum);
+    DEALLOCATE(vm, jitCode);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef STOVE_JIT_H
+#define STOVE_JIT_H
+
+#include "vm.h"
+
+#if ENABLE_JIT
+
+#define JIT_HOT_CALLS 100 //函数被调用这么多次后编译为机器码
+#define JIT_HOT_LOOPS 1000 //函数中循环回边执行这么多次后编译为机器码
+
+#define JIT_NO_ENTRY UINT32_MAX //指令流中此处不能进入机器码
+
+//机器码入口，target是机器码中要开始执行的位置，返回值是退出机器码后解释器继续执行的ip
+typedef uint8_t *(*JitEntryFun)(ObjThread *objThread, Frame *frame, uint8_t *target);
+
+struct jitCode {
+    uint8_t *code; //可执行的机器码，开头是入口
+    uint32_t codeSize; //机器码所占的内存大小
+    //指令流偏移到机器码偏移的映射，只有可由机器码执行的指令起始处才有值，其余为JIT_NO_ENTRY
+    uint32_t *entries;
+    uint32_t entryNum; //映射表大小，等于指令流长度
+};
+
+void compileJit(VM *vm, ObjFun *fun);
+void freeJitCode(VM *vm, JitCode *jitCode);
+
+//若ip处的指令可由机器码执行就转入机器码，返回解释器接下来要执行的ip
+static inline uint8_t *runJitCode(ObjFun *fun, ObjThread *objThread, Frame *frame, uint8_t *ip) {
+    JitCode *jitCode = fun->jitCode;
+    uint32_t entry = jitCode->entries[ip - fun->instrStream.datas];
+    if (entry == JIT_NO_ENTRY)
+        return ip;
+    return ((JitEntryFun) jitCode->code)(objThread, frame, jitCode->code + entry);
+}
+
+#endif
+
+#endif //STOVE_JIT_H
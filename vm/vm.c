@@ -6,8 +6,11 @@
 #include <stdlib.h>
 #include "core.h"
 #include "../compiler/compiler.h"
+#include "../compiler/cache.h"
+#include "jit.h"
 #include <time.h>
 #include <string.h>
+#include <math.h>
 
 #ifdef DEBUG
 #include "../compiler/debug.h"
@@ -19,8 +22,27 @@ void initVM(VM *vm) {
     vm->allObjects = NULL;
     vm->curParser = NULL;
     StringBufferInit(&vm->allMethodNames);
-    vm->allModules = newObjMap(vm);
-    vm->curParser = NULL;
+
+    //创建allModules时就可能触发gc，gc会清空方法查找缓存，故先分配
+    vm->methodEpoch = 0;
+    vm->isMethodRebound = false;
+    vm->isHeapExhausted = false;
+    vm->instructionBudget = UINT64_MAX;
+    vm->suspendedBudget = 0;
+    vm->methodCache = (MethodCacheEntry *) calloc(METHOD_CACHE_SIZE, sizeof(MethodCacheEntry));
+    if (vm->methodCache == NULL)
+        MEM_ERROR("allocate method cache failed.");
+    vm->bundle = NULL;
+#if PROFILE_PAIRS
+    vm->pairCounts = (uint64_t *) calloc(OPCODE_NUM * OPCODE_NUM, sizeof(uint64_t));
+    if (vm->pairCounts == NULL)
+        MEM_ERROR("allocate opcode pair counts failed.");
+    vm->dispatchNum = 0;
+    vm->instrNum = 0;
+    vm->lastOpCode = OPCODE_NUM;
+#endif
+
+    vm->curThread = NULL;
     vm->config.heapGrowthFactor = 1.5;
 
     //最小堆大小为1MB
@@ -29,6 +51,20 @@ void initVM(VM *vm) {
     vm->config.initialHeapSize = 1024 * 1024 * 10;
 
     vm->config.nextGC = vm->config.initialHeapSize;
+
+    //默认使用栈式指令
+    vm->config.useRegisterTier = false;
+
+    //默认不限制指令数和堆大小
+    vm->config.instructionQuota = 0;
+    vm->config.maxHeapSize = 0;
+    vm->config.useBytecodeCache = false;
+
+#if ENABLE_JIT
+    //编译时开启了JIT则默认使用
+    vm->config.useJit = true;
+#endif
+
     vm->grays.count = 0;
     vm->grays.capacity = 32;
 
@@ -37,6 +73,9 @@ void initVM(VM *vm) {
 
     vm->tmpRootNum = 0;
 
+    //gc用到的配置和灰色数组都已初始化，此后才能分配对象
+    vm->allModules = newObjMap(vm);
+
     time_t build_time = time(NULL);
     char *time = ctime(&build_time);
     int len = strlen(time);
@@ -53,6 +92,76 @@ VM *newVM(void) {
     return vm;
 }
 
+#if PROFILE_PAIRS
+//操作码的名字，下标即操作码
+static const char *opCodeNames[] = {
+    #define OPCODE_SLOTS(opcode, effect) #opcode,
+    #include "opcode.inc"
+    #undef OPCODE_SLOTS
+};
+
+//输出时只列出次数最多的指令对
+#define PROFILE_TOP_PAIRS 30
+
+//统计即将执行的指令，opCodePtr指向其操作码，esp是执行前的栈顶
+//超级指令按融合前的两条指令计，比较并跳转的操作数不都是数字时回退到方法调用，之后还会单独分派JUMP_IF_FALSE，故只计比较指令
+static void profileOpCode(VM *vm, ObjFun *fun, uint8_t *opCodePtr, Value *esp) {
+    OpCode opCode = (OpCode) *opCodePtr;
+    OpCode first = getFusedFirstOpCode(opCode);
+    vm->dispatchNum++;
+    if (vm->lastOpCode != OPCODE_NUM)
+        vm->pairCounts[vm->lastOpCode * OPCODE_NUM + first]++;
+    vm->instrNum++;
+    vm->lastOpCode = first;
+
+    if (first == opCode)
+        return;
+    if (opCode >= OPCODE_LT_JUMP_IF_FALSE && opCode <= OPCODE_NEQ_JUMP_IF_FALSE &&
+        (!VALUE_IS_NUM(esp[-2]) || !VALUE_IS_NUM(esp[-1])))
+        return;
+
+    //超级指令的长度只计前一条指令，其后就是被融合的后一条指令
+    uint32_t ip = opCodePtr - fun->instrStream.datas;
+    OpCode second = (OpCode) opCodePtr[1 + getBytesOfOperands(fun->instrStream.datas, fun->constants.datas, ip)];
+    vm->pairCounts[first * OPCODE_NUM + second]++;
+    vm->instrNum++;
+    vm->lastOpCode = second;
+}
+
+//按次数从多到少排列指令对的下标
+static uint64_t *sortedPairCounts;
+
+static int comparePairs(const void *a, const void *b) {
+    uint64_t countA = sortedPairCounts[*(const uint32_t *) a];
+    uint64_t countB = sortedPairCounts[*(const uint32_t *) b];
+    return countA < countB ? 1 : (countA > countB ? -1 : 0);
+}
+
+//输出分派次数、融合减少的分派比例和最常见的指令对，可融合的指令对标以*
+void dumpPairProfile(VM *vm) {
+    uint32_t pairs[OPCODE_NUM * OPCODE_NUM];
+    uint64_t pairTotal = 0;
+    for (uint32_t idx = 0; idx < OPCODE_NUM * OPCODE_NUM; idx++) {
+        pairs[idx] = idx;
+        pairTotal += vm->pairCounts[idx];
+    }
+    sortedPairCounts = vm->pairCounts;
+    qsort(pairs, OPCODE_NUM * OPCODE_NUM, sizeof(uint32_t), comparePairs);
+
+    fprintf(stderr, "dispatches: %llu, instructions before fusion: %llu, saved: %.1f%%\n",
+            (unsigned long long) vm->dispatchNum, (unsigned long long) vm->instrNum,
+            vm->instrNum == 0 ? 0.0 : 100.0 * (vm->instrNum - vm->dispatchNum) / vm->instrNum);
+    for (uint32_t idx = 0; idx < PROFILE_TOP_PAIRS && vm->pairCounts[pairs[idx]] > 0; idx++) {
+        OpCode first = (OpCode) (pairs[idx] / OPCODE_NUM);
+        OpCode second = (OpCode) (pairs[idx] % OPCODE_NUM);
+        fprintf(stderr, "%12llu %5.1f%% %c %s %s\n", (unsigned long long) vm->pairCounts[pairs[idx]],
+                100.0 * vm->pairCounts[pairs[idx]] / pairTotal,
+                getSuperInstruction(first, second) != OPCODE_END ? '*' : ' ',
+                opCodeNames[first], opCodeNames[second]);
+    }
+}
+#endif
+
 //释放虚拟机
 void freeVM(VM *vm) {
     ASSERT(vm->allMethodNames.count > 0, "VM have already been freed.");
@@ -61,13 +170,20 @@ void freeVM(VM *vm) {
     ObjHeader *objHeader = vm->allObjects;
     while (objHeader != NULL) {
         //释放之前先备份下一个节点地址
-        ObjHeader *next = objHeader->next;
+        ObjHeader *next = OBJ_NEXT(objHeader);
         freeObject(vm, objHeader);
         objHeader = next;
     }
 
     vm->grays.grayObjects = DEALLOCATE(vm, vm->grays.grayObjects);
+    free(vm->methodCache);
+    //包中的指令流随所属函数一同释放后才能解除映射
+    if (vm->bundle != NULL)
+        closeBundle(vm, vm->bundle);
     StringBufferClear(vm, &vm->allMethodNames);
+#if PROFILE_PAIRS
+    free(vm->pairCounts);
+#endif
     DEALLOCATE(vm, vm);
 }
 
@@ -84,6 +200,32 @@ void popTmpRoot(VM *vm) {
     vm->tmpRootNum--;
 }
 
+//出错时最多输出的调用栈帧数
+#define MAX_TRACE_FRAMES 16
+
+//运行时出错时输出线程的调用栈，从最内层的帧开始，每帧一行：所在模块和源码行号
+//调用前各帧的ip须已写回frame
+static void printStackTrace(ObjThread *objThread) {
+    int idx = (int) objThread->usedFrameNum - 1;
+    int lastIdx = idx >= MAX_TRACE_FRAMES ? idx - MAX_TRACE_FRAMES + 1 : 0;
+    while (idx >= lastIdx) {
+        Frame *frame = &objThread->frames[idx];
+        ObjFun *fun = frame->closure->fun;
+        //ip指向下一条要执行的指令，退1字节落在正在执行的指令之内
+        uint32_t ip = (uint32_t) (frame->ip - fun->instrStream.datas);
+        uint32_t lineNo = getLineNo(&fun->lineTable, ip > 0 ? ip - 1 : 0);
+        const char *moduleName = fun->module->name == NULL ? "core" : fun->module->name->value.start;
+#if DEBUG
+        fprintf(stderr, "  at %s:%u in %s\n", moduleName, lineNo, fun->debug->funName);
+#else
+        fprintf(stderr, "  at %s:%u\n", moduleName, lineNo);
+#endif
+        idx--;
+    }
+    if (lastIdx > 0)
+        fprintf(stderr, "  ... %d more frames\n", lastIdx);
+}
+
 //确保stack有效
 void ensureStack(VM *vm, ObjThread *objThread, uint32_t neededSlots) {
     if (objThread->stackCapacity >= neededSlots)
@@ -96,6 +238,21 @@ void ensureStack(VM *vm, ObjThread *objThread, uint32_t neededSlots) {
     Value *oldStackBottom = objThread->stack;
 
     uint32_t slotSize = sizeof(Value);
+#if RESERVED_STACK
+    if (newStackCapacity > RESERVED_STACK_THRESHOLD) {
+        //栈已在预留的地址空间中时不会走到这里，此时是预留的也用尽了
+        if (neededSlots > RESERVED_STACK_SLOTS) {
+            printStackTrace(objThread);
+            RUN_ERROR("stack overflow, a thread can use at most %d slots.", RESERVED_STACK_SLOTS);
+        }
+
+        //搬到预留的地址空间，之后不会再移动
+        objThread->stack = (Value *) reserveStackMemory(RESERVED_STACK_SLOTS * slotSize);
+        memcpy(objThread->stack, oldStackBottom, (objThread->esp - oldStackBottom) * slotSize);
+        DEALLOCATE_ARRAY(vm, oldStackBottom, objThread->stackCapacity);
+        newStackCapacity = RESERVED_STACK_SLOTS;
+    } else
+#endif
     objThread->stack = (Value *) memManager(vm, objThread->stack, objThread->stackCapacity * slotSize,
                                             newStackCapacity * slotSize);
     objThread->stackCapacity = newStackCapacity;
@@ -127,6 +284,21 @@ static void createFrame(VM *vm, ObjThread *objThread, ObjClosure *objClosure, in
     if (objThread->usedFrameNum + 1 > objThread->frameCapacity) {
         uint32_t newCapacity = objThread->frameCapacity * 2;
         uint32_t frameSize = sizeof(Frame);
+#if RESERVED_STACK
+        if (newCapacity > RESERVED_FRAME_THRESHOLD) {
+            if (objThread->frameCapacity == RESERVED_FRAME_NUM) {
+                printStackTrace(objThread);
+                RUN_ERROR("stack overflow, a thread can use at most %d frames.", RESERVED_FRAME_NUM);
+            }
+
+            //搬到预留的地址空间，之后不会再移动，也不会因扩容而触发gc
+            Frame *frames = (Frame *) reserveStackMemory(RESERVED_FRAME_NUM * frameSize);
+            memcpy(frames, objThread->frames, objThread->usedFrameNum * frameSize);
+            DEALLOCATE_ARRAY(vm, objThread->frames, objThread->frameCapacity);
+            objThread->frames = frames;
+            newCapacity = RESERVED_FRAME_NUM;
+        } else
+#endif
         objThread->frames = (Frame *) memManager(vm, objThread->frames, frameSize * objThread->frameCapacity,
                                                  frameSize * newCapacity);
         objThread->frameCapacity = newCapacity;
@@ -155,6 +327,23 @@ static void closedUpvalue(ObjThread *objThread, Value *lastSlot) {
     objThread->openUpvalues = upvalue;
 }
 
+//中止线程：关闭其upvalue并丢弃所有frame，使之不能再被切换执行，栈上的对象在下次gc时即可回收
+void abortThread(ObjThread *objThread) {
+    closedUpvalue(objThread, objThread->stack);
+    objThread->usedFrameNum = 0;
+    objThread->esp = objThread->stack;
+    objThread->caller = NULL;
+}
+
+//尾调用时主调函数随后就原样返回被调函数的结果，主调frame已无用
+//先关闭其upvalue，再把receiver和参数移到其栈底并释放该frame，随后创建的被调frame会占用它的位置
+static void popFrameForTailCall(ObjThread *objThread, Value *stackStart, int argNum) {
+    closedUpvalue(objThread, stackStart);
+    memmove(stackStart, objThread->esp - argNum, sizeof(Value) * argNum);
+    objThread->esp = stackStart + argNum;
+    objThread->usedFrameNum--;
+}
+
 //创建线程已打开的upvalue链表，并将localVarPtr所属的upvalue以降序插入到该链表
 static ObjUpvalue *createOpenUpvalue(VM *vm, ObjThread *objThread, Value *localVarPtr) {
     //如果openUpvalue链表为空就创建
@@ -287,17 +476,26 @@ static void patchOperand(Class *class, ObjFun *fun) {
 
 //绑定方法和修正操作数
 static void bindMethodAndPatch(VM *vm, OpCode opCode, uint32_t methodIndex, Class *class, Value methodValue) {
-    if (class->objHeader.class == NULL)
-        class->objHeader.class = class;
+    if (OBJ_CLASS(class) == NULL)
+        OBJ_SET_CLASS(class, class);
 
     //如果是静态方法，就将类指向meta类（使接收者为meta类）
     if (opCode == OPCODE_STATIC_METHOD)
-        class = class->objHeader.class;
+        class = OBJ_CLASS(class);
+
+    //修正super要用到基类，没有基类的只有Object，脚本不会给它定义方法
+    if (class->superClass == NULL)
+        RUN_ERROR("class \"%s\" has no superClass to bind methods.", class->name->value.start);
 
     Method method;
     method.methodType = MT_SCRIPT;
     method.obj = VALUE_TO_OBJCLOSURE(methodValue);
 
+    //校验器按函数的参数个数推演栈底，调用时则按签名传参，二者须一致
+    String *name = &vm->allMethodNames.datas[methodIndex];
+    if (method.obj->fun->argNum != getSignatureArgNum(name->str, name->length))
+        RUN_ERROR("method \"%s\" can't take %u arguments.", name->str, (uint32_t) method.obj->fun->argNum);
+
     //修正操作数
     patchOperand(class, method.obj->fun);
 
@@ -305,6 +503,156 @@ static void bindMethodAndPatch(VM *vm, OpCode opCode, uint32_t methodIndex, Clas
     bindMethod(vm, class, methodIndex, method);
 }
 
+//迭代器是否是可用作索引的非负整数
+static inline bool isIndexIterator(Value iterator) {
+    if (!VALUE_IS_NUM(iterator))
+        return false;
+    double iter = VALUE_TO_NUM(iterator);
+    return iter >= 0 && iter <= UINT32_MAX && iter == (uint32_t) iter;
+}
+
+//for循环中对内建序列做sequence.iterate(iterator)，与各类的iterate(_)原生方法结果一致
+//sequence不是列表、range、map或字符串，或迭代器不合法时返回false，由调用方回退到方法调用并由原生方法报错
+static bool iterateNative(Value sequence, Value iterator, Value *result) {
+    if (!VALUE_IS_OBJ(sequence))
+        return false;
+
+    ObjHeader *objHeader = VALUE_TO_OBJ(sequence);
+    switch (objHeader->objType) {
+        case OT_LIST: {
+            ObjList *objList = (ObjList *) objHeader;
+            if (VALUE_IS_NULL(iterator)) {
+                *result = objList->elements.count == 0 ? VT_TO_VALUE(VT_FALSE) : NUM_TO_VALUE(0);
+                return true;
+            }
+            if (!isIndexIterator(iterator))
+                return false;
+            double iter = VALUE_TO_NUM(iterator) + 1;
+            *result = iter >= objList->elements.count ? VT_TO_VALUE(VT_FALSE) : NUM_TO_VALUE(iter);
+            return true;
+        }
+
+        case OT_RANGE: {
+            ObjRange *objRange = (ObjRange *) objHeader;
+            if (VALUE_IS_NULL(iterator)) {
+                *result = NUM_TO_VALUE(objRange->from);
+                return true;
+            }
+            if (!VALUE_IS_NUM(iterator))
+                return false;
+            double iter = VALUE_TO_NUM(iterator);
+            if (objRange->from < objRange->to)
+                iter++;
+            else
+                iter--;
+            bool isEnd = objRange->from < objRange->to ? iter > objRange->to : iter < objRange->to;
+            *result = isEnd ? VT_TO_VALUE(VT_FALSE) : NUM_TO_VALUE(iter);
+            return true;
+        }
+
+        case OT_MAP: {
+            //迭代器是entry的索引，跳过未使用的槽位
+            ObjMap *objMap = (ObjMap *) objHeader;
+            *result = VT_TO_VALUE(VT_FALSE);
+            if (objMap->count == 0)
+                return true;
+            uint32_t index = 0;
+            if (!VALUE_IS_NULL(iterator)) {
+                if (!isIndexIterator(iterator))
+                    return false;
+                index = (uint32_t) VALUE_TO_NUM(iterator);
+                if (index >= objMap->capacity)
+                    return true;
+                index++;
+            }
+            while (index < objMap->capacity) {
+                if (!VALUE_IS_UNDEFINED(objMap->entries[index].key)) {
+                    *result = NUM_TO_VALUE(index);
+                    break;
+                }
+                index++;
+            }
+            return true;
+        }
+
+        case OT_STRING: {
+            //迭代器是utf-8字符首字节的索引
+            ObjString *objString = (ObjString *) objHeader;
+            if (VALUE_IS_NULL(iterator)) {
+                *result = objString->value.length == 0 ? VT_TO_VALUE(VT_FALSE) : NUM_TO_VALUE(0);
+                return true;
+            }
+            if (!isIndexIterator(iterator))
+                return false;
+            uint32_t index = (uint32_t) VALUE_TO_NUM(iterator);
+            do {
+                index++;
+                if (index >= objString->value.length) {
+                    *result = VT_TO_VALUE(VT_FALSE);
+                    return true;
+                }
+            } while ((objString->value.start[index] & 0xc0) == 0x80);
+            *result = NUM_TO_VALUE(index);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+//for循环中对内建序列做sequence.iteratorValue(iterator)，不能直接取值时返回false
+//字符串的迭代值是新创建的字符串，调用前须把esp写回线程
+static bool iteratorValueNative(VM *vm, Value sequence, Value iterator, Value *result) {
+    if (!VALUE_IS_OBJ(sequence) || !VALUE_IS_NUM(iterator))
+        return false;
+
+    ObjHeader *objHeader = VALUE_TO_OBJ(sequence);
+    switch (objHeader->objType) {
+        case OT_LIST: {
+            ObjList *objList = (ObjList *) objHeader;
+            if (!isIndexIterator(iterator) || VALUE_TO_NUM(iterator) >= objList->elements.count)
+                return false;
+            *result = objList->elements.datas[(uint32_t) VALUE_TO_NUM(iterator)];
+            return true;
+        }
+
+        case OT_RANGE: {
+            //range的迭代器就是值本身，越界时由原生方法返回false
+            ObjRange *objRange = (ObjRange *) objHeader;
+            double value = VALUE_TO_NUM(iterator);
+            int min = objRange->from < objRange->to ? objRange->from : objRange->to;
+            int max = objRange->from < objRange->to ? objRange->to : objRange->from;
+            if (value < min || value > max)
+                return false;
+            *result = iterator;
+            return true;
+        }
+
+        case OT_MAP: {
+            ObjMap *objMap = (ObjMap *) objHeader;
+            if (!isIndexIterator(iterator) || VALUE_TO_NUM(iterator) >= objMap->capacity)
+                return false;
+            Entry *entry = &objMap->entries[(uint32_t) VALUE_TO_NUM(iterator)];
+            if (VALUE_IS_UNDEFINED(entry->key))
+                return false;
+            *result = entry->key;
+            return true;
+        }
+
+        case OT_STRING: {
+            ObjString *objString = (ObjString *) objHeader;
+            if (!isIndexIterator(iterator) || VALUE_TO_NUM(iterator) >= objString->value.length)
+                return false;
+            *result = stringCodePointAt(vm, objString, (uint32_t) VALUE_TO_NUM(iterator));
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
 //执行指令
 VMResult executeInstruction(VM *vm, register ObjThread *curThread) {
     vm->curThread = curThread;
@@ -314,13 +662,33 @@ VMResult executeInstruction(VM *vm, register ObjThread *curThread) {
     register ObjFun *fun;
     OpCode opCode;
 
+    //方法调用指令共用，快速化后的调用指令在守卫通过后也经由这些变量进入CALLx的调用代码
+    int argNum, index;
+    Value *args;
+    Class *class;
+    Method *method;
+    InlineCache *inlineCache;
+
+#if USE_STACK_CACHING
+    //栈顶指针缓存在寄存器中，压栈弹栈不必每次读写curThread->esp
+    //调用函数前要把它写回线程（gc按curThread->esp标记栈，原生方法和切换线程也会读写它），之后重新读取
+    register Value *esp;
+#define ESP esp
+#define SPILL_ESP() (curThread->esp = esp)
+#define RELOAD_ESP() (esp = curThread->esp)
+#else
+#define ESP (curThread->esp)
+#define SPILL_ESP() ((void) 0)
+#define RELOAD_ESP() ((void) 0)
+#endif
+
     //定义操作运行时栈的宏
     //esp是栈中下一个可写入数据的slot
-#define PUSH(value) (*curThread->esp++ = value) //压栈
-#define POP() (*(--curThread->esp)) //弹栈
-#define DROP() (curThread->esp--) //丢掉栈顶元素
-#define PEEK() (*(curThread->esp - 1)) //获得栈顶数据
-#define PEEK2() (*(curThread->esp - 2)) //获得次栈顶数据
+#define PUSH(value) (*ESP++ = value) //压栈
+#define POP() (*(--ESP)) //弹栈
+#define DROP() (ESP--) //丢掉栈顶元素
+#define PEEK() (*(ESP - 1)) //获得栈顶数据
+#define PEEK2() (*(ESP - 2)) //获得次栈顶数据
 
 //下面是读取指令流：objFun.instrStream.datas
 #define READ_BYTE() (*ip++) //从指令流中读取1字节
@@ -328,26 +696,107 @@ VMResult executeInstruction(VM *vm, register ObjThread *curThread) {
 #define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
 
 //当前指令单元执行的进度就是在指令流中的指针，即ip，将其保存起来
-#define STORE_CUR_FRAME() curFrame->ip = ip //备份ip以能回到当前
+#define STORE_CUR_FRAME() (curFrame->ip = ip, SPILL_ESP()) //备份ip和esp以能回到当前
+
+//执行指令时出错，写回ip后先输出调用栈再报告错误
+#define RUN_ERROR_TRACE(...) \
+    do { \
+        STORE_CUR_FRAME(); \
+        printStackTrace(curThread); \
+        RUN_ERROR(__VA_ARGS__); \
+    } while (0)
+
+//字段的接收者和索引取决于运行时的值，校验器无法证明，指令流又可能来自缓存或模块包，故每次都要检查
+#define CHECK_FIELD(receiver, fieldIdx) \
+    do { \
+        if (!VALUE_IS_OBJINSTANCE(receiver) || \
+            (fieldIdx) >= OBJ_CLASS(VALUE_TO_OBJINSTANCE(receiver))->fieldNum) \
+            RUN_ERROR_TRACE("field %u is not accessible on the receiver.", (uint32_t) (fieldIdx)); \
+    } while (0)
 //加载最新的frame
 #define LOAD_CUR_FRAME() \
     /* frames是数组，索引从0起，故usedFrameNum-1 */ \
     curFrame = &curThread->frames[curThread->usedFrameNum - 1]; \
     stackStart = curFrame->stackStart;    \
     ip = curFrame->ip;   \
-    fun = curFrame->closure->fun;
+    fun = curFrame->closure->fun; \
+    RELOAD_ESP();
+
+#if ENABLE_JIT
+    //机器码中的回边不检查配额，故设置了指令配额或堆上限时不编译
+#define JIT_ALLOWED() (vm->config.useJit && vm->config.instructionQuota == 0 && vm->config.maxHeapSize == 0)
+
+    //进入函数时累计调用次数，达到阈值后编译为机器码
+#define COUNT_CALL() \
+    if (++fun->callCount == JIT_HOT_CALLS && JIT_ALLOWED()) \
+        compileJit(vm, fun);
+
+    //循环回边累计次数，达到阈值后编译为机器码
+#define COUNT_LOOP() \
+    if (++fun->loopCount == JIT_HOT_LOOPS && JIT_ALLOWED()) { \
+        SPILL_ESP(); \
+        compileJit(vm, fun); \
+    }
+
+    //当前函数有机器码时从ip处转入机器码执行，机器码退出后ip是解释器接下来要执行的指令
+#define ENTER_JIT() \
+    if (fun->jitCode != NULL) { \
+        SPILL_ESP(); \
+        ip = runJitCode(fun, curThread, curFrame, ip); \
+        RELOAD_ESP(); \
+    }
+#else
+#define COUNT_CALL()
+#define COUNT_LOOP()
+#define ENTER_JIT()
+#endif
+
+    //在回边和进入函数处扣减指令配额，配额由本次执行的所有线程共用，用完时中止执行
+    //gc后堆仍超过上限时，gc把配额置为1，使下一次扣减就中止当前线程
+#define CHECK_QUOTA() \
+    if (--vm->instructionBudget == 0) \
+        goto quotaExceeded;
+
+#if PROFILE_PAIRS
+#define PROFILE_OPCODE() profileOpCode(vm, fun, ip, ESP)
+#else
+#define PROFILE_OPCODE()
+#endif
 
+#if USE_COMPUTED_GOTO
+    //由opcode.inc生成的跳转表，下标即操作码，每个表项是对应处理代码的标签地址
+    static void *opCodeLabels[] = {
+        #define OPCODE_SLOTS(opcode, effect) &&opcode_##opcode,
+        #include "opcode.inc"
+        #undef OPCODE_SLOTS
+    };
+
+    //每条指令执行完后直接跳到下一条指令的处理代码，不再经过统一的switch分派
+#define DECODE LOOP();
+
+#define CASE(shortOpCode) opcode_##shortOpCode
+#define LOOP() \
+    do {       \
+        PROFILE_OPCODE(); \
+        opCode = READ_BYTE(); \
+        goto *opCodeLabels[opCode]; \
+    } while (0)
+#else
 #define DECODE loopStart: \
+    PROFILE_OPCODE(); \
     opCode = READ_BYTE();     \
     switch(opCode)
 
 #define CASE(shortOpCode) case OPCODE_##shortOpCode
 #define LOOP() goto loopStart
+#endif
 
     LOAD_CUR_FRAME()
 
 DECODE {
         //若OPCODE依赖于指令环境（栈和指令流），会在各OPCODE下说明
+        //指令流在编译时已经过verifyFun校验，跳转偏移量、各类索引和栈深度在此不再检查
+        //字段的接收者和索引、类名、待绑定的类和方法、super的基类取决于运行时的值，仍在各指令中检查
 
         CASE(LOAD_LOCAL_VAR):
             //指令流：1字节的局部变量索引
@@ -359,10 +808,8 @@ DECODE {
             uint8_t fieldIdx = READ_BYTE();
 
             //stackStart[0]是实例对象self
-            ASSERT(VALUE_IS_OBJINSTANCE(stackStart[0]), "method receiver should be objInstance.");
+            CHECK_FIELD(stackStart[0], fieldIdx);
             ObjInstance *objInstance = VALUE_TO_OBJINSTANCE(stackStart[0]);
-
-            ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field.");
             PUSH(objInstance->fields[fieldIdx]);
             LOOP();
         }
@@ -371,6 +818,156 @@ DECODE {
             DROP();
             LOOP();
 
+            //数字运算指令
+            //指令流1：2字节的运算符方法名索引
+            //指令流2：2字节的内联缓存索引
+            //栈顶的操作数都是数字时直接计算，否则回退到运算符方法调用，因此重载了运算符的类不受影响
+#define BINARY_OP(type, operator) { \
+            Value left = PEEK2(); \
+            Value right = PEEK(); \
+            if (!VALUE_IS_NUM(left) || !VALUE_IS_NUM(right)) { \
+                opCode = OPCODE_CALL1; \
+                goto callMethod; \
+            } \
+            ip += 4; /* 跳过方法名索引和内联缓存索引 */ \
+            DROP(); \
+            PEEK() = type##_TO_VALUE(VALUE_TO_NUM(left) operator VALUE_TO_NUM(right)); \
+            LOOP(); \
+        }
+
+//位运算与primNumBitXXX一致，先转换为32位无符号整数
+#define BIT_OP(operator) { \
+            Value left = PEEK2(); \
+            Value right = PEEK(); \
+            if (!VALUE_IS_NUM(left) || !VALUE_IS_NUM(right)) { \
+                opCode = OPCODE_CALL1; \
+                goto callMethod; \
+            } \
+            ip += 4; \
+            DROP(); \
+            PEEK() = NUM_TO_VALUE((uint32_t) VALUE_TO_NUM(left) operator (uint32_t) VALUE_TO_NUM(right)); \
+            LOOP(); \
+        }
+
+        CASE(ADD):
+        BINARY_OP(NUM, +)
+
+        CASE(SUB):
+        BINARY_OP(NUM, -)
+
+        CASE(MUL):
+        BINARY_OP(NUM, *)
+
+        CASE(DIV):
+        BINARY_OP(NUM, /)
+
+        CASE(LT):
+        BINARY_OP(BOOL, <)
+
+        CASE(LE):
+        BINARY_OP(BOOL, <=)
+
+        CASE(GT):
+        BINARY_OP(BOOL, >)
+
+        CASE(GE):
+        BINARY_OP(BOOL, >=)
+
+        CASE(EQ):
+        BINARY_OP(BOOL, ==)
+
+        CASE(NEQ):
+        BINARY_OP(BOOL, !=)
+
+        CASE(BIT_AND):
+        BIT_OP(&)
+
+        CASE(BIT_OR):
+        BIT_OP(|)
+
+        CASE(BIT_SHIFT_LEFT):
+        BIT_OP(<<)
+
+        CASE(BIT_SHIFT_RIGHT):
+        BIT_OP(>>)
+
+#undef BINARY_OP
+#undef BIT_OP
+
+        CASE(MOD): {
+            //与primNumMod一致，用fmod实现浮点取模
+            Value left = PEEK2();
+            Value right = PEEK();
+            if (!VALUE_IS_NUM(left) || !VALUE_IS_NUM(right)) {
+                opCode = OPCODE_CALL1;
+                goto callMethod;
+            }
+            ip += 4;
+            DROP();
+            PEEK() = NUM_TO_VALUE(fmod(VALUE_TO_NUM(left), VALUE_TO_NUM(right)));
+            LOOP();
+        }
+
+        CASE(NEG):
+            if (!VALUE_IS_NUM(PEEK())) {
+                opCode = OPCODE_CALL0;
+                goto callMethod;
+            }
+            ip += 4;
+            PEEK() = NUM_TO_VALUE(-VALUE_TO_NUM(PEEK()));
+            LOOP();
+
+        CASE(BIT_NOT):
+            if (!VALUE_IS_NUM(PEEK())) {
+                opCode = OPCODE_CALL0;
+                goto callMethod;
+            }
+            ip += 4;
+            PEEK() = NUM_TO_VALUE(~(uint32_t) VALUE_TO_NUM(PEEK()));
+            LOOP();
+
+            //for循环的迭代指令
+            //栈顶：迭代器 次栈顶：序列
+            //指令流同CALL1：2字节的iterate(_)或iteratorValue(_)方法名索引，2字节的内联缓存索引
+            //内建的列表、range、map和字符串直接迭代，其余序列回退到方法调用
+        CASE(ITERATE): {
+            Value result;
+            if (!iterateNative(PEEK2(), PEEK(), &result)) {
+                opCode = OPCODE_CALL1;
+                goto callMethod;
+            }
+            ip += 4;
+            DROP();
+            PEEK() = result;
+            LOOP();
+        }
+
+        CASE(ITERATOR_VALUE): {
+            Value result;
+            //迭代字符串时会创建字符串
+            SPILL_ESP();
+            if (!iteratorValueNative(vm, PEEK2(), PEEK(), &result)) {
+                opCode = OPCODE_CALL1;
+                goto callMethod;
+            }
+            ip += 4;
+            DROP();
+            PEEK() = result;
+            LOOP();
+        }
+
+        CASE(IS):
+            //指令流同CALL1，右操作数不是类或有类重新定义了is(_)时回退到方法调用
+            if (!VALUE_IS_CLASS(PEEK()) || vm->isMethodRebound) {
+                opCode = OPCODE_CALL1;
+                goto callMethod;
+            }
+            ip += 4;
+            class = getClassOfObj(vm, PEEK2());
+            DROP();
+            PEEK() = BOOL_TO_VALUE(isSubClass(class, VALUE_TO_CLASS(ESP[0])));
+            LOOP();
+
         CASE(PUSH_NULL):
             PUSH(VT_TO_VALUE(VT_NULL));
             LOOP();
@@ -415,21 +1012,69 @@ DECODE {
         CASE(CALL14):
         CASE(CALL15):
         CASE(CALL16): {
-            int argNum, index;
-            Value *args;
-            Class *class;
-            Method *method;
-
+            //数字运算指令的操作数不是数字时，以对应的CALLx从这里进入
+            callMethod:
             //指令流1：2字节的method索引
             //因为还有个隐式的receiver（就是下面的args[0]，所以参数个数+1）
             argNum = opCode - OPCODE_CALL0 + 1;
             //读取两字节的数据（CALL指令的操作数），index是方法名的索引
             index = READ_SHORT();
             //为参数指针数组args赋值
-            args = curThread->esp - argNum;
+            args = ESP - argNum;
             //获得方法所在的类
             class = getClassOfObj(vm, args[0]);
-            goto invokeMethod;
+
+            //指令流2：2字节的内联缓存索引
+            inlineCache = &fun->inlineCaches[READ_SHORT()];
+            if (inlineCache->epoch == vm->methodEpoch) {
+                //命中时方法在缓存建立时已检查过，直接调用
+                InlineCacheEntry *entry = inlineCache->entries;
+                InlineCacheEntry *entryEnd = entry + inlineCache->entryNum;
+                while (entry < entryEnd) {
+                    if (entry->class == class) {
+                        method = &entry->method;
+                        goto invokeFoundMethod;
+                    }
+                    entry++;
+                }
+            } else {
+                //有方法被重新绑定过，丢弃旧缓存
+                inlineCache->epoch = vm->methodEpoch;
+                inlineCache->entryNum = 0;
+                inlineCache->isMegamorphic = false;
+            }
+
+            if ((method = findMethod(vm, class, index)) == NULL)
+                RUN_ERROR_TRACE("method \"%s\" not found.", vm->allMethodNames.datas[index].str);
+
+            //未命中时将receiver类和方法记入缓存，超过INLINE_CACHE_SIZE个类的调用点不再缓存
+            if (!inlineCache->isMegamorphic) {
+                if (inlineCache->entryNum < INLINE_CACHE_SIZE) {
+                    InlineCacheEntry *entry = &inlineCache->entries[inlineCache->entryNum++];
+                    entry->class = class;
+                    entry->method = *method;
+
+                    //调用点第一次建立缓存时把指令快速化，按receiver是数字还是对象改写为CALL_NUM或CALL_OBJ
+                    //ip - 5是本指令的操作码，记下原指令以便守卫失败时还原
+                    //运算和比较指令只在操作数不全是数字时才回退到这里，快速化会使其永远失去数字快速路径，故只快速化CALLx
+                    if (inlineCache->entryNum == 1 && (VALUE_IS_NUM(args[0]) || VALUE_IS_OBJ(args[0])) &&
+                        ((ip[-5] >= OPCODE_CALL0 && ip[-5] <= OPCODE_CALL16) ||
+                         (ip[-5] >= OPCODE_CALL_CLOSURE0 && ip[-5] <= OPCODE_CALL_CLOSURE16))) {
+                        inlineCache->argNum = argNum;
+                        inlineCache->genericOpCode = ip[-5];
+                        ip[-5] = VALUE_IS_NUM(args[0]) ? OPCODE_CALL_NUM : OPCODE_CALL_OBJ;
+                    }
+                } else
+                    inlineCache->isMegamorphic = true;
+            }
+            goto invokeFoundMethod;
+
+            //寄存器运算指令的操作数不是数字时从这里进入，操作数已放在栈顶，不使用内联缓存
+            regCallMethod:
+            index = READ_SHORT();
+            args = ESP - argNum;
+            class = getClassOfObj(vm, args[0]);
+            goto lookupMethod;
 
             CASE(SUPER0):
             CASE(SUPER1):
@@ -454,22 +1099,33 @@ DECODE {
                 //因为还有个隐式的receiver（就是下面的args[0]），所以参数个数+1
                 argNum = opCode - OPCODE_SUPER0 + 1;
             index = READ_SHORT();
-            args = curThread->esp - argNum;
-
-            //在函数bindMethodAndPatch中实现的基类的绑定
-            class = VALUE_TO_CLASS(fun->constants.datas[READ_SHORT()]);
-
-            invokeMethod:
-            if ((uint32_t) index > class->methods.count ||
-                (method = &class->methods.datas[index])->methodType == MT_NONE)
-                RUN_ERROR("method \"%s\" not found.", vm->allMethodNames.datas[index].str);
-
+            args = ESP - argNum;
+
+            //在函数bindMethodAndPatch中实现的基类的绑定，未经绑定的函数中该常量仍是占位的null
+            Value superClass = fun->constants.datas[READ_SHORT()];
+            if (!VALUE_IS_CLASS(superClass))
+                RUN_ERROR_TRACE("super is only available in a method.");
+            class = VALUE_TO_CLASS(superClass);
+            //基类的原生方法按基类的布局读取接收者，接收者须是基类或其子类的对象
+            if (!isSubClass(getClassOfObj(vm, args[0]), class))
+                RUN_ERROR_TRACE("receiver of super is not an instance of \"%s\".", class->name->value.start);
+
+            lookupMethod:
+            if ((method = findMethod(vm, class, index)) == NULL)
+                RUN_ERROR_TRACE("method \"%s\" not found.", vm->allMethodNames.datas[index].str);
+
+            invokeFoundMethod:
             switch (method->methodType) {
                 case MT_PRIMITIVE:
+                    //原生方法可能分配内存或读写栈顶
+                    SPILL_ESP();
+                    bool succeeded = method->primFun(vm, args);
+                    RELOAD_ESP();
+
                     //如果返回值为true，则vm进行空间回收的工作
-                    if (method->primFun(vm, args))
+                    if (succeeded)
                         //args[0]是返回值，argNum-1是保留args[0]，args[0]的空间最终由返回值的接收者即函数的主调方回收
-                        curThread->esp -= argNum - 1;
+                        ESP -= argNum - 1;
                     else {
                         /*
                          * 如果返回false则说明有两种情况：
@@ -477,16 +1133,18 @@ DECODE {
                          * 2. 切换了线程，此时vm->curThread已经被切换为新的线程
                          * 保存线程的上下文环境，运行新线程之后还能回到当前老线程指令流的正确位置
                         */
-                        STORE_CUR_FRAME();
-
-                        if (!VALUE_IS_NULL(curThread->errorObj)) {
+                        //没有切换线程就是出错了，errorObj出错后一直保留，不能据它判断本次调用是否出错
+                        if (vm->curThread == curThread) {
                             if (VALUE_IS_OBJSTR(curThread->errorObj)) {
                                 ObjString *error = VALUE_TO_OBJSTR(curThread->errorObj);
                                 printf("%s", error->value.start);
                             }
                             //出错后将返回值置为NULL，避免主调方获取到错误的结果
+                            //参数也要像成功时一样回收，否则栈深度会超出校验时推演的上限
+                            ESP -= argNum - 1;
                             PEEK() = VT_TO_VALUE(VT_NULL);
                         }
+                        STORE_CUR_FRAME();
 
                         //如果没有待执行的线程，说明执行完毕
                         if (vm->curThread == NULL)
@@ -501,8 +1159,12 @@ DECODE {
 
                 case MT_SCRIPT:
                     STORE_CUR_FRAME();
+                    if (*ip == OPCODE_TAIL_RETURN)
+                        popFrameForTailCall(curThread, stackStart, argNum);
                     createFrame(vm, curThread, (ObjClosure *) method->obj, argNum);
                     LOAD_CUR_FRAME() //加载最新的frame
+                    COUNT_CALL()
+                    CHECK_QUOTA()
                     break;
 
                 case MT_FUN_CALL:
@@ -510,30 +1172,116 @@ DECODE {
                     ObjFun *objFun = VALUE_TO_OBJCLOSURE(args[0])->fun;
                     //-1是去掉实例self
                     if (argNum - 1 < objFun->argNum)
-                        RUN_ERROR("arguments less.");
+                        RUN_ERROR_TRACE("arguments less.");
 
                     STORE_CUR_FRAME();
+                    if (*ip == OPCODE_TAIL_RETURN)
+                        popFrameForTailCall(curThread, stackStart, argNum);
                     createFrame(vm, curThread, VALUE_TO_OBJCLOSURE(args[0]), argNum);
                     LOAD_CUR_FRAME() //加载最新的frame
+                    COUNT_CALL()
+                    CHECK_QUOTA()
                     break;
 
                 default:
                     NOT_REACHED()
             }
+            //被调函数或调用返回后的主调函数有机器码时转入机器码
+            ENTER_JIT()
+            LOOP();
+        }
+
+        CASE(CALL_NUM):
+            //快速化后的CALLx，调用点只见过数字receiver
+            //指令流同CALLx：2字节的method索引，2字节的内联缓存索引
+            ip += 2;
+            inlineCache = &fun->inlineCaches[READ_SHORT()];
+            argNum = inlineCache->argNum;
+            args = ESP - argNum;
+            if (!VALUE_IS_NUM(args[0]) || inlineCache->epoch != vm->methodEpoch)
+                goto deQuicken;
+            method = &inlineCache->entries[0].method;
+            goto invokeFoundMethod;
+
+        CASE(CALL_OBJ):
+            //快速化后的CALLx，调用点只见过一种类的对象receiver
+            ip += 2;
+            inlineCache = &fun->inlineCaches[READ_SHORT()];
+            argNum = inlineCache->argNum;
+            args = ESP - argNum;
+            if (!VALUE_IS_OBJ(args[0]) || OBJ_CLASS(VALUE_TO_OBJ(args[0])) != inlineCache->entries[0].class ||
+                inlineCache->epoch != vm->methodEpoch)
+                goto deQuicken;
+            method = &inlineCache->entries[0].method;
+            goto invokeFoundMethod;
+
+            deQuicken:
+            //守卫失败，把指令还原为快速化之前的指令并重新执行，之后由它按多态调用点处理
+            ip -= 5;
+            *ip = inlineCache->genericOpCode;
+            LOOP();
+
+        CASE(CALL_CLOSURE0):
+        CASE(CALL_CLOSURE1):
+        CASE(CALL_CLOSURE2):
+        CASE(CALL_CLOSURE3):
+        CASE(CALL_CLOSURE4):
+        CASE(CALL_CLOSURE5):
+        CASE(CALL_CLOSURE6):
+        CASE(CALL_CLOSURE7):
+        CASE(CALL_CLOSURE8):
+        CASE(CALL_CLOSURE9):
+        CASE(CALL_CLOSURE10):
+        CASE(CALL_CLOSURE11):
+        CASE(CALL_CLOSURE12):
+        CASE(CALL_CLOSURE13):
+        CASE(CALL_CLOSURE14):
+        CASE(CALL_CLOSURE15):
+        CASE(CALL_CLOSURE16): {
+            //编译器为f.call(...)生成的调用，指令流同CALLx：2字节的method索引，2字节的内联缓存索引
+            argNum = opCode - OPCODE_CALL_CLOSURE0 + 1;
+            args = ESP - argNum;
+
+            //receiver不是闭包时按对应的CALLx查找call方法
+            if (!VALUE_IS_OBJCLOSURE(args[0])) {
+                opCode = opCode - OPCODE_CALL_CLOSURE0 + OPCODE_CALL0;
+                goto callMethod;
+            }
+
+            //与MT_FUN_CALL相同，只是省去了在funClass中查找call方法
+            ObjClosure *closure = VALUE_TO_OBJCLOSURE(args[0]);
+            if (argNum - 1 < closure->fun->argNum)
+                RUN_ERROR_TRACE("arguments less.");
+
+            ip += 4;
+            STORE_CUR_FRAME();
+            if (*ip == OPCODE_TAIL_RETURN)
+                popFrameForTailCall(curThread, stackStart, argNum);
+            createFrame(vm, curThread, closure, argNum);
+            LOAD_CUR_FRAME()
+            COUNT_CALL()
+            CHECK_QUOTA()
+            ENTER_JIT()
             LOOP();
         }
 
         CASE(LOAD_UPVALUE):
             //指令流：1字节的upvalue索引
 
-            PUSH(*((curFrame->closure->upvalues[READ_BYTE()])->localVarPtr));
+            PUSH(*(curFrame->closure->upvalues[READ_BYTE()].upvalue->localVarPtr));
             LOOP();
 
         CASE(STORE_UPVALUE):
             //栈顶：upvalue值
             //指令流：1字节的upvalue索引
 
-            *((curFrame->closure->upvalues[READ_BYTE()])->localVarPtr) = PEEK();
+            *(curFrame->closure->upvalues[READ_BYTE()].upvalue->localVarPtr) = PEEK();
+            LOOP();
+
+        CASE(LOAD_CAPTURED):
+            //指令流：1字节的upvalue索引，该upvalue按值捕获，值就存在闭包中
+
+            PUSH(curFrame->closure->upvalues[READ_BYTE()].value);
             LOOP();
 
         CASE(LOAD_MODULE_VAR):
@@ -553,9 +1301,8 @@ DECODE {
             //指令流：1字节的field索引
 
             uint8_t fieldIdx = READ_BYTE();
-            ASSERT(VALUE_IS_OBJINSTANCE(stackStart[0]), "receiver should be instance.");
+            CHECK_FIELD(stackStart[0], fieldIdx);
             ObjInstance *objInstance = VALUE_TO_OBJINSTANCE(stackStart[0]);
-            ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field.");
             objInstance->fields[fieldIdx] = PEEK();
             LOOP();
         }
@@ -566,9 +1313,8 @@ DECODE {
 
             uint8_t fieldIdx = READ_BYTE(); //获取待加载的字段索引
             Value receiver = POP(); //获取消息接收者
-            ASSERT(VALUE_IS_OBJINSTANCE(receiver), "receiver should be instance.");
+            CHECK_FIELD(receiver, fieldIdx);
             ObjInstance *objInstance = VALUE_TO_OBJINSTANCE(receiver);
-            ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field.");
             PUSH(objInstance->fields[fieldIdx]);
             LOOP();
         }
@@ -579,9 +1325,8 @@ DECODE {
 
             uint8_t fieldIdx = READ_BYTE(); //获取待加载的字段索引
             Value receiver = POP(); //获取消息接收者
-            ASSERT(VALUE_IS_OBJINSTANCE(receiver), "receiver should be instance.");
+            CHECK_FIELD(receiver, fieldIdx);
             ObjInstance *objInstance = VALUE_TO_OBJINSTANCE(receiver);
-            ASSERT(fieldIdx < objInstance->objHeader.class->fieldNum, "out of bounds field.");
             objInstance->fields[fieldIdx] = PEEK();
             LOOP();
         }
@@ -590,7 +1335,6 @@ DECODE {
             //指令流：2字节的跳转正偏移量
 
             int16_t offset = READ_SHORT();
-            ASSERT(offset > 0, "OPCODE_JUMP's operand must be positive.");
             ip += offset;
             LOOP();
         }
@@ -599,17 +1343,91 @@ DECODE {
             //指令流：2字节的跳转正偏移量
 
             int16_t offset = READ_SHORT();
-            ASSERT(offset > 0, "OPCODE_LOOP's operand must be positive.");
+            //先扣减配额再回跳，中止时ip仍在LOOP指令之后，调用栈报告回边所在的行
+            CHECK_QUOTA()
             ip -= offset;
+            COUNT_LOOP()
+            ENTER_JIT()
             LOOP();
         }
 
+        //超级指令，由编译器融合相邻的两条指令而来，执行完两条指令的功能后跳过后一条指令
+        CASE(LOAD_LOCAL_VAR_CONSTANT):
+            //指令流：1字节的局部变量索引，后接LOAD_CONSTANT指令
+            PUSH(stackStart[READ_BYTE()]);
+            ip++; //跳过LOAD_CONSTANT的操作码
+            PUSH(fun->constants.datas[READ_SHORT()]);
+            LOOP();
+
+        CASE(LOAD_LOCAL_VAR_LOCAL_VAR):
+            //指令流：1字节的局部变量索引，后接LOAD_LOCAL_VAR指令
+            PUSH(stackStart[READ_BYTE()]);
+            ip++;
+            PUSH(stackStart[READ_BYTE()]);
+            LOOP();
+
+        CASE(LOAD_MODULE_VAR_CONSTANT):
+            //指令流：2字节的模块变量索引，后接LOAD_CONSTANT指令
+            PUSH(fun->module->moduleVarValue.datas[READ_SHORT()]);
+            ip++;
+            PUSH(fun->constants.datas[READ_SHORT()]);
+            LOOP();
+
+        CASE(STORE_LOCAL_VAR_POP):
+            //指令流：1字节的局部变量索引，后接POP指令
+            stackStart[READ_BYTE()] = POP();
+            ip++; //跳过POP
+            LOOP();
+
+        CASE(STORE_MODULE_VAR_POP):
+            //指令流：2字节的模块变量索引，后接POP指令
+            fun->module->moduleVarValue.datas[READ_SHORT()] = POP();
+            ip++;
+            LOOP();
+
+            //比较并跳转
+            //指令流：同比较指令的操作数，后接JUMP_IF_FALSE指令
+            //操作数都是数字时比较结果不入栈，直接按结果跳转；否则按比较指令回退到方法调用，返回后再执行后面的JUMP_IF_FALSE
+#define COMPARE_JUMP_IF_FALSE(operator) { \
+            Value left = PEEK2(); \
+            Value right = PEEK(); \
+            if (!VALUE_IS_NUM(left) || !VALUE_IS_NUM(right)) { \
+                opCode = OPCODE_CALL1; \
+                goto callMethod; \
+            } \
+            ip += 5; /* 跳过方法名索引、内联缓存索引和JUMP_IF_FALSE的操作码 */ \
+            ESP -= 2; \
+            int16_t offset = READ_SHORT(); \
+            if (!(VALUE_TO_NUM(left) operator VALUE_TO_NUM(right))) \
+                ip += offset; \
+            LOOP(); \
+        }
+
+        CASE(LT_JUMP_IF_FALSE):
+        COMPARE_JUMP_IF_FALSE(<)
+
+        CASE(LE_JUMP_IF_FALSE):
+        COMPARE_JUMP_IF_FALSE(<=)
+
+        CASE(GT_JUMP_IF_FALSE):
+        COMPARE_JUMP_IF_FALSE(>)
+
+        CASE(GE_JUMP_IF_FALSE):
+        COMPARE_JUMP_IF_FALSE(>=)
+
+        CASE(EQ_JUMP_IF_FALSE):
+        COMPARE_JUMP_IF_FALSE(==)
+
+        CASE(NEQ_JUMP_IF_FALSE):
+        COMPARE_JUMP_IF_FALSE(!=)
+
+#undef COMPARE_JUMP_IF_FALSE
+
         CASE(JUMP_IF_FALSE): {
             //栈顶：跳转条件bool值
             //指令流：2字节的跳转偏移量
 
             int16_t offset = READ_SHORT();
-            ASSERT(offset > 0, "OPCODE_JUMP_IF_FALSE's operand must be positive.");
             Value condition = POP();
             if (VALUE_IS_FALSE(condition) || VALUE_IS_NULL(condition))
                 ip += offset;
@@ -621,7 +1439,6 @@ DECODE {
             //指令流：2字节的跳转偏移量
 
             int16_t offset = READ_SHORT();
-            ASSERT(offset > 0, "OPCODE_AND's operand must be positive.");
             Value condition = PEEK();
             if (VALUE_IS_FALSE(condition) || VALUE_IS_NULL(condition))
                 //若条件为假则不再计算and的右操作数，跳过右操作数的计算指令
@@ -637,7 +1454,6 @@ DECODE {
             //指令流：2字节的跳转偏移量
 
             int16_t offset = READ_SHORT();
-            ASSERT(offset > 0, "OPCODE_OR's operand must be positive.");
             Value condition = PEEK();
             if (VALUE_IS_FALSE(condition) || VALUE_IS_NULL(condition))
                 //若条件为假或空则执行右边的计算步骤，丢掉跳转条件
@@ -650,11 +1466,14 @@ DECODE {
         CASE(CLOSE_UPVALUE):
             //栈顶：相当于局部变量
             //把地址大于栈顶局部变量的upvalue关闭
-            closedUpvalue(curThread, curThread->esp - 1);
+            closedUpvalue(curThread, ESP - 1);
             DROP(); //弹出栈顶局部变量
             LOOP();
 
-        CASE(RETURN): {
+        CASE(TAIL_RETURN):
+            //被调方是原生方法等未能复用frame时，按普通的return返回
+        CASE(RETURN):
+        returnFromFrame: {
             //栈顶：返回值
 
             //获取返回值
@@ -688,16 +1507,20 @@ DECODE {
                 //将返回值置于运行时栈栈顶
                 stackStart[0] = retVal;
                 //回收堆栈：保留除结果所在的slot即stackStart[0]，其他全丢弃
+                //写回线程，下面加载frame时会重新读取
                 curThread->esp = stackStart + 1;
             }
             LOAD_CUR_FRAME()
+            ENTER_JIT()
             LOOP();
         }
 
         CASE(CONSTRUCT): {
             //栈底：stackStart[0]是class
 
-            ASSERT(VALUE_IS_CLASS(stackStart[0]), "stackStart[0] should be a class for OPCODE_CONSTRUCT.");
+            if (!VALUE_IS_CLASS(stackStart[0]))
+                RUN_ERROR_TRACE("constructor should be called on a class.");
+            SPILL_ESP();
 
             //将创建的类实例存储到stackStart[0]，即self
             ObjInstance *objInstance = newObjInstance(vm, VALUE_TO_CLASS(stackStart[0]));
@@ -712,21 +1535,35 @@ DECODE {
 
             //endCompileUnit已经将闭包函数添加进了常量表
             ObjFun *objFun = VALUE_TO_OBJFUN(fun->constants.datas[READ_SHORT()]);
+            SPILL_ESP();
+
+            //没有upvalue时每次创建的闭包都一样，共用一个，循环中创建的lambda就不再分配内存
+            if (objFun->upvalueNum == 0) {
+                if (objFun->sharedClosure == NULL)
+                    objFun->sharedClosure = newObjClosure(vm, objFun);
+                PUSH(OBJ_TO_VALUE(objFun->sharedClosure));
+                LOOP();
+            }
+
             ObjClosure *objClosure = newObjClosure(vm, objFun);
             //将创建好的闭包的value结构压到栈顶，后续会有函数如defineMethod从栈底取出
             //先将其压到栈中，后面再创建upvalue，这样可避免在创建upvalue过程中被GC
             PUSH(OBJ_TO_VALUE(objClosure));
+            SPILL_ESP();
             uint32_t idx = 0;
             while (idx < objFun->upvalueNum) {
                 //读入endCompileUnit函数最后为每个upvalue写入的数据对儿
                 uint8_t isEnclosingLocalVar = READ_BYTE();
                 uint8_t index = READ_BYTE();
 
-                if (isEnclosingLocalVar) //是直接外层的局部变量
+                if (isEnclosingLocalVar == CAPTURE_LOCAL_VAR) //是直接外层的局部变量
                     //创建upvalue
-                    objClosure->upvalues[idx] = createOpenUpvalue(vm, curThread, curFrame->stackStart + index);
+                    objClosure->upvalues[idx].upvalue = createOpenUpvalue(vm, curThread, curFrame->stackStart + index);
+                else if (isEnclosingLocalVar == CAPTURE_LOCAL_VAR_BY_VALUE)
+                    //该局部变量不会再被赋值，把值复制到闭包中，不必创建upvalue
+                    objClosure->upvalues[idx].value = curFrame->stackStart[index];
                 else
-                    //直接从父编译单元中继承
+                    //直接从父编译单元中继承，按值捕获的就复制其值
                     objClosure->upvalues[idx] = curFrame->closure->upvalues[index];
                 idx++;
             }
@@ -738,18 +1575,23 @@ DECODE {
             //栈顶：基类 次栈顶：子类名
 
             uint32_t fieldNum = READ_BYTE();
-            Value superClass = curThread->esp[-1]; //基类名
-            Value className = curThread->esp[-2]; //子类名
+            Value superClass = ESP[-1]; //基类名
+            Value className = ESP[-2]; //子类名
 
             //回收基类所占的栈空间，次栈顶的空间暂时保留，创建的类会直接用该空间
             DROP();
+            SPILL_ESP();
+
+            //类名来自常量表，长度受newClass中缓冲区的限制
+            if (!VALUE_IS_OBJSTR(className) || VALUE_TO_OBJSTR(className)->value.length > MAX_ID_LEN)
+                RUN_ERROR_TRACE("class name should be a string of at most %d bytes.", MAX_ID_LEN);
 
             //校验基类合法性，若不合法则停止运行
             validateSuperClass(vm, className, fieldNum, superClass);
             Class *class = newClass(vm, VALUE_TO_OBJSTR(className), fieldNum, VALUE_TO_CLASS(superClass));
 
-            //类存储于栈底
-            stackStart[0] = OBJ_TO_VALUE(class);
+            //类存储于原类名所在的slot，即栈顶
+            PEEK() = OBJ_TO_VALUE(class);
 
             LOOP();
         }
@@ -763,6 +1605,8 @@ DECODE {
             uint32_t methodNameIndex = READ_SHORT();
 
             //从栈顶中获得待绑定的类
+            if (!VALUE_IS_CLASS(PEEK()) || !VALUE_IS_OBJCLOSURE(PEEK2()))
+                RUN_ERROR_TRACE("method should be bound to a class.");
             Class *class = VALUE_TO_CLASS(PEEK());
 
             //从次栈顶中获得待绑定的方法，这是由OPCODE_CREATE_CLOSURE操作码生成后压到栈中的
@@ -771,6 +1615,7 @@ DECODE {
 //            printf("method:%u", method.type);
 //            printf("class:%s\n", class->name->value.start);
 
+            SPILL_ESP();
             bindMethodAndPatch(vm, opCode, methodNameIndex, class, method);
 
             DROP();
@@ -778,11 +1623,271 @@ DECODE {
             LOOP();
         }
 
+        //寄存器指令，由编译器在开启寄存器层时翻译而来，操作数是本帧运行时栈的slot编号
+        //寄存器指令不维护esp，执行栈式指令前由REG_SET_TOP同步
+        CASE(REG_SET_TOP):
+            //指令流：1字节的栈深度
+            ESP = stackStart + READ_BYTE();
+            LOOP();
+
+        CASE(REG_MOVE): {
+            //指令流：1字节的目的slot，1字节的源slot
+            uint8_t dst = READ_BYTE();
+            stackStart[dst] = stackStart[READ_BYTE()];
+            LOOP();
+        }
+
+        CASE(REG_LOAD_CONSTANT): {
+            //指令流：1字节的目的slot，2字节的常量索引
+            uint8_t dst = READ_BYTE();
+            stackStart[dst] = fun->constants.datas[READ_SHORT()];
+            LOOP();
+        }
+
+        CASE(REG_LOAD_NULL):
+            //指令流：1字节的目的slot
+            stackStart[READ_BYTE()] = VT_TO_VALUE(VT_NULL);
+            LOOP();
+
+        CASE(REG_LOAD_TRUE):
+            stackStart[READ_BYTE()] = VT_TO_VALUE(VT_TRUE);
+            LOOP();
+
+        CASE(REG_LOAD_FALSE):
+            stackStart[READ_BYTE()] = VT_TO_VALUE(VT_FALSE);
+            LOOP();
+
+        CASE(REG_LOAD_MODULE_VAR): {
+            //指令流：1字节的目的slot，2字节的模块变量索引
+            uint8_t dst = READ_BYTE();
+            stackStart[dst] = fun->module->moduleVarValue.datas[READ_SHORT()];
+            LOOP();
+        }
+
+        CASE(REG_STORE_MODULE_VAR): {
+            //指令流：2字节的模块变量索引，1字节的源slot
+            index = READ_SHORT();
+            fun->module->moduleVarValue.datas[index] = stackStart[READ_BYTE()];
+            LOOP();
+        }
+
+        CASE(REG_LOAD_UPVALUE): {
+            //指令流：1字节的目的slot，1字节的upvalue索引
+            uint8_t dst = READ_BYTE();
+            stackStart[dst] = *(curFrame->closure->upvalues[READ_BYTE()].upvalue->localVarPtr);
+            LOOP();
+        }
+
+        CASE(REG_STORE_UPVALUE): {
+            //指令流：1字节的upvalue索引，1字节的源slot
+            index = READ_BYTE();
+            *(curFrame->closure->upvalues[index].upvalue->localVarPtr) = stackStart[READ_BYTE()];
+            LOOP();
+        }
+
+        CASE(REG_LOAD_CAPTURED): {
+            //指令流：1字节的目的slot，1字节按值捕获的upvalue索引
+            uint8_t dst = READ_BYTE();
+            stackStart[dst] = curFrame->closure->upvalues[READ_BYTE()].value;
+            LOOP();
+        }
+
+            //寄存器运算指令
+            //指令流：1字节的目的slot，1或2个1字节的操作数slot，2字节的运算符方法名索引
+            //操作数不是数字时把它们放到目的slot起始处作为栈顶，按运算符方法调用，结果同样留在目的slot
+#define REG_CALL_METHOD() { \
+            stackStart[dst] = left; \
+            stackStart[dst + 1] = right; \
+            ESP = stackStart + dst + 2; \
+            argNum = 2; \
+            goto regCallMethod; \
+        }
+
+#define REG_BINARY_OP(expr) { \
+            uint8_t dst = READ_BYTE(); \
+            Value left = stackStart[READ_BYTE()]; \
+            Value right = stackStart[READ_BYTE()]; \
+            if (!VALUE_IS_NUM(left) || !VALUE_IS_NUM(right)) \
+                REG_CALL_METHOD() \
+            ip += 2; \
+            stackStart[dst] = (expr); \
+            LOOP(); \
+        }
+
+#define REG_NUM_OP(type, operator) REG_BINARY_OP(type##_TO_VALUE(VALUE_TO_NUM(left) operator VALUE_TO_NUM(right)))
+
+#define REG_BIT_OP(operator) \
+        REG_BINARY_OP(NUM_TO_VALUE((uint32_t) VALUE_TO_NUM(left) operator (uint32_t) VALUE_TO_NUM(right)))
+
+        CASE(REG_ADD):
+        REG_NUM_OP(NUM, +)
+
+        CASE(REG_SUB):
+        REG_NUM_OP(NUM, -)
+
+        CASE(REG_MUL):
+        REG_NUM_OP(NUM, *)
+
+        CASE(REG_DIV):
+        REG_NUM_OP(NUM, /)
+
+        CASE(REG_MOD):
+        REG_BINARY_OP(NUM_TO_VALUE(fmod(VALUE_TO_NUM(left), VALUE_TO_NUM(right))))
+
+        CASE(REG_LT):
+        REG_NUM_OP(BOOL, <)
+
+        CASE(REG_LE):
+        REG_NUM_OP(BOOL, <=)
+
+        CASE(REG_GT):
+        REG_NUM_OP(BOOL, >)
+
+        CASE(REG_GE):
+        REG_NUM_OP(BOOL, >=)
+
+        CASE(REG_EQ):
+        REG_NUM_OP(BOOL, ==)
+
+        CASE(REG_NEQ):
+        REG_NUM_OP(BOOL, !=)
+
+        CASE(REG_BIT_AND):
+        REG_BIT_OP(&)
+
+        CASE(REG_BIT_OR):
+        REG_BIT_OP(|)
+
+        CASE(REG_BIT_SHIFT_LEFT):
+        REG_BIT_OP(<<)
+
+        CASE(REG_BIT_SHIFT_RIGHT):
+        REG_BIT_OP(>>)
+
+        CASE(REG_NEG): {
+            uint8_t dst = READ_BYTE();
+            Value operand = stackStart[READ_BYTE()];
+            if (!VALUE_IS_NUM(operand)) {
+                stackStart[dst] = operand;
+                ESP = stackStart + dst + 1;
+                argNum = 1;
+                goto regCallMethod;
+            }
+            ip += 2;
+            stackStart[dst] = NUM_TO_VALUE(-VALUE_TO_NUM(operand));
+            LOOP();
+        }
+
+        CASE(REG_BIT_NOT): {
+            uint8_t dst = READ_BYTE();
+            Value operand = stackStart[READ_BYTE()];
+            if (!VALUE_IS_NUM(operand)) {
+                stackStart[dst] = operand;
+                ESP = stackStart + dst + 1;
+                argNum = 1;
+                goto regCallMethod;
+            }
+            ip += 2;
+            stackStart[dst] = NUM_TO_VALUE(~(uint32_t) VALUE_TO_NUM(operand));
+            LOOP();
+        }
+
+        CASE(REG_JUMP_IF_FALSE): {
+            //指令流：1字节的条件slot，2字节的跳转偏移量
+            Value condition = stackStart[READ_BYTE()];
+            int16_t offset = READ_SHORT();
+            if (VALUE_IS_FALSE(condition) || VALUE_IS_NULL(condition))
+                ip += offset;
+            LOOP();
+        }
+
+            //寄存器比较并跳转
+            //指令流：同寄存器比较指令的操作数，后接以其目的slot为条件的REG_JUMP_IF_FALSE指令
+            //操作数都是数字时直接按比较结果跳转，否则按比较指令回退到方法调用，返回后再执行后面的REG_JUMP_IF_FALSE
+#define REG_COMPARE_JUMP_IF_FALSE(operator) { \
+            uint8_t dst = READ_BYTE(); \
+            Value left = stackStart[READ_BYTE()]; \
+            Value right = stackStart[READ_BYTE()]; \
+            if (!VALUE_IS_NUM(left) || !VALUE_IS_NUM(right)) \
+                REG_CALL_METHOD() \
+            ip += 4; /* 跳过方法名索引及REG_JUMP_IF_FALSE的操作码和条件slot */ \
+            int16_t offset = READ_SHORT(); \
+            if (!(VALUE_TO_NUM(left) operator VALUE_TO_NUM(right))) \
+                ip += offset; \
+            LOOP(); \
+        }
+
+        CASE(REG_LT_JUMP_IF_FALSE):
+        REG_COMPARE_JUMP_IF_FALSE(<)
+
+        CASE(REG_LE_JUMP_IF_FALSE):
+        REG_COMPARE_JUMP_IF_FALSE(<=)
+
+        CASE(REG_GT_JUMP_IF_FALSE):
+        REG_COMPARE_JUMP_IF_FALSE(>)
+
+        CASE(REG_GE_JUMP_IF_FALSE):
+        REG_COMPARE_JUMP_IF_FALSE(>=)
+
+        CASE(REG_EQ_JUMP_IF_FALSE):
+        REG_COMPARE_JUMP_IF_FALSE(==)
+
+        CASE(REG_NEQ_JUMP_IF_FALSE):
+        REG_COMPARE_JUMP_IF_FALSE(!=)
+
+#undef REG_CALL_METHOD
+#undef REG_BINARY_OP
+#undef REG_NUM_OP
+#undef REG_BIT_OP
+#undef REG_COMPARE_JUMP_IF_FALSE
+
+        CASE(REG_RETURN):
+            //指令流：1字节的返回值slot
+            //把返回值所在slot作为栈顶，按RETURN返回
+            ESP = stackStart + READ_BYTE() + 1;
+            goto returnFromFrame;
+
         CASE(END):
             NOT_REACHED()
     }
     NOT_REACHED()
 
+    quotaExceeded: {
+        //配额由整条调用链共用，用尽后主调线程也无法继续，按运行时错误中止本次执行的所有线程
+        if (!vm->isHeapExhausted)
+            RUN_ERROR_TRACE("instruction quota of %llu exhausted.", (unsigned long long) vm->config.instructionQuota);
+
+        //堆超过上限只中止当前线程，与Thread.abort一样把错误存入errorObj，主调线程可以由isDone和error得知
+        STORE_CUR_FRAME();
+        char errorMsg[64];
+        snprintf(errorMsg, sizeof(errorMsg), "heap size exceeds the limit of %llu bytes.",
+                 (unsigned long long) vm->config.maxHeapSize);
+        fprintf(stderr, "%s\n", errorMsg);
+        printStackTrace(curThread);
+
+        ObjThread *callerThread = curThread->caller;
+        abortThread(curThread);
+
+        //先清除标记并恢复剩余配额，构造错误信息时的分配不会再次触发中止
+        //分配可能触发gc，主调线程经vm->curThread保留，中止的线程经tmpRoots保留
+        vm->isHeapExhausted = false;
+        vm->instructionBudget = vm->suspendedBudget;
+        vm->curThread = callerThread;
+        pushTmpRoot(vm, (ObjHeader *) curThread);
+        curThread->errorObj = OBJ_TO_VALUE(newObjString(vm, errorMsg, strlen(errorMsg)));
+        popTmpRoot(vm);
+
+        //没有主调线程说明中止的是模块线程，返回错误由宿主处理
+        if (callerThread == NULL)
+            return VM_RESULT_ERROR;
+
+        //主调线程照常继续，被调线程的结果为null
+        curThread = callerThread;
+        curThread->esp[-1] = VT_TO_VALUE(VT_NULL);
+        LOAD_CUR_FRAME()
+        LOOP();
+    }
+
 #undef PUSH
 #undef POP
 #undef DROP
@@ -790,6 +1895,11 @@ DECODE {
 #undef PEEK2
 #undef LOAD_CUR_FRAME
 #undef STORE_CUR_FRAME
+#undef RUN_ERROR_TRACE
+#undef CHECK_QUOTA
 #undef READ_SHORT
 #undef READ_BYTE
+#undef DECODE
+#undef CASE
+#undef LOOP
 }
@@ -12,12 +12,22 @@
 
 #define MAX_TEMP_ROOTS_NUM 8
 
+typedef struct methodCacheEntry MethodCacheEntry; //全局方法查找缓存项，定义在class.h
+typedef struct bundle Bundle; //映射到内存的模块包，定义在cache.h
+
 #define OPCODE_SLOTS(opcode, effect) OPCODE_##opcode,
 typedef enum {
     #include "opcode.inc"
 } OpCode;
 #undef OPCODE_SLOTS
 
+//操作码的个数
+#define OPCODE_SLOTS(opcode, effect) + 1
+enum { OPCODE_NUM = 0
+    #include "opcode.inc"
+};
+#undef OPCODE_SLOTS
+
 typedef enum vmResult {
     VM_RESULT_SUCCESS,
     VM_RESULT_ERROR,
@@ -32,10 +42,17 @@ typedef struct {
 } Gray;
 
 typedef struct {
-    int heapGrowthFactor; //堆生长因子
+    double heapGrowthFactor; //堆生长因子
     uint32_t initialHeapSize; //初始堆大小，默认10MB
     uint32_t minHeapSize; //最小堆大小，默认1MB
     uint32_t nextGC; //第一次触发gc的堆大小，默认为initialHeapSize
+    bool useRegisterTier; //是否把编译出的指令流翻译为寄存器指令执行，默认为false
+    uint64_t instructionQuota; //每次执行模块可执行的回边和函数调用次数，模块中创建的线程和导入的模块共用，超过即中止执行，0表示不限制
+    uint64_t maxHeapSize; //堆的软上限，只在gc后检查，存活对象仍超过时在下一个回边或函数调用处中止当前线程，0表示不限制
+    bool useBytecodeCache; //是否为源码文件读写字节码缓存，默认为false
+#if ENABLE_JIT
+    bool useJit; //是否把热点函数编译为机器码，默认为true
+#endif
 } Configuration;
 
 struct vm {
@@ -65,7 +82,27 @@ struct vm {
     Gray grays;
     Configuration config;
 
+    uint32_t methodEpoch; //方法绑定的版本号，向查找过的类bindMethod后加1，使所有内联缓存失效
+    bool isMethodRebound; //有类重新定义了is(_)，此后OPCODE_IS都回退到方法调用
+    bool isHeapExhausted; //gc后堆仍超过上限，vm在下一个回边或函数调用处中止当前线程
+    uint64_t instructionBudget; //本次执行剩余的指令配额，每个回边和函数调用扣减1，所有线程共用
+    uint64_t suspendedBudget; //堆超过上限时gc把instructionBudget置为1以尽快中止当前线程，原有的剩余配额暂存于此
+
+    //全局方法查找缓存，以(类, 方法名索引)散列，命中时免去沿基类链查找
+    MethodCacheEntry *methodCache;
+
+    //打开的模块包，导入模块时先从中查找，没有时为NULL
+    Bundle *bundle;
+
     char *buildTime;
+
+#if PROFILE_PAIRS
+    //pairCounts[a * OPCODE_NUM + b]是融合前的指令流中指令a之后紧接着执行指令b的次数
+    uint64_t *pairCounts;
+    uint64_t dispatchNum; //解释器实际分派的次数，超级指令只计1次
+    uint64_t instrNum; //融合前的指令条数，执行了快速路径的超级指令计2条
+    uint32_t lastOpCode; //融合前上一条执行的指令，尚未执行指令时为OPCODE_NUM
+#endif
 };
 
 void initVM(VM *vm);
@@ -74,6 +111,10 @@ void freeVM(VM *vm);
 void pushTmpRoot(VM *vm, ObjHeader *obj);
 void popTmpRoot(VM *vm);
 void ensureStack(VM *vm, ObjThread *objThread, uint32_t neededSlots);
+void abortThread(ObjThread *objThread);
 VMResult executeInstruction(VM *vm, register ObjThread *curThread);
+#if PROFILE_PAIRS
+void dumpPairProfile(VM *vm);
+#endif
 
 #endif //STOVE_VM_H